@@ -0,0 +1,208 @@
+#ifndef _PYWM_UPDATE_H
+#define _PYWM_UPDATE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Once the server is ready, the Python side of the update (update,
+ * update_view, update_widget, ...) runs on a worker thread. The compositor
+ * publishes the state of its views upstream, the worker publishes the results
+ * downstream, both through triple buffers so neither side ever waits for the
+ * other. The compositor applies the newest downstream snapshot before every
+ * frame.
+ *
+ * Snapshots only hold state, skipping one does no harm. One-shot actions
+ * (creating and destroying widgets, pixels, pending view actions, ...) are
+ * queued instead, and applied in order together with their snapshot.
+ */
+
+/*
+ * Lock-free single-producer single-consumer triple buffer. Only the indices
+ * of three slots are managed, the slots themselves are owned by the user.
+ */
+struct _pywm_update_triple {
+    /* Owned by the writer */
+    int back;
+
+    /* Owned by the reader */
+    int front;
+
+    /* Slot in between, flagged if it has been published but not yet read */
+    atomic_int middle;
+};
+
+void _pywm_update_triple_init(struct _pywm_update_triple* triple);
+
+/* Writer: returns true if the slot received in exchange has never been read */
+bool _pywm_update_triple_publish(struct _pywm_update_triple* triple);
+
+/* Reader: returns true if front has been replaced by a newer slot */
+bool _pywm_update_triple_acquire(struct _pywm_update_triple* triple);
+
+
+/*
+ * Upstream: compositor -> worker
+ */
+struct _pywm_update_view_info {
+    long handle;
+    long parent_handle;
+    bool xwayland;
+    pid_t pid;
+
+    /* Owned by the snapshot */
+    char* title;
+    char* app_id;
+    char* role;
+
+    bool floating;
+
+    int min_w, max_w, min_h, max_h;
+    int offset_x, offset_y;
+    int width, height;
+
+    bool focused;
+    bool fullscreen;
+    bool maximized;
+    bool resizing;
+    bool inhibiting_idle;
+};
+
+struct _pywm_update_up {
+    unsigned int seq;
+
+    /* Predicted present time (CLOCK_MONOTONIC) and refresh, see wm::callback_update */
+    int64_t present_nsec;
+    int refresh_nsec;
+
+    struct _pywm_update_view_info* views;
+    int n_views;
+    int views_capacity;
+};
+
+/*
+ * Downstream: worker -> compositor
+ */
+struct _pywm_update_view {
+    long handle;
+
+    /* update_view returned a valid state */
+    bool valid;
+
+    double x, y, w, h;
+    double mask_x, mask_y, mask_w, mask_h;
+    double opacity;
+    double corner_radius;
+    int blur_passes;
+    double blur_radius;
+    int z_index;
+    int accepts_input;
+    int lock_enabled;
+};
+
+struct _pywm_update_widget {
+    long handle;
+
+    /* update_widget returned a valid state */
+    bool valid;
+
+    int lock_enabled;
+    double x, y, w, h;
+    double mask_x, mask_y, mask_w, mask_h;
+    double opacity;
+    int z_index;
+};
+
+struct _pywm_update_down {
+    /* Matches _pywm_update_actions::seq of the same update */
+    unsigned int seq;
+
+    /* update returned a valid state */
+    bool valid;
+
+    double lock_perc;
+
+    /* enum wm_update_state */
+    int update_state;
+    int deadline_msec;
+
+    struct _pywm_update_widget* widgets;
+    int n_widgets;
+    int widgets_capacity;
+
+    struct _pywm_update_view* views;
+    int n_views;
+    int views_capacity;
+};
+
+/*
+ * Downstream one-shot actions: worker -> compositor
+ */
+struct _pywm_update_view_actions {
+    long handle;
+
+    /* -1 for no-op */
+    int width_pending, height_pending;
+    int focus_pending;
+    int fullscreen_pending;
+    int maximized_pending;
+    int resizing_pending;
+    int close_pending;
+};
+
+struct _pywm_update_pixels {
+    long handle;
+    int stride, width, height;
+
+    /* Kept when the entry is reused, only grown */
+    unsigned char* pixels;
+    size_t pixels_capacity;
+};
+
+struct _pywm_update_actions {
+    unsigned int seq;
+
+    /* -1 for no-op */
+    int update_cursor;
+    bool terminate;
+
+    long* new_widgets;
+    int n_new_widgets;
+    int new_widgets_capacity;
+
+    long* destroy_widgets;
+    int n_destroy_widgets;
+    int destroy_widgets_capacity;
+
+    struct _pywm_update_pixels* pixels;
+    int n_pixels;
+    int pixels_capacity;
+
+    /* Only views with at least one action */
+    struct _pywm_update_view_actions* views;
+    int n_views;
+    int views_capacity;
+
+    struct _pywm_update_actions* next;
+};
+
+/* Grow *data to hold at least n elements of size */
+void _pywm_update_reserve(void** data, int* capacity, int n, size_t size);
+
+/* Register callback_update and callback_apply_update */
+void _pywm_update_init();
+
+/* Start / stop the worker, until started updates run synchronously */
+void _pywm_update_start();
+void _pywm_update_stop();
+
+/* View handle has been destroyed by the compositor, GIL must be held */
+void _pywm_update_view_destroyed(long handle);
+
+/* Whether update_view must not be called for handle anymore, GIL must be held */
+bool _pywm_update_is_view_destroyed(long handle, unsigned int seq);
+
+#endif
@@ -2,6 +2,12 @@
 #define _PYWM_VIEW_H
 
 struct wm_view;
+struct _pywm_update_view_info;
+struct _pywm_update_view;
+struct _pywm_update_up;
+struct _pywm_update_down;
+struct _pywm_update_view_actions;
+struct _pywm_update_actions;
 
 struct _pywm_view {
     long handle;
@@ -12,7 +18,15 @@ struct _pywm_view {
 
 void _pywm_view_init(struct _pywm_view* _view, struct wm_view* view);
 
-void _pywm_view_update(struct _pywm_view* view);
+/* Compositor thread: gather the state passed to update_view */
+void _pywm_view_collect(struct _pywm_view* view, struct _pywm_update_view_info* info);
+
+/* Any thread holding the GIL: call update_view and parse the result */
+void _pywm_view_call(const struct _pywm_update_view_info* info, struct _pywm_update_view* result, struct _pywm_update_actions* actions);
+
+/* Compositor thread: apply the parsed result */
+void _pywm_view_apply(struct _pywm_view* view, const struct _pywm_update_view* result);
+void _pywm_view_apply_actions(struct _pywm_view* view, const struct _pywm_update_view_actions* pending);
 
 struct _pywm_views {
     struct _pywm_view* first_view;
@@ -22,6 +36,11 @@ void _pywm_views_init();
 long _pywm_views_add(struct wm_view* view);
 long _pywm_views_get_handle(struct wm_view* view);
 long _pywm_views_remove(struct wm_view* view);
-void _pywm_views_update();
+struct _pywm_view* _pywm_views_container_from_handle(long handle);
+
+void _pywm_views_collect(struct _pywm_update_up* up);
+void _pywm_views_call(const struct _pywm_update_up* up, struct _pywm_update_down* down, struct _pywm_update_actions* actions);
+void _pywm_views_apply_actions(const struct _pywm_update_actions* actions);
+void _pywm_views_apply(const struct _pywm_update_down* down);
 
 #endif
@@ -2,6 +2,9 @@
 #define _PYWM_WIDGET_H
 
 struct wm_widget;
+struct _pywm_update_widget;
+struct _pywm_update_down;
+struct _pywm_update_actions;
 
 struct _pywm_widget {
     long handle;
@@ -10,19 +13,30 @@ struct _pywm_widget {
     struct _pywm_widget* next_widget;
 };
 
-void _pywm_widget_init(struct _pywm_widget* _widget, struct wm_widget* widget);
+void _pywm_widget_init(struct _pywm_widget* _widget, struct wm_widget* widget, long handle);
 
-void _pywm_widget_update(struct _pywm_widget* widget);
+/* Any thread holding the GIL: call update_widget(_pixels) and parse the result */
+void _pywm_widget_call(long handle, struct _pywm_update_widget* result, struct _pywm_update_actions* actions);
+
+/* Compositor thread: apply the parsed result */
+void _pywm_widget_apply(struct _pywm_widget* widget, const struct _pywm_update_widget* result);
 
 struct _pywm_widgets {
     struct _pywm_widget* first_widget;
 };
 
 void _pywm_widgets_init();
-long _pywm_widgets_add(struct wm_widget* widget);
+long _pywm_widgets_add(struct wm_widget* widget, long handle);
 long _pywm_widgets_get_handle(struct wm_widget* widgets);
 long _pywm_widgets_remove(struct wm_widget* widget);
-void _pywm_widgets_update();
+
+/*
+ * Handles are assigned by whoever runs the update (query_new_widget), the
+ * compositor creates and destroys the widgets once the actions are applied
+ */
+void _pywm_widgets_call(struct _pywm_update_down* down, struct _pywm_update_actions* actions);
+void _pywm_widgets_apply_actions(const struct _pywm_update_actions* actions);
+void _pywm_widgets_apply(const struct _pywm_update_down* down);
 
 struct _pywm_widget* _pywm_widgets_container_from_handle(long handle);
 struct wm_widget* _pywm_widgets_from_handle(long handle);
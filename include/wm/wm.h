@@ -3,6 +3,7 @@
 
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <wlr/types/wlr_keyboard.h>
 #include <wlr/types/wlr_pointer.h>
 
@@ -10,6 +11,18 @@ struct wm_view;
 struct wm_server;
 struct wm_layout;
 struct wm_widget;
+struct wm_output_frame;
+
+/*
+ * Result of callback_update: whether another update is needed without any
+ * new events (animating: within the next period of callback_frequency,
+ * deadline: after the given time)
+ */
+enum wm_update_state {
+    WM_UPDATE_IDLE = 0,
+    WM_UPDATE_ANIMATING = 1,
+    WM_UPDATE_DEADLINE = 2,
+};
 
 struct wm {
     struct wm_server* server;
@@ -28,8 +41,15 @@ struct wm {
     /* Once the server is ready, and we can create new threads */
     void (*callback_ready)(void);
 
-    /* Synchronous update once per frame */
-    void (*callback_update)(void);
+    /*
+     * Update once per frame, may hand off the work to another thread; gets
+     * the predicted time (CLOCK_MONOTONIC) at which the results will be on
+     * screen and the refresh interval of the default output (0 if unknown)
+     */
+    void (*callback_update)(int64_t present_nsec, int refresh_nsec);
+
+    /* Apply results of callback_update, see wm_request_apply_update */
+    void (*callback_apply_update)(void);
 };
 
 void wm_init();
@@ -42,6 +62,30 @@ void wm_update_cursor(int cursor_visible);
 
 void wm_set_locked(double locked);
 
+/*
+ * Thread-safe: have the compositor thread call wm_callback_apply_update()
+ * as soon as possible
+ */
+void wm_request_apply_update();
+
+/* Thread-safe: have callback_update called within the next period even if idle */
+void wm_request_update();
+
+void wm_set_update_state(enum wm_update_state state, int deadline_msec);
+
+/* Thread-safe: record spans, see wm_trace.h */
+void wm_set_tracing(bool enabled);
+
+/* Thread-safe: write the recorded spans as Chrome trace JSON */
+bool wm_dump_trace(const char* path);
+
+/*
+ * Thread-safe: recent frames of every output, oldest first, see
+ * wm_layout_frames
+ */
+void wm_frames(void (*callback)(const char* name, const struct wm_output_frame* frames, int n_frames, void* data),
+        void* data);
+
 struct wm_widget* wm_create_widget();
 void wm_destroy_widget(struct wm_widget* widget);
 
@@ -72,6 +116,7 @@ void wm_callback_destroy_view(struct wm_view* view);
 void wm_callback_view_event(struct wm_view* view, const char* event);
 
 void wm_callback_update();
+void wm_callback_apply_update();
 void wm_callback_ready();
 
 #endif
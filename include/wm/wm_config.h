@@ -19,6 +19,9 @@ struct wm_config {
     int output_height;
     int output_mHz;
 
+    /* All outputs but the default one show a copy of it, instead of extending the layout */
+    bool output_mirror;
+
     const char* xcursor_theme;
     int xcursor_size;
 
@@ -30,6 +33,17 @@ struct wm_config {
 
     bool encourage_csd;
 
+    /* Render just in time for the next vblank, with a margin (ms) adapted between min and max */
+    bool frame_scheduling;
+    double frame_margin_min;
+    double frame_margin_max;
+
+    /* Variable refresh rate on outputs supporting it, paced by fullscreen clients */
+    bool adaptive_sync;
+
+    /* Record spans from the start, see wm_trace.h */
+    bool trace;
+
     bool debug_f1;
 };
 
@@ -4,15 +4,17 @@
 #include <stdio.h>
 #include <wayland-server.h>
 #include <pixman.h>
+#include <wlr/types/wlr_box.h>
 #include <wlr/types/wlr_surface.h>
 #include <wlr/util/log.h>
 
 struct wm_output;
+struct wm_renderer_blur;
 
 struct wm_content_vtable;
 
 struct wm_content {
-    struct wl_list link;  // wm_server::wm_views
+    struct wl_list link;  // wm_server::wm_contents
     struct wm_server* wm_server;
 
     struct wm_content_vtable* vtable;
@@ -32,8 +34,28 @@ struct wm_content {
     int z_index;
     double opacity;
 
+    /* Blur whatever is behind the masked content (blur_passes == 0: none) */
+    int blur_passes;
+    double blur_radius;
+    struct wm_renderer_blur* blur;
+    struct wl_list blur_link;  // wm_server::blurred_contents, if blur_passes > 0
+
     /* Accepts input and is displayed clearly during lock - careful */
     bool lock_enabled;
+
+    /* Spatial index, see wm_grid */
+    bool grid_dirty;
+    struct wl_list grid_dirty_link;  // wm_grid::dirty
+    bool grid_indexed;
+    bool grid_large;
+    int grid_cells[4];  // x1, y1, x2, y2 (inclusive)
+    struct wlr_fbox grid_box;
+
+    /* Layout coordinates of the box and all surfaces, which may reach past it */
+    struct wlr_fbox bounds;
+
+    /* Position in wm_contents, index into wm_content_arrays */
+    int z_order;
 };
 
 void wm_content_init(struct wm_content* content, struct wm_server* server);
@@ -55,6 +77,11 @@ double wm_content_get_opacity(struct wm_content* content);
 
 void wm_content_set_lock_enabled(struct wm_content* content, bool lock_enabled);
 
+void wm_content_set_blur(struct wm_content* content, int passes, double radius);
+
+/* Area on output (output coordinates) whose blurred background is drawn */
+void wm_content_get_blur_box(struct wm_content* content, struct wm_output* output, struct wlr_fbox* box);
+
 struct wm_content_vtable {
     void (*destroy)(struct wm_content* content);
     void (*render)(struct wm_content* content, struct wm_output* output, pixman_region32_t* output_damage, struct timespec now);
@@ -63,6 +90,12 @@ struct wm_content_vtable {
     void (*damage_output)(struct wm_content* content, struct wm_output* output, struct wlr_surface* origin);
 
     void (*printf)(FILE* file, struct wm_content* content);
+
+    /*
+     * Add the part of the output covered by fully opaque pixels to region,
+     * regardless of content opacity - used for occlusion culling. May be NULL
+     */
+    void (*opaque_region)(struct wm_content* content, struct wm_output* output, pixman_region32_t* region);
 };
 
 static inline void wm_content_destroy(struct wm_content* content){
@@ -74,6 +107,9 @@ static inline void wm_content_render(struct wm_content* content, struct wm_outpu
 static inline void wm_content_damage_output(struct wm_content* content, struct wm_output* output, struct wlr_surface* origin){
     (*content->vtable->damage_output)(content, output, origin);
 }
+static inline void wm_content_opaque_region(struct wm_content* content, struct wm_output* output, pixman_region32_t* region){
+    if(content->vtable->opaque_region) (*content->vtable->opaque_region)(content, output, region);
+}
 static inline void wm_content_printf(FILE* file, struct wm_content* content){
     (*content->vtable->printf)(file, content);
 }
@@ -0,0 +1,75 @@
+#ifndef WM_CONTENT_ARRAYS_H
+#define WM_CONTENT_ARRAYS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pixman.h>
+
+struct wm_server;
+struct wm_content;
+
+/*
+ * Copies of the fields of all contents, in wm_contents order (topmost first),
+ * which the per-frame and per-motion loops filter on. Those loops scan the
+ * arrays and only dereference (and dispatch through the vtable of) the
+ * contents which pass. Rebuilt lazily once wm_contents has changed, the
+ * wm_content setters write through in between.
+ */
+enum wm_content_type {
+    WM_CONTENT_TYPE_OTHER = 0,
+    WM_CONTENT_TYPE_VIEW,
+    WM_CONTENT_TYPE_DRAG
+};
+
+#define WM_CONTENT_FLAG_LOCK_ENABLED (1 << 0)
+#define WM_CONTENT_FLAG_BLUR (1 << 1)
+
+struct wm_content_arrays {
+    int n;
+    int capacity;
+
+    /* contents_generation the arrays have been built for */
+    uint64_t generation;
+
+    struct wm_content** content;
+    double* x;
+    double* y;
+    double* width;
+    double* height;
+
+    /* wm_content::bounds, what output culling is based on */
+    double* bounds_x;
+    double* bounds_y;
+    double* bounds_width;
+    double* bounds_height;
+
+    /* Box clipped to the mask; only widgets are clipped by it as a whole */
+    double* mask_x;
+    double* mask_y;
+    double* mask_width;
+    double* mask_height;
+
+    double* opacity;
+    int* z_index;
+    uint8_t* flags;
+    uint8_t* type;
+
+    /*
+     * Per-frame scratch of the renderer, sized along with the arrays: indices
+     * of the contents left after culling and the damage handed to each of
+     * them. The regions stay initialised and are overwritten every frame
+     */
+    int* visible;
+    pixman_region32_t* damage;
+};
+
+void wm_content_arrays_init(struct wm_content_arrays* arrays);
+void wm_content_arrays_destroy(struct wm_content_arrays* arrays);
+
+/* Rebuild if necessary, after flushing wm_grid; also assigns wm_content::z_order */
+struct wm_content_arrays* wm_content_arrays_update(struct wm_server* server);
+
+/* Fields of content have changed */
+void wm_content_arrays_update_content(struct wm_content_arrays* arrays, struct wm_content* content);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef WM_GRID_H
+#define WM_GRID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_box.h>
+
+struct wm_server;
+struct wm_content;
+
+/*
+ * Spatial hash over the input boxes of views (layout coordinates), so that
+ * wm_server_surface_at only descends into the views near the cursor. Boxes
+ * cover all surfaces of a view including popups, and are recomputed lazily:
+ * changes only mark the content dirty (see wm_layout_damage_from). They also
+ * make up wm_content::bounds, which output culling is based on.
+ */
+#define WM_GRID_CELL_SIZE 256
+#define WM_GRID_BUCKETS 256
+
+/* Boxes spanning more cells are kept in a single list, checked on every query */
+#define WM_GRID_MAX_CELLS 256
+
+struct wm_grid_bucket {
+    struct wm_content** contents;
+    int n_contents;
+    int contents_capacity;
+};
+
+struct wm_grid {
+    struct wm_server* wm_server;
+
+    struct wm_grid_bucket buckets[WM_GRID_BUCKETS];
+    struct wm_grid_bucket large;
+
+    struct wl_list dirty;  // wm_content::grid_dirty_link
+
+    /* Result of wm_grid_query */
+    struct wm_grid_bucket result;
+
+    /* Incremented on every change affecting hit-testing, for results to be cached on */
+    uint64_t generation;
+};
+
+void wm_grid_init(struct wm_grid* grid, struct wm_server* server);
+void wm_grid_destroy(struct wm_grid* grid);
+
+/* Geometry or surfaces of content have changed */
+void wm_grid_mark_dirty(struct wm_grid* grid, struct wm_content* content);
+
+/* Recompute the boxes of content right away, if it is dirty */
+void wm_grid_update(struct wm_grid* grid, struct wm_content* content);
+
+/* Recompute the boxes of all dirty contents */
+void wm_grid_flush(struct wm_grid* grid);
+
+/* Something not reflected in the boxes has changed (e.g. map state, accepts_input) */
+void wm_grid_invalidate(struct wm_grid* grid);
+
+/* Content is destroyed */
+void wm_grid_remove(struct wm_grid* grid, struct wm_content* content);
+
+/*
+ * Views whose input box contains (x, y), in no particular order and possibly
+ * unmapped; *result is valid until the next query
+ */
+int wm_grid_query(struct wm_grid* grid, double x, double y, struct wm_content*** result);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef WM_LAYOUT_H
 #define WM_LAYOUT_H
 
+#include <pthread.h>
 #include <wayland-server.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
@@ -8,6 +9,7 @@
 struct wm_server;
 struct wm_view;
 struct wm_content;
+struct wm_output_frame;
 
 struct wm_layout {
     struct wm_server* wm_server;
@@ -18,11 +20,17 @@ struct wm_layout {
     int width;
     int height;
 
-    /* First registered output for now - multiple screens are not
-     * properly supported anyway - used to notify clients about 
-     * the output they are on */
+    /* First registered output, or the one named by output_name -
+     * drives updates, is mirrored by the others if output_mirror
+     * is set, and used to notify clients about the output they are on */
     struct wm_output* default_output;
 
+    /*
+     * Frame records of the outputs are read from other threads; this guards
+     * them as well as adding and removing outputs to wm_outputs
+     */
+    pthread_mutex_t frames_mutex;
+
     struct wl_listener change;
 };
 
@@ -35,6 +43,18 @@ void wm_layout_remove_output(struct wm_layout* layout, struct wm_output* output)
 /* Damage whole output layout */
 void wm_layout_damage_whole(struct wm_layout* layout);
 
+/* Damage whole output layout, but keep the contents behind the lock screen cached */
+void wm_layout_damage_lock(struct wm_layout* layout);
+
 void wm_layout_damage_from(struct wm_layout* layout, struct wm_content* content, struct wlr_surface* origin);
 
+/*
+ * Thread-safe: call callback for every output with its recent frames, oldest
+ * first. Called with frames_mutex held, so callback must not call back into
+ * the compositor.
+ */
+void wm_layout_frames(struct wm_layout* layout,
+        void (*callback)(const char* name, const struct wm_output_frame* frames, int n_frames, void* data),
+        void* data);
+
 #endif
@@ -1,11 +1,53 @@
 #ifndef WM_OUTPUT_H
 #define WM_OUTPUT_H
 
+#include <stdint.h>
 #include <wayland-server.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_damage.h>
 
 struct wm_layout;
+struct wm_renderer_lock_cache;
+struct wm_renderer_mirror;
+struct wm_renderer_stencil;
+
+#define WM_OUTPUT_RENDER_SAMPLES 32
+#define WM_OUTPUT_FRAMES 128
+
+enum wm_output_frame_flags {
+    WM_OUTPUT_FRAME_SCANOUT = 1 << 0,
+    WM_OUTPUT_FRAME_PRESENTED = 1 << 1,
+    WM_OUTPUT_FRAME_DISCARDED = 1 << 2,
+};
+
+/*
+ * Record of a committed frame. Fixed-width fields without padding, as these
+ * are handed to Python as they are, see PYWM_FRAME_DTYPE
+ */
+struct wm_output_frame {
+    uint64_t seq;
+
+    /* CLOCK_MONOTONIC, start of rendering and vblank the frame has been shown at */
+    int64_t start_nsec;
+    int64_t present_nsec;
+
+    /* Damaged pixels */
+    int64_t damage_area;
+
+    /* Contents actually drawn, enum wm_output_frame_flags */
+    int32_t n_contents;
+    int32_t flags;
+
+    /* Rendering up to the commit, and the commit itself */
+    int32_t render_usec;
+    int32_t commit_usec;
+
+    /* GL state changes issued and skipped as redundant, see wm_renderer_gl_state */
+    int32_t gl_issued;
+    int32_t gl_skipped;
+};
+
+_Static_assert(sizeof(struct wm_output_frame) == 56, "PYWM_FRAME_DTYPE out of sync");
 
 struct wm_output {
     struct wm_server* wm_server;
@@ -15,6 +57,71 @@ struct wm_output {
     struct wlr_output* wlr_output;
     struct wlr_output_damage* wlr_output_damage;
 
+    /* Position in layout coordinates, see wm_layout handle_change */
+    int layout_x;
+    int layout_y;
+
+    /* Stencil buffer for the framebuffers of this output, see wm_renderer_begin */
+    struct wm_renderer_stencil* stencil;
+
+    /* Contents behind the lock screen, while locked */
+    struct wm_renderer_lock_cache* lock_cache;
+
+    /* Output shown on this one instead of contents, see wm_layout update_mirrors */
+    struct wm_output* mirror_of;
+
+    /* Last frame, if other outputs mirror this one */
+    struct wm_renderer_mirror* mirror;
+
+    /* Last frame has been a client buffer attached directly */
+    bool scanout;
+
+    /* Frame scheduling, see handle_damage_frame */
+    struct wl_event_source* frame_timer;
+    bool frame_pending;
+
+    struct timespec last_present;
+    int refresh_nsec;
+
+    /* Recent render durations (ms) */
+    double render_msec[WM_OUTPUT_RENDER_SAMPLES];
+    int n_render_msec;
+    int render_msec_idx;
+
+    /* Safety margin (ms), grows on missed frames */
+    double frame_margin;
+    int frames_on_time;
+
+    /* Vblank the last scheduled frame was rendered for */
+    struct timespec frame_target;
+    bool frame_target_valid;
+
+    /* Variable refresh rate has been enabled successfully */
+    bool adaptive_sync;
+
+    /* Achieved intervals (ms) between presented frames, see present_metric */
+    int n_presents;
+    double present_interval_min;
+    double present_interval_max;
+    double present_interval_sum;
+    struct timespec present_metric_since;
+
+    /* Ring of recent frames, guarded by wm_layout::frames_mutex */
+    struct wm_output_frame frames[WM_OUTPUT_FRAMES];
+    int n_frames;
+    int frames_idx;
+    uint64_t frames_seq;
+
+    /* Oldest committed frame still waiting for its present event */
+    int n_frames_unpresented;
+
+    /*
+     * wlr_presentation_feedback* of the surfaces sampled for the frame being
+     * rendered, and of the committed frames awaiting their present event
+     */
+    struct wl_array feedbacks_pending;
+    struct wl_array feedbacks_committed;
+
     struct wl_listener destroy;
     struct wl_listener commit;
     struct wl_listener mode;
@@ -26,5 +133,18 @@ struct wm_output {
 void wm_output_init(struct wm_output* output, struct wm_server* server, struct wm_layout* layout, struct wlr_output* out);
 void wm_output_destroy(struct wm_output* output);
 
+/* Surface has been drawn into the frame being rendered, see wp_presentation */
+void wm_output_surface_sampled(struct wm_output* output, struct wlr_surface* surface);
+
+/*
+ * Vblank at which a frame using state computed at now will be presented at
+ * the earliest, and the refresh interval (0 if unknown)
+ */
+void wm_output_predict_present(struct wm_output* output, struct timespec now,
+                               int64_t* present_nsec, int* refresh_nsec);
+
+/* Whether the box (layout coordinates) is visible on output, never on mirrors */
+bool wm_output_intersects(struct wm_output* output, double x, double y, double width, double height);
+
 
 #endif
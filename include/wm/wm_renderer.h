@@ -2,32 +2,232 @@
 #define WM_RENDERER_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <wayland-server.h>
 #include <wlr/render/wlr_renderer.h>
 
 #define WM_CUSTOM_RENDERER
 
 struct wm_output;
+struct wm_renderer_blur;
+struct wm_renderer_lock_cache;
+struct wm_renderer_mirror;
+struct wm_renderer_stencil;
 
 #ifdef WM_CUSTOM_RENDERER
 
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+/*
+ * Shader variants are keyed by a bitmask of the features a draw actually
+ * needs, so e.g. an opaque unmasked surface only pays for a texture fetch
+ */
+enum wm_renderer_shader_feature {
+    WM_RENDERER_SHADER_ALPHA = 1 << 0,
+    WM_RENDERER_SHADER_MASK = 1 << 1,
+    WM_RENDERER_SHADER_CORNERS = 1 << 2,
+    WM_RENDERER_SHADER_LOCK = 1 << 3,
+
+    /* Samples GL_TEXTURE_EXTERNAL_OES, only compiled if supported */
+    WM_RENDERER_SHADER_EXTERNAL = 1 << 4,
+};
+
+#define WM_RENDERER_SHADER_VARIANTS (1 << 5)
+
 struct wm_renderer_shader {
     GLuint shader;
     GLint proj;
-    GLint invert_y;
     GLint tex;
-    GLint alpha;
-    GLint pos_attrib;
-    GLint tex_attrib;
-    GLint width;
-    GLint height;
-
-    GLint padding_l;
-    GLint padding_t;
-    GLint padding_r;
-    GLint padding_b;
-    GLint cornerradius;
-    GLint lock_perc;
+
+    /* Last value uploaded to proj, see wm_renderer_gl_state */
+    bool proj_valid;
+    GLfloat proj_value[9];
+};
+
+/*
+ * Shadow copy of the GL state touched by the batch, used to skip redundant
+ * calls within a frame. Reset in wm_renderer_begin, as wlroots changes the
+ * same state behind our back.
+ */
+struct wm_renderer_gl_state {
+    bool program_valid;
+    GLuint program;
+
+    bool texture_valid;
+    GLenum target;
+    GLuint tex;
+    bool external_bound;
+
+    bool array_buffer_valid;
+    GLuint array_buffer;
+
+    bool attribs_valid;
+    GLuint attribs;
+
+    /* Textures whose filters have been set this frame */
+    GLuint* filtered;
+    int n_filtered;
+    int filtered_capacity;
+};
+
+struct wm_renderer_gl_stats {
+    int issued;
+    int skipped;
+};
+
+/*
+ * Per-quad parameters are passed as vertex attributes so quads can be
+ * batched, see custom_tex_fragment_src
+ */
+struct wm_renderer_vertex {
+    GLfloat pos[2];
+    GLfloat texcoord[2];
+
+    /* Offset from the center of the visible rounded box */
+    GLfloat local[2];
+
+    /* Half width, half height, corner radius, alpha */
+    GLfloat rect[4];
+
+    GLfloat lock_perc;
+};
+
+struct wm_renderer_batch_run {
+    struct wm_renderer_shader* shader;
+    GLenum target;
+    GLuint tex;
+
+    /* GL_TEXTURE_MAG_FILTER tex is drawn with */
+    GLint filter;
+
+    int first;
+    int count;
+};
+
+struct wm_renderer_batch {
+    GLfloat proj[9];
+    bool stencil;
+
+    /* Region of the current target to be drawn, i.e. damage */
+    pixman_region32_t* clip;
+
+    struct wm_renderer_vertex* vertices;
+    int n_vertices;
+    int vertices_capacity;
+
+    struct wm_renderer_batch_run* runs;
+    int n_runs;
+    int runs_capacity;
+};
+
+#define WM_RENDERER_STENCIL_FBOS 4
+
+/*
+ * Stencil renderbuffer of one render target (wlroots framebuffers only come
+ * with a colour attachment). Shared by the framebuffers of an output's
+ * swapchain, attached to each of them once and only reallocated when the
+ * size changes.
+ */
+struct wm_renderer_stencil {
+    struct wl_list link; // wm_renderer::stencil_garbage
+
+    GLuint rbo;
+    int width;
+    int height;
+
+    /* Framebuffers rbo has been attached to, reset along with rbo */
+    GLuint fbos[WM_RENDERER_STENCIL_FBOS];
+    int n_fbos;
+
+    /* Attaching failed, don't try again until reallocated */
+    bool unsupported;
+};
+
+/*
+ * Contents behind the lock screen of one output, rendered without the lock
+ * effect. The effect is applied to the whole texture in a single pass, so as
+ * long as these contents do not change, they need not be rendered again.
+ */
+struct wm_renderer_lock_cache {
+    struct wl_list link; // wm_renderer::lock_cache_garbage
+
+    GLuint fbo;
+    GLuint tex;
+    int width;
+    int height;
+
+    /* Everything has to be rendered again, otherwise only damage (output coordinates) */
+    bool dirty;
+    pixman_region32_t damage;
+
+    struct wm_renderer_stencil stencil;
+
+    /* State of the output framebuffer while rendering into the cache */
+    GLint output_fbo;
+    bool output_stencil;
+    pixman_region32_t* output_clip;
+};
+
+/* Separate programs for the dual-Kawase blur passes, see wm_renderer_render_blur */
+struct wm_renderer_blur_shader {
+    GLuint shader;
+    GLint tex;
+    GLint halfpixel;
+    GLint offset;
+};
+
+#define WM_RENDERER_BLUR_MAX_PASSES 6
+
+/*
+ * Blurred background of a content on one output. Level 0 is a copy of the
+ * framebuffer behind the content and, after all passes, the result; level i
+ * is downsampled by 2^i.
+ */
+struct wm_renderer_blur {
+    struct wl_list link; // wm_renderer::blur_garbage
+
+    /* Same content on other outputs */
+    struct wm_renderer_blur* next;
+
+    bool dirty;
+
+    /* Framebuffer pixels the result has been taken from */
+    struct wm_output* output;
+    struct wlr_box fb_box;
+
+    int n_levels;
+    GLuint tex[WM_RENDERER_BLUR_MAX_PASSES + 1];
+    GLuint fbo[WM_RENDERER_BLUR_MAX_PASSES + 1];
+    int width[WM_RENDERER_BLUR_MAX_PASSES + 1];
+    int height[WM_RENDERER_BLUR_MAX_PASSES + 1];
+};
+
+/*
+ * Last frame of an output, drawn scaled onto the outputs mirroring it. Only
+ * the damaged part is copied every frame.
+ */
+struct wm_renderer_mirror {
+    struct wl_list link; // wm_renderer::mirror_garbage
+
+    GLuint tex;
+    int width;
+    int height;
+
+    /* The whole texture has been filled */
+    bool valid;
+
+    /* Size of the output in output coordinates */
+    int output_width;
+    int output_height;
+
+    /*
+     * Texture coordinates of the top left output corner and of the steps to
+     * the top right / bottom left corner, independent of the output transform
+     */
+    GLfloat origin[2];
+    GLfloat axis_x[2];
+    GLfloat axis_y[2];
 };
 
 #endif
@@ -39,27 +239,107 @@ struct wm_renderer {
     struct wm_output* current;
 
 #ifdef WM_CUSTOM_RENDERER
-    /* Custom shaders */
-    struct wm_renderer_shader shader_rgba;
-    struct wm_renderer_shader shader_rgbx;
+    /* Custom shaders, indexed by enum wm_renderer_shader_feature bitmask */
+    struct wm_renderer_shader shaders[WM_RENDERER_SHADER_VARIANTS];
+    struct wm_renderer_shader shader_solid;
+    struct wm_renderer_blur_shader shader_blur_down;
+    struct wm_renderer_blur_shader shader_blur_up;
+
+    /* Quads of the current frame, flushed in wm_renderer_end */
+    struct wm_renderer_batch batch;
+    GLuint vbo;
+    size_t vbo_size;
+
+    struct wm_renderer_gl_state gl_state;
 
-    struct wm_renderer_shader shader_blurred_rgba;
-    struct wm_renderer_shader shader_blurred_rgbx;
+    /* GL calls since wm_renderer_begin */
+    struct wm_renderer_gl_stats gl_stats;
+
+    /* Caches of destroyed contents / outputs, freed once a context is current */
+    struct wl_list stencil_garbage;
+    struct wl_list blur_garbage;
+    struct wl_list lock_cache_garbage;
+    struct wl_list mirror_garbage;
 #endif
 };
 
 void wm_renderer_init(struct wm_renderer *renderer, struct wm_server *server);
 void wm_renderer_destroy(struct wm_renderer *renderer);
 
-void wm_renderer_begin(struct wm_renderer *renderer, struct wm_output *output);
+void wm_renderer_begin(struct wm_renderer *renderer, struct wm_output *output,
+                       pixman_region32_t *damage);
+
+/* Free the stencil buffer of an output (created in wm_renderer_begin) once it is gone */
+void wm_renderer_destroy_stencil(struct wm_renderer *renderer, struct wm_renderer_stencil *stencil);
 void wm_renderer_end(struct wm_renderer *renderer, pixman_region32_t *damage,
                      struct wm_output *output);
+
+/* GL calls issued and skipped as redundant since wm_renderer_begin */
+void wm_renderer_get_gl_stats(struct wm_renderer *renderer, int32_t *issued, int32_t *skipped);
 void wm_renderer_render_texture_at(struct wm_renderer *renderer,
                                    pixman_region32_t *damage,
                                    struct wlr_texture *texture,
                                    struct wlr_box *box, double opacity,
-                                   double padding_l, double padding_t, double padding_r, double padding_b,
-                                   double corner_radius, double lock_perc);
+                                   struct wlr_fbox *mask,
+                                   double corner_radius);
+
+bool wm_renderer_texture_has_alpha(struct wlr_texture *texture);
+
+/* Fill region with color (replacing what has been drawn before) */
+void wm_renderer_clear_region(struct wm_renderer *renderer, pixman_region32_t *region,
+                              const float color[static 4]);
+
+/*
+ * Lock screen: if the cached contents of the current output are stale (or
+ * *cache is NULL, then it is created), returns true and sets region to what
+ * has to be rendered; these contents then end up in the cache instead of the
+ * output until wm_renderer_end_lock_cache
+ */
+bool wm_renderer_begin_lock_cache(struct wm_renderer *renderer,
+                                  struct wm_renderer_lock_cache **cache,
+                                  pixman_region32_t *damage, pixman_region32_t *region);
+void wm_renderer_end_lock_cache(struct wm_renderer *renderer, struct wm_renderer_lock_cache *cache);
+
+/* Draw cached contents with the lock effect applied */
+void wm_renderer_render_lock_cache(struct wm_renderer *renderer, struct wm_renderer_lock_cache *cache,
+                                   pixman_region32_t *damage, double lock_perc);
+
+/* Contents behind the lock screen have changed within region (output coordinates, NULL: everywhere) */
+void wm_renderer_invalidate_lock_cache(struct wm_renderer_lock_cache *cache, pixman_region32_t *region);
+
+/* Add the part of output showing the cached pixels in region, once the lock effect is applied, to damage */
+void wm_renderer_lock_effect_damage(struct wm_output *output, pixman_region32_t *region,
+                                    pixman_region32_t *damage);
+
+/* Free the cache once the lock screen or the output is gone */
+void wm_renderer_destroy_lock_cache(struct wm_renderer *renderer, struct wm_renderer_lock_cache *cache);
+
+/*
+ * Draw a blurred copy of what has been rendered behind the rounded box mask
+ * (output coordinates) so far. The blur is only recomputed if the cache for
+ * the current output in *blur is dirty (or missing, then it is created) -
+ * whoever invalidates it must damage the whole box, as everything behind has
+ * to be rendered again to take the copy.
+ */
+void wm_renderer_render_blur(struct wm_renderer *renderer, pixman_region32_t *damage,
+                             struct wm_renderer_blur **blur, struct wlr_fbox *mask,
+                             double corner_radius, double opacity, int passes,
+                             double radius);
+void wm_renderer_invalidate_blur(struct wm_renderer_blur *blur);
+void wm_renderer_destroy_blur(struct wm_renderer *renderer, struct wm_renderer_blur *blur);
+
+/*
+ * Mirroring: copy the damaged part of what has been rendered to the current
+ * output into *mirror (created if missing); to be called last before
+ * wm_renderer_end
+ */
+void wm_renderer_capture_mirror(struct wm_renderer *renderer, struct wm_renderer_mirror **mirror,
+                                pixman_region32_t *damage);
+
+/* Draw the captured frame onto the current output, scaled to fit */
+void wm_renderer_render_mirror(struct wm_renderer *renderer, struct wm_renderer_mirror *mirror,
+                               pixman_region32_t *damage);
+void wm_renderer_destroy_mirror(struct wm_renderer *renderer, struct wm_renderer_mirror *mirror);
 
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef WM_SERVER_H
 #define WM_SERVER_H
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <time.h>
 #include <wayland-server.h>
 #include <wlr/backend.h>
@@ -8,12 +10,31 @@
 #include <wlr/types/wlr_server_decoration.h>
 #include <wlr/types/wlr_xdg_decoration_v1.h>
 #include <wlr/types/wlr_idle_inhibit_v1.h>
+#include "wm/wm.h"
 
 struct wm_config;
 struct wm_seat;
 struct wm_layout;
 struct wm_renderer;
 struct wm_idle_inhibit;
+struct wm_grid;
+struct wm_surface_map;
+struct wm_content_arrays;
+
+/* Last result of wm_server_surface_at, valid as long as the generations match */
+struct wm_server_surface_at_memo {
+    bool valid;
+    double at_x;
+    double at_y;
+    uint64_t contents_generation;
+    uint64_t grid_generation;
+
+    struct wlr_surface* surface;
+    double sx;
+    double sy;
+    double scale_x;
+    double scale_y;
+};
 
 struct wm_server{
     struct wm_config* wm_config;
@@ -29,14 +50,42 @@ struct wm_server{
     struct wlr_xdg_decoration_manager_v1* wlr_xdg_decoration_manager;
     struct wlr_xwayland* wlr_xwayland;
     struct wlr_xcursor_manager* wlr_xcursor_manager;
+    struct wlr_presentation* wlr_presentation;
 
     struct wm_renderer* wm_renderer;
     struct wm_seat* wm_seat;
     struct wm_layout* wm_layout;
     struct wm_idle_inhibit* wm_idle_inhibit;
 
-    /* Sorted by z-index (highest first) */
+    /*
+     * Sorted by z-index (highest first), among equal z-index newest first;
+     * kept sorted on insert and in wm_content_set_z_index
+     */
     struct wl_list wm_contents;  // wm_content::link
+    int n_contents;
+
+    /* Contents with blur_passes > 0, see invalidate_blur in wm_layout.c */
+    struct wl_list blurred_contents;  // wm_content::blur_link
+
+    /* Incremented whenever wm_contents is changed, for caches to key on */
+    uint64_t contents_generation;
+
+    /* Input boxes of views, see wm_server_surface_at */
+    struct wm_grid* wm_grid;
+
+    /* Hot fields of wm_contents, see wm_content_arrays_update */
+    struct wm_content_arrays* wm_content_arrays;
+
+    struct wm_server_surface_at_memo surface_at_memo;
+
+    /* Owning view of every surface, see wm_server_view_for_surface */
+    struct wm_surface_map* wm_surface_map;
+
+    /*
+     * Incremented whenever surfaces of views are mapped, unmapped, moved
+     * or destroyed without a commit of their own, see wm_view_get_surfaces
+     */
+    uint64_t surfaces_generation;
 
     struct wl_listener new_input;
     struct wl_listener new_output;
@@ -48,8 +97,25 @@ struct wm_server{
 
     struct timespec last_callback_externally_sourced;
 
+    /*
+     * Only armed while the last update has not been idle, or something
+     * happened that Python might be interested in
+     */
     bool callback_timer_started;
+    bool callback_timer_armed;
+    struct timespec callback_timer_due;
     struct wl_event_source* callback_timer;
+    enum wm_update_state update_state;
+
+    /* Metric, logged about once per second */
+    int n_callback_timer_wakeups;
+    int n_callback_updates;
+    struct timespec callback_metric_since;
+
+    /* Written to from any thread, see wm_server_request_apply_update */
+    int wakeup_fd;
+    struct wl_event_source* wakeup_source;
+    atomic_bool update_requested;
 
     double lock_perc;
 };
@@ -61,7 +127,6 @@ void wm_server_surface_at(struct wm_server* server, double at_x, double at_y,
         struct wlr_surface** result, double* result_sx, double* result_sy, double* result_scale_x, double* result_scale_y);
 struct wm_view* wm_server_view_for_surface(struct wm_server* server, struct wlr_surface* surface);
 
-void wm_server_update_contents(struct wm_server* server);
 
 /* passes ownership to caller, no need to unregister, simply destroy */
 struct wm_widget* wm_server_create_widget(struct wm_server* server);
@@ -73,6 +138,18 @@ struct wm_widget* wm_server_create_widget(struct wm_server* server);
  */
 void wm_server_callback_update(struct wm_server* server);
 
+/* Thread-safe: wake up the event loop to call wm_callback_apply_update() */
+void wm_server_request_apply_update(struct wm_server* server);
+
+/* Make sure callback_timer ticks within the next period */
+void wm_server_schedule_update(struct wm_server* server);
+
+/* Thread-safe version of wm_server_schedule_update */
+void wm_server_request_update(struct wm_server* server);
+
+/* Result of the last update, decides whether callback_timer is re-armed */
+void wm_server_set_update_state(struct wm_server* server, enum wm_update_state state, int deadline_msec);
+
 void wm_server_set_locked(struct wm_server* server, double lock_perc);
 bool wm_server_is_locked(struct wm_server* server);
 
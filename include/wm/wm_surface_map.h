@@ -0,0 +1,39 @@
+#ifndef WM_SURFACE_MAP_H
+#define WM_SURFACE_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct wlr_surface;
+struct wm_view;
+
+/*
+ * Owning view of every surface (toplevel, popups, subsurfaces, xwayland
+ * children), see wm_server_view_for_surface. Open addressing with linear
+ * probing; kept up to date by wm_view_xdg.c and wm_view_xwayland.c.
+ */
+struct wm_surface_map_entry {
+    struct wlr_surface* surface;
+    struct wm_view* view;
+};
+
+struct wm_surface_map {
+    struct wm_surface_map_entry* entries;
+    size_t capacity;
+    size_t n_entries;
+};
+
+void wm_surface_map_init(struct wm_surface_map* map);
+void wm_surface_map_destroy(struct wm_surface_map* map);
+
+void wm_surface_map_insert(struct wm_surface_map* map, struct wlr_surface* surface, struct wm_view* view);
+
+/* Only if surface still belongs to view, surfaces might have been handed over */
+void wm_surface_map_remove(struct wm_surface_map* map, struct wlr_surface* surface, struct wm_view* view);
+
+/* All surfaces of view, once it is destroyed (its popups may outlive it) */
+void wm_surface_map_remove_view(struct wm_surface_map* map, struct wm_view* view);
+
+struct wm_view* wm_surface_map_get(struct wm_surface_map* map, struct wlr_surface* surface);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef WM_TRACE_H
+#define WM_TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Span tracing: every thread records begin / end events into its own ring,
+ * without locks, as long as tracing is enabled. While disabled, an event
+ * costs a single relaxed atomic load. Rings are allocated on the first event
+ * of a thread, and can be dumped at any time in the Chrome trace event format
+ * (chrome://tracing, ui.perfetto.dev).
+ *
+ * Names must be string literals (or otherwise outlive the trace).
+ */
+
+#define WM_TRACE_RING_SIZE (1 << 16)
+
+struct wm_trace_event {
+    int64_t nsec;
+    const char* name;
+    char phase;
+};
+
+extern atomic_bool wm_trace_enabled;
+
+static inline bool wm_trace_is_enabled(){
+    return __builtin_expect(atomic_load_explicit(&wm_trace_enabled, memory_order_relaxed), 0);
+}
+
+void wm_trace_set_enabled(bool enabled);
+
+/* Name shown for the calling thread, recorded once the thread traces */
+void wm_trace_set_thread_name(const char* name);
+
+void wm_trace_event(const char* name, char phase);
+
+#define WM_TRACE_BEGIN(name) do{ if(wm_trace_is_enabled()) wm_trace_event(name, 'B'); }while(0)
+#define WM_TRACE_END(name) do{ if(wm_trace_is_enabled()) wm_trace_event(name, 'E'); }while(0)
+
+/* Write all recorded events as Chrome trace JSON, returns false on failure */
+bool wm_trace_dump(const char* path);
+
+#endif
@@ -2,6 +2,7 @@
 #define WM_VIEW_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <wayland-server.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/types/wlr_xdg_decoration_v1.h>
@@ -12,6 +13,18 @@
 struct wm_seat;
 struct wm_view_vtable;
 
+/* Entry of the flattened surface tree, see wm_view_get_surfaces */
+struct wm_view_surface {
+    struct wlr_surface* surface;
+    struct wlr_texture* texture;
+
+    /* Offset and size in surface-local coordinates of the root surface */
+    int sx;
+    int sy;
+    int width;
+    int height;
+};
+
 struct wm_view {
     struct wm_content super;
 
@@ -21,6 +34,19 @@ struct wm_view {
 
     bool accepts_input;
 
+    /*
+     * Surfaces in rendering order, rebuilt once a surface of the view has
+     * committed or wm_server::surfaces_generation has changed
+     */
+    struct wm_view_surface* surfaces;
+    int n_surfaces;
+    int surfaces_capacity;
+    bool surfaces_dirty;
+    uint64_t surfaces_generation;
+
+    /* Outputs the surfaces have entered, see wm_view_update_outputs */
+    struct wl_array outputs;  // struct wm_output*
+
     /* Server-side determined states - stored from setter */
     bool focused;
     bool fullscreen;
@@ -31,10 +57,34 @@ struct wm_view {
 void wm_view_base_init(struct wm_view* view, struct wm_server* server);
 
 void wm_view_set_inhibiting_idle(struct wm_view* view, bool inhibiting_idle);
+void wm_view_set_accepts_input(struct wm_view* view, bool accepts_input);
 bool wm_view_is_inhibiting_idle(struct wm_view* view);
 
 bool wm_content_is_view(struct wm_content* content);
 
+/* A surface of view has committed */
+void wm_view_invalidate_surfaces(struct wm_view* view);
+
+/* Flattened surface tree, valid until the next event is dispatched */
+struct wm_view_surface* wm_view_get_surfaces(struct wm_view* view, int* n_surfaces);
+
+/*
+ * Send enter / leave to the surfaces of view for the outputs its bounds
+ * (have started or stopped to) intersect. Views not placed on any output
+ * yet are considered to be on the default one.
+ */
+void wm_view_update_outputs(struct wm_view* view);
+
+/* New surface of view, enters all outputs view is on */
+void wm_view_surface_enter(struct wm_view* view, struct wlr_surface* surface);
+
+/* Without sending leave: the surfaces (xwayland unmap) or output are gone */
+void wm_view_forget_outputs(struct wm_view* view);
+void wm_view_forget_output(struct wm_view* view, struct wm_output* output);
+
+/* Single opaque surface exactly covering output, which can be scanned out directly - or NULL */
+struct wlr_surface* wm_view_get_scanout_surface(struct wm_view* view, struct wm_output* output);
+
 struct wm_view_vtable {
     void (*destroy)(struct wm_view* view);
 
@@ -15,6 +15,9 @@ struct wm_xdg_subsurface {
 
     struct wlr_subsurface* wlr_subsurface;
 
+    /* Kept, as the toplevel might be destroyed first */
+    struct wm_server* wm_server;
+
     struct wl_list subsurfaces;
 
     struct wl_listener map;
@@ -35,6 +38,9 @@ struct wm_popup_xdg {
 
     struct wlr_xdg_popup* wlr_xdg_popup;
 
+    /* Kept, as the toplevel might be destroyed first */
+    struct wm_server* wm_server;
+
     struct wl_list popups;
     struct wl_list subsurfaces;
 
@@ -1,12 +1,17 @@
 from .pywm import (  # noqa F401
     PyWM,
+    PyWMOutput,
     PyWMDownstreamState,
     PYWM_MOD_CTRL,
     PYWM_MOD_ALT,
     PYWM_MOD_CAPS,
     PYWM_MOD_LOGO,
     PYWM_RELEASED,
-    PYWM_PRESSED
+    PYWM_PRESSED,
+    PYWM_FRAME_SCANOUT,
+    PYWM_FRAME_PRESENTED,
+    PYWM_FRAME_DISCARDED,
+    PYWM_FRAME_DTYPE
 )
 from .pywm_view import (  # noqa F401
     PyWMView,
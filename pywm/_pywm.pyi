@@ -2,3 +2,7 @@ from typing import Callable, Any
 
 def run(**kwargs: dict[str, Any]) -> None: ...
 def register(func: str, call: Callable[..., Any]) -> None: ...
+def request_update() -> None: ...
+def frames() -> list[tuple[str, bytes]]: ...
+def trace(enabled: bool) -> None: ...
+def trace_dump(path: str) -> bool: ...
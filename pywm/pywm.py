@@ -6,13 +6,19 @@ import time
 from threading import Thread, Lock
 from typing import Callable, Optional, Any, Type, TypeVar, Generic
 
+import numpy as np
+
 from .touchpad import TouchpadDaemon, GestureListener, Gesture
 from .pywm_widget import PyWMWidget
 from .pywm_view import PyWMView
 
 from ._pywm import (
     run,
-    register
+    register,
+    request_update,
+    frames as _frames,
+    trace as _trace,
+    trace_dump as _trace_dump
 )
 
 PYWM_MOD_SHIFT = 1
@@ -27,9 +33,46 @@ PYWM_MOD_MOD5 = 128
 PYWM_RELEASED = 0
 PYWM_PRESSED = 1
 
+PYWM_UPDATE_IDLE = 0
+PYWM_UPDATE_ANIMATING = 1
+PYWM_UPDATE_DEADLINE = 2
+
+PYWM_FRAME_SCANOUT = 1
+PYWM_FRAME_PRESENTED = 2
+PYWM_FRAME_DISCARDED = 4
+
+"""
+Layout of struct wm_output_frame: times in ns (CLOCK_MONOTONIC), durations in us,
+damage area in pixels
+"""
+PYWM_FRAME_DTYPE = np.dtype([
+    ('seq', '=u8'),
+    ('start', '=i8'),
+    ('present', '=i8'),
+    ('damage_area', '=i8'),
+    ('n_contents', '=i4'),
+    ('flags', '=i4'),
+    ('render', '=i4'),
+    ('commit', '=i4'),
+    ('gl_issued', '=i4'),
+    ('gl_skipped', '=i4'),
+])
+
 logger: logging.Logger = logging.getLogger(__name__)
 
 
+class PyWMOutput:
+    def __init__(self, name: str, pos: tuple[int, int], width: int, height: int, scale: float) -> None:
+        self.name = name
+        self.pos = pos
+        self.width = width
+        self.height = height
+        self.scale = scale
+
+    def __str__(self) -> str:
+        return "<PyWMOutput %s at %d, %d: %dx%d (%f)>" % (self.name, *self.pos, self.width, self.height, self.scale)
+
+
 class PyWMDownstreamState:
     def __init__(self, lock_perc: float=0.0) -> None:
         self.lock_perc = lock_perc
@@ -126,6 +169,11 @@ class PyWM(Generic[ViewT]):
         self._touchpad_captured = False
 
         self._down_state = PyWMDownstreamState()
+
+        """
+        Set from compositor callbacks, taken by _update on the update worker
+        """
+        self._pending_lock = Lock()
         self._damaged = False
 
         """
@@ -142,8 +190,16 @@ class PyWM(Generic[ViewT]):
         self.config: dict[str, Any] = kwargs
         self.width = 0
         self.height = 0
+        self.layout: list[PyWMOutput] = []
         self.modifiers = 0
 
+        """
+        Time (time.time()) at which the results of the running update will be on screen,
+        and refresh interval (seconds, 0 if unknown) of the default output
+        """
+        self.present_time: float = time.time()
+        self.refresh_interval: float = 0.
+
         self._idle_thread: PyWMIdleThread[ViewT] = PyWMIdleThread(self)
         self._idle_last_activity: float = time.time()
         self._idle_last_update_active: float = time.time()
@@ -254,11 +310,14 @@ class PyWM(Generic[ViewT]):
         return self.on_modifiers(self.modifiers)
 
     @callback
-    def _layout_change(self, width: int, height: int) -> None:
+    def _layout_change(self, width: int, height: int, outputs: list[tuple[str, int, int, int, int, float]]) -> None:
         logger.debug("PyWM layout change: %dx%d" % (width, height))
         self._update_idle()
         self.width = width
         self.height = height
+        self.layout = [PyWMOutput(name, (x, y), w, h, scale) for name, x, y, w, h, scale in outputs]
+        for o in self.layout:
+            logger.debug("  %s" % o)
         self.on_layout_change()
         
 
@@ -342,27 +401,38 @@ class PyWM(Generic[ViewT]):
         return None
 
     @callback
-    def _update(self) -> tuple[int, float, bool]:
-        if self._damaged:
-            self._damaged = False
-            self._down_state = self.process()
+    def _update(self, present_time: float, refresh_interval: float) -> tuple[int, float, bool, int, int]:
+        # Compositor clock is CLOCK_MONOTONIC (time.monotonic())
+        self.present_time = time.time() + present_time - time.monotonic()
+        self.refresh_interval = refresh_interval
 
-        res = self._down_state.get(
-            self._pending_update_cursor,
-            self._pending_terminate
-        )
+        with self._pending_lock:
+            processed, self._damaged = self._damaged, False
+            update_cursor, self._pending_update_cursor = self._pending_update_cursor, -1
+            terminate, self._pending_terminate = self._pending_terminate, False
 
-        self._pending_update_cursor = -1
-        self._pending_terminate = False
+        if processed:
+            self._down_state = self.process()
 
-        return res
+        res = self._down_state.get(update_cursor, terminate)
+
+        deadline = self.update_deadline()
+        if processed:
+            return res + (PYWM_UPDATE_ANIMATING, 0)
+        elif deadline is not None:
+            return res + (PYWM_UPDATE_DEADLINE, max(1, int(deadline * 1000.)))
+        else:
+            return res + (PYWM_UPDATE_IDLE, 0)
     
     def damage(self) -> None:
-        self._damaged = True
+        with self._pending_lock:
+            self._damaged = True
+        request_update()
 
     def widget_destroy(self, widget: PyWMWidget) -> None:
         self._widgets.pop(widget._handle, None)
         self._pending_destroy_widgets += [widget]
+        request_update()
 
     def _gesture(self, gesture: Gesture) -> None:
         self._update_idle()
@@ -396,19 +466,42 @@ class PyWM(Generic[ViewT]):
         if self._touchpad_daemon is not None:
             self._touchpad_daemon.stop()
         self._idle_thread.stop()
-        self._pending_terminate = True
+        with self._pending_lock:
+            self._pending_terminate = True
+        request_update()
 
     def create_widget(self, widget_class: Callable[..., WidgetT], *args: Any, **kwargs: Any) -> WidgetT:
         widget = widget_class(self, *args, **kwargs)
         self._pending_widgets += [widget]
+        request_update()
         return widget
 
     def update_cursor(self, enabled: bool=True) -> None:
-        self._pending_update_cursor = 0 if not enabled else 1
+        with self._pending_lock:
+            self._pending_update_cursor = 0 if not enabled else 1
+        request_update()
 
     def is_locked(self) -> bool:
         return self._down_state.lock_perc != 0.0
 
+    def frames(self) -> dict[str, np.ndarray]:
+        """
+        Recent frames per output name, oldest first, as structured arrays of PYWM_FRAME_DTYPE
+        """
+        return {name: np.frombuffer(data, dtype=PYWM_FRAME_DTYPE) for name, data in _frames()}
+
+    def trace(self, enabled: bool=True) -> None:
+        """
+        Record spans of rendering, damage, callbacks and client commits
+        """
+        _trace(enabled)
+
+    def trace_dump(self, path: str) -> bool:
+        """
+        Write recorded spans as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+        """
+        return _trace_dump(path)
+
     def round(self, x: float, y: float, w: float, h: float) -> tuple[float, float, float, float]:
         return (
             round(x * self.round_scale) / self.round_scale,
@@ -424,10 +517,18 @@ class PyWM(Generic[ViewT]):
     @abstractmethod
     def process(self) -> PyWMDownstreamState:
         """
-        return next down_state based on whatever state the implementation uses
+        return next down_state based on whatever state the implementation uses;
+        animations should be evaluated at self.present_time rather than now
         """
         pass
 
+    def update_deadline(self) -> Optional[float]:
+        """
+        seconds after which an update is required even if nothing has been damaged,
+        None to sleep until the next damage or event
+        """
+        return None
+
     def main(self) -> None:
         pass
 
@@ -4,6 +4,8 @@ from typing import TYPE_CHECKING, Optional, TypeVar, Generic, Any
 import logging
 from abc import abstractmethod
 
+from ._pywm import request_update
+
 # Python imports are great
 if TYPE_CHECKING:
     from .pywm import PyWM, ViewT
@@ -79,7 +81,8 @@ class PyWMViewDownstreamState:
                  z_index: int=0, box: tuple[float, float, float, float]=(0, 0, 0, 0),
                  mask: tuple[float, float, float, float]=(-1, -1, -1, -1),
                  opacity: float=1., corner_radius: float=0,
-                 accepts_input: bool=False, lock_enabled: bool=False, up_state: Optional[PyWMViewUpstreamState]=None) -> None:
+                 accepts_input: bool=False, lock_enabled: bool=False, up_state: Optional[PyWMViewUpstreamState]=None,
+                 blur: tuple[int, float]=(0, 0.)) -> None:
         """
         Just to be sure - wrap in type constructors
         """
@@ -91,6 +94,11 @@ class PyWMViewDownstreamState:
         self.accepts_input = accepts_input
         self.lock_enabled = lock_enabled
 
+        """
+        Blur behind the view: (passes, radius) - every pass halves the resolution
+        """
+        self.blur = (int(blur[0]), float(blur[1]))
+
         """
         Request size
         """
@@ -100,19 +108,20 @@ class PyWMViewDownstreamState:
             self.size = up_state.size
 
     def copy(self) -> PyWMViewDownstreamState:
-        res = PyWMViewDownstreamState(self.z_index, self.box, self.mask, self.opacity, self.corner_radius, self.accepts_input, self.lock_enabled)
+        res = PyWMViewDownstreamState(self.z_index, self.box, self.mask, self.opacity, self.corner_radius, self.accepts_input, self.lock_enabled, blur=self.blur)
         res.size = self.size
         return res
 
     def get(self, root: PyWM[ViewT],
             last_state: Optional[PyWMViewDownstreamState],
             focus: Optional[int], fullscreen: Optional[int], maximized: Optional[int], resizing: Optional[int], close: Optional[int]
-            ) -> tuple[tuple[float, float, float, float], tuple[float, float, float, float], float, float, int, bool, bool, tuple[int, int], int, int, int, int, int]:
+            ) -> tuple[tuple[float, float, float, float], tuple[float, float, float, float], float, float, tuple[int, float], int, bool, bool, tuple[int, int], int, int, int, int, int]:
         return (
             root.round(*self.box),
             self.mask,
             self.opacity,
             self.corner_radius,
+            self.blur,
             int(self.z_index),
             bool(self.accepts_input),
             bool(self.lock_enabled),
@@ -161,7 +170,7 @@ class PyWMView(Generic[PyWMT]):
                 offset_x: int, offset_y: int,
                 width: int, height: int,
                 is_focused: bool, is_fullscreen: bool, is_maximized: bool, is_resizing: bool, is_inhibiting_idle: bool
-                ) -> tuple[tuple[float, float, float, float], tuple[float, float, float, float], float, float, int, bool, bool, tuple[int, int], int, int, int, int, int]:
+                ) -> tuple[tuple[float, float, float, float], tuple[float, float, float, float], float, float, tuple[int, float], int, bool, bool, tuple[int, int], int, int, int, int, int]:
 
         if self.parent is None and parent_handle is not None:
             try:
@@ -241,21 +250,27 @@ class PyWMView(Generic[PyWMT]):
 
     def focus(self) -> None:
         self._down_action_focus = True
+        request_update()
 
     def set_resizing(self, val: bool) -> None:
         self._down_action_resizing = bool(val)
+        request_update()
 
     def set_fullscreen(self, val: bool) -> None:
         self._down_action_fullscreen = bool(val)
+        request_update()
 
     def set_maximized(self, val: bool) -> None:
         self._down_action_maximized = bool(val)
+        request_update()
 
     def close(self) -> None:
         self._down_action_close = True
+        request_update()
 
     def damage(self) -> None:
         self._damaged = True
+        request_update()
 
     
     """
@@ -267,7 +282,8 @@ class PyWMView(Generic[PyWMT]):
     @abstractmethod
     def process(self, up_state: PyWMViewUpstreamState) -> PyWMViewDownstreamState:
         """
-        return next down_state based on up_state (and whatever state the implementation uses)
+        return next down_state based on up_state (and whatever state the implementation uses);
+        animations should be evaluated at self.wm.present_time rather than now
         """
         pass
 
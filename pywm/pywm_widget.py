@@ -3,6 +3,8 @@ from typing import TYPE_CHECKING, TypeVar, Optional, Generic
 
 from abc import abstractmethod
 
+from ._pywm import request_update
+
 # Python imports are great
 if TYPE_CHECKING:
     from .pywm import PyWM, ViewT
@@ -61,16 +63,19 @@ class PyWMWidget(Generic[PyWMT]):
 
     def damage(self) -> None:
         self._damaged = True
+        request_update()
 
     def destroy(self) -> None:
         self.wm.widget_destroy(self)
 
     def set_pixels(self, stride: int, width: int, height: int, data: bytes) -> None:
         self._pending_pixels = (stride, width, height, data)
+        request_update()
 
     @abstractmethod
     def process(self) -> PyWMWidgetDownstreamState:
         """
-        return next down_state based on whatever state the implementation uses
+        return next down_state based on whatever state the implementation uses;
+        animations should be evaluated at self.wm.present_time rather than now
         """
         pass
@@ -5,8 +5,10 @@
 #include <wlr/util/log.h>
 #include "wm/wm.h"
 #include "wm/wm_layout.h"
+#include "wm/wm_output.h"
 #include "py/_pywm_callbacks.h"
 #include "py/_pywm_view.h"
+#include "py/_pywm_update.h"
 
 static struct _pywm_callbacks callbacks = { 0 };
 
@@ -41,7 +43,22 @@ static void call_void(PyObject* callable, PyObject* args){
 static void call_layout_change(struct wm_layout* layout){
     if(callbacks.layout_change){
         PyGILState_STATE gil = PyGILState_Ensure();
-        PyObject* args = Py_BuildValue("(ii)", layout->width, layout->height);
+
+        /* (name, x, y, width, height, scale) in layout coordinates, in order of appearance */
+        PyObject* outputs = PyList_New(0);
+        struct wm_output* output;
+        wl_list_for_each_reverse(output, &layout->wm_outputs, link){
+            if(output->mirror_of) continue;
+
+            int width, height;
+            wlr_output_effective_resolution(output->wlr_output, &width, &height);
+            PyObject* o = Py_BuildValue("(siiiid)", output->wlr_output->name,
+                    output->layout_x, output->layout_y, width, height, output->wlr_output->scale);
+            PyList_Append(outputs, o);
+            Py_XDECREF(o);
+        }
+
+        PyObject* args = Py_BuildValue("(iiN)", layout->width, layout->height, outputs);
         call_void(callbacks.layout_change, args);
         PyGILState_Release(gil);
     }
@@ -128,6 +145,7 @@ static void call_destroy_view(struct wm_view* view){
     if(callbacks.destroy_view){
         long handle = _pywm_views_remove(view);
         PyGILState_STATE gil = PyGILState_Ensure();
+        _pywm_update_view_destroyed(handle);
         PyObject* args = Py_BuildValue("(l)", handle);
         call_void(callbacks.destroy_view, args);
         PyGILState_Release(gil);
@@ -152,6 +170,9 @@ static void call_ready(){
         call_void(callbacks.ready, args);
         PyGILState_Release(gil);
     }
+
+    /* Now it is safe to create threads, see wm_server */
+    _pywm_update_start();
 }
 
 /*
@@ -0,0 +1,388 @@
+#include <Python.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+#include "wm/wm.h"
+#include "wm/wm_trace.h"
+#include "wm/wm_util.h"
+
+#include "py/_pywm_update.h"
+#include "py/_pywm_callbacks.h"
+#include "py/_pywm_view.h"
+#include "py/_pywm_widget.h"
+
+#define TRIPLE_FRESH 4
+#define TRIPLE_INDEX 3
+
+struct _pywm_update {
+    /* Compositor -> worker */
+    struct _pywm_update_triple up_triple;
+    struct _pywm_update_up up[3];
+    unsigned int up_seq;
+
+    /* Worker -> compositor */
+    struct _pywm_update_triple down_triple;
+    struct _pywm_update_down down[3];
+    unsigned int down_seq;
+
+    /* Worker -> compositor, one-shot actions; the one being filled by the worker */
+    struct _pywm_update_actions* actions;
+
+    /* Queued in order, and entries ready for reuse */
+    pthread_mutex_t actions_mutex;
+    struct _pywm_update_actions* actions_first;
+    struct _pywm_update_actions** actions_last;
+    struct _pywm_update_actions* actions_free;
+
+    /* View handles destroyed, but possibly still part of upstream snapshots; GIL */
+    struct {
+        long handle;
+        unsigned int seq;
+    }* destroyed;
+    int n_destroyed;
+    int destroyed_capacity;
+
+    bool worker_running;
+    pthread_t worker;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool worker_pending;
+    bool worker_stop;
+};
+
+static struct _pywm_update update = { 0 };
+
+/*
+ * Triple buffer
+ */
+void _pywm_update_triple_init(struct _pywm_update_triple* triple){
+    triple->back = 0;
+    atomic_init(&triple->middle, 1);
+    triple->front = 2;
+}
+
+bool _pywm_update_triple_publish(struct _pywm_update_triple* triple){
+    int prev = atomic_exchange(&triple->middle, triple->back | TRIPLE_FRESH);
+    triple->back = prev & TRIPLE_INDEX;
+    return prev & TRIPLE_FRESH;
+}
+
+bool _pywm_update_triple_acquire(struct _pywm_update_triple* triple){
+    if(!(atomic_load(&triple->middle) & TRIPLE_FRESH)){
+        return false;
+    }
+
+    int prev = atomic_exchange(&triple->middle, triple->front);
+    triple->front = prev & TRIPLE_INDEX;
+    return true;
+}
+
+/*
+ * Helpers
+ */
+void _pywm_update_reserve(void** data, int* capacity, int n, size_t size){
+    if(n <= *capacity){
+        return;
+    }
+
+    int new_capacity = *capacity ? *capacity : 4;
+    while(new_capacity < n) new_capacity *= 2;
+
+    *data = realloc(*data, new_capacity * size);
+    assert(*data);
+
+    /* Zero out, so elements owning memory start out with none */
+    memset((char*)(*data) + *capacity * size, 0, (new_capacity - *capacity) * size);
+    *capacity = new_capacity;
+}
+
+/*
+ * Actions queue
+ */
+
+/* Hand out an entry for the worker to fill, actions_mutex must be held */
+static struct _pywm_update_actions* actions_take(){
+    struct _pywm_update_actions* actions = update.actions_free;
+    if(actions){
+        update.actions_free = actions->next;
+    }else{
+        actions = calloc(1, sizeof(struct _pywm_update_actions));
+        assert(actions);
+    }
+
+    actions->next = NULL;
+    return actions;
+}
+
+static void actions_reset(struct _pywm_update_actions* actions, unsigned int seq){
+    actions->seq = seq;
+    actions->update_cursor = -1;
+    actions->terminate = false;
+    actions->n_new_widgets = 0;
+    actions->n_destroy_widgets = 0;
+    actions->n_pixels = 0;
+    actions->n_views = 0;
+}
+
+/* Queue the filled entry and replace it by a fresh one */
+static void actions_push(){
+    pthread_mutex_lock(&update.actions_mutex);
+    *update.actions_last = update.actions;
+    update.actions_last = &update.actions->next;
+    update.actions = actions_take();
+    pthread_mutex_unlock(&update.actions_mutex);
+}
+
+static void actions_apply(const struct _pywm_update_actions* actions){
+    if(actions->update_cursor >= 0){
+        wm_update_cursor(actions->update_cursor);
+    }
+
+    _pywm_widgets_apply_actions(actions);
+
+    _pywm_views_apply_actions(actions);
+
+    if(actions->terminate){
+        wm_terminate();
+    }
+}
+
+/* Apply all actions up to and including those of the snapshot seq */
+static void actions_drain(unsigned int seq){
+    pthread_mutex_lock(&update.actions_mutex);
+    struct _pywm_update_actions* first = update.actions_first;
+    struct _pywm_update_actions** last = &update.actions_first;
+    while(*last && (int)((*last)->seq - seq) <= 0){
+        last = &(*last)->next;
+    }
+    update.actions_first = *last;
+    if(!update.actions_first){
+        update.actions_last = &update.actions_first;
+    }
+    *last = NULL;
+    pthread_mutex_unlock(&update.actions_mutex);
+
+    if(!first) return;
+
+    /* Applied without the lock, so the worker is never held up */
+    struct _pywm_update_actions* actions;
+    for(actions = first; actions; actions = actions->next){
+        actions_apply(actions);
+    }
+
+    pthread_mutex_lock(&update.actions_mutex);
+    *last = update.actions_free;
+    update.actions_free = first;
+    pthread_mutex_unlock(&update.actions_mutex);
+}
+
+/*
+ * Update
+ */
+
+/* Python side of the update, GIL must be held */
+static void run(){
+    _pywm_update_triple_acquire(&update.up_triple);
+    const struct _pywm_update_up* up = &update.up[update.up_triple.front];
+    struct _pywm_update_down* down = &update.down[update.down_triple.back];
+    struct _pywm_update_actions* actions = update.actions;
+
+    down->seq = ++update.down_seq;
+    down->valid = false;
+    actions_reset(actions, down->seq);
+
+    WM_TRACE_BEGIN("update");
+    PyObject* args = Py_BuildValue("(dd)", up->present_nsec / 1000000000., up->refresh_nsec / 1000000000.);
+    PyObject* res = PyObject_Call(_pywm_callbacks_get_all()->update, args, NULL);
+    Py_XDECREF(args);
+    WM_TRACE_END("update");
+
+    int terminate;
+    if(!res || !PyArg_ParseTuple(res,
+                "idpii",
+                &actions->update_cursor,
+                &down->lock_perc,
+                &terminate,
+                &down->update_state,
+                &down->deadline_msec)){
+        PyErr_SetString(PyExc_TypeError, "Cannot parse query return");
+        actions->update_cursor = -1;
+    }else{
+        down->valid = true;
+        actions->terminate = terminate;
+    }
+    Py_XDECREF(res);
+
+
+    _pywm_widgets_call(down, actions);
+
+    _pywm_views_call(up, down, actions);
+
+
+    /* Actions first, they must be queued once the snapshot can be acquired */
+    actions_push();
+
+    /* Should the compositor have been too slow, only state is lost */
+    _pywm_update_triple_publish(&update.down_triple);
+}
+
+static void* worker(void* data){
+    wlr_log(WLR_DEBUG, "Update: Worker started");
+    wm_trace_set_thread_name("update worker");
+
+    pthread_mutex_lock(&update.mutex);
+    for(;;){
+        while(!update.worker_pending && !update.worker_stop){
+            pthread_cond_wait(&update.cond, &update.mutex);
+        }
+        if(update.worker_stop){
+            break;
+        }
+        update.worker_pending = false;
+        pthread_mutex_unlock(&update.mutex);
+
+        WM_TRACE_BEGIN("worker_gil");
+        PyGILState_STATE gil = PyGILState_Ensure();
+        WM_TRACE_END("worker_gil");
+
+        WM_TRACE_BEGIN("worker_run");
+        run();
+        WM_TRACE_END("worker_run");
+        PyGILState_Release(gil);
+
+        wm_request_apply_update();
+
+        pthread_mutex_lock(&update.mutex);
+    }
+    pthread_mutex_unlock(&update.mutex);
+
+    wlr_log(WLR_DEBUG, "Update: Worker stopped");
+    return NULL;
+}
+
+/*
+ * Callbacks
+ */
+static void handle_update(int64_t present_nsec, int refresh_nsec){
+    /* Publish the current state of the views... */
+    struct _pywm_update_up* up = &update.up[update.up_triple.back];
+    up->seq = ++update.up_seq;
+    up->present_nsec = present_nsec;
+    up->refresh_nsec = refresh_nsec;
+    _pywm_views_collect(up);
+    _pywm_update_triple_publish(&update.up_triple);
+
+    /* ...and have the worker pick it up */
+    if(update.worker_running){
+        pthread_mutex_lock(&update.mutex);
+        update.worker_pending = true;
+        pthread_cond_signal(&update.cond);
+        pthread_mutex_unlock(&update.mutex);
+        return;
+    }
+
+    PyGILState_STATE gil = PyGILState_Ensure();
+    run();
+    PyGILState_Release(gil);
+
+    wm_callback_apply_update();
+}
+
+static void handle_apply_update(){
+    if(!_pywm_update_triple_acquire(&update.down_triple)){
+        return;
+    }
+
+    const struct _pywm_update_down* down = &update.down[update.down_triple.front];
+
+    /* Including those of skipped snapshots; before the state, which may refer to new widgets */
+    actions_drain(down->seq);
+
+    if(down->valid){
+        wm_set_locked(down->lock_perc);
+        wm_set_update_state(down->update_state, down->deadline_msec);
+    }else{
+        /* Keep polling until Python behaves */
+        wm_set_update_state(WM_UPDATE_ANIMATING, 0);
+    }
+
+    _pywm_widgets_apply(down);
+
+    _pywm_views_apply(down);
+}
+
+/*
+ * Public interface
+ */
+void _pywm_update_init(){
+    _pywm_update_triple_init(&update.up_triple);
+    _pywm_update_triple_init(&update.down_triple);
+
+    pthread_mutex_init(&update.mutex, NULL);
+    pthread_cond_init(&update.cond, NULL);
+
+    pthread_mutex_init(&update.actions_mutex, NULL);
+    update.actions_first = NULL;
+    update.actions_last = &update.actions_first;
+    update.actions_free = NULL;
+    update.actions = actions_take();
+
+    get_wm()->callback_update = &handle_update;
+    get_wm()->callback_apply_update = &handle_apply_update;
+}
+
+void _pywm_update_start(){
+    if(update.worker_running) return;
+
+    update.worker_pending = false;
+    update.worker_stop = false;
+    if(pthread_create(&update.worker, NULL, &worker, NULL)){
+        wlr_log(WLR_ERROR, "Update: Could not start worker, updating synchronously");
+        return;
+    }
+
+    update.worker_running = true;
+}
+
+void _pywm_update_stop(){
+    if(!update.worker_running) return;
+
+    pthread_mutex_lock(&update.mutex);
+    update.worker_stop = true;
+    pthread_cond_signal(&update.cond);
+    pthread_mutex_unlock(&update.mutex);
+
+    pthread_join(update.worker, NULL);
+    update.worker_running = false;
+}
+
+void _pywm_update_view_destroyed(long handle){
+    _pywm_update_reserve((void**)&update.destroyed, &update.destroyed_capacity,
+            update.n_destroyed + 1, sizeof(*update.destroyed));
+
+    /* Every snapshot up to the current one might contain handle */
+    update.destroyed[update.n_destroyed].handle = handle;
+    update.destroyed[update.n_destroyed].seq = update.up_seq;
+    update.n_destroyed++;
+}
+
+bool _pywm_update_is_view_destroyed(long handle, unsigned int seq){
+    bool result = false;
+    for(int i=0; i<update.n_destroyed; i++){
+        /* Newer snapshots won't contain the handle anymore */
+        if(update.destroyed[i].seq < seq){
+            update.destroyed[i--] = update.destroyed[--update.n_destroyed];
+            continue;
+        }
+
+        if(update.destroyed[i].handle == handle){
+            result = true;
+        }
+    }
+
+    return result;
+}
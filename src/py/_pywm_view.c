@@ -1,15 +1,18 @@
 #include <Python.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "wm/wm.h"
 #include "wm/wm_view.h"
 #include "wm/wm_view_xwayland.h"
+#include "wm/wm_trace.h"
 #include "wm/wm_util.h"
 
 #include "py/_pywm_view.h"
 #include "py/_pywm_callbacks.h"
+#include "py/_pywm_update.h"
 
 static struct _pywm_views views = { 0 };
 
@@ -22,131 +25,150 @@ void _pywm_view_init(struct _pywm_view* _view, struct wm_view* view){
     _view->next_view = NULL;
 }
 
-void _pywm_view_update(struct _pywm_view* view){
+static void set_string(char** target, const char* value){
+    if(!value){
+        free(*target);
+        *target = NULL;
+        return;
+    }
+
+    /* Mostly unchanged from the last time this slot has been used */
+    if(*target && !strcmp(*target, value)){
+        return;
+    }
+
+    free(*target);
+    *target = strdup(value);
+}
+
+void _pywm_view_collect(struct _pywm_view* view, struct _pywm_update_view_info* info){
+    info->handle = view->handle;
 
     /* General info */
-    long parent_handle = 0;
+    info->parent_handle = 0;
     struct wm_view* parent = wm_view_get_parent(view->view);
     if(parent){
-        parent_handle = _pywm_views_get_handle(parent);
+        info->parent_handle = _pywm_views_get_handle(parent);
     }
-    int is_floating = wm_view_is_floating(view->view);
+    info->floating = wm_view_is_floating(view->view);
 
-    pid_t pid;
     uid_t uid;
     gid_t gid;
-    wm_view_get_credentials(view->view, &pid, &uid, &gid);
+    wm_view_get_credentials(view->view, &info->pid, &uid, &gid);
 
     const char* title;
     const char* app_id; 
     const char* role;
     wm_view_get_info(view->view, &title, &app_id, &role);
+    set_string(&info->title, title);
+    set_string(&info->app_id, app_id);
+    set_string(&info->role, role);
 
-    bool xwayland = wm_view_is_xwayland(view->view);
+    info->xwayland = wm_view_is_xwayland(view->view);
 
     /* Current info */
-    int min_w, max_w, min_h, max_h;
-    wm_view_get_size_constraints(view->view, &min_w, &max_w, &min_h, &max_h);
+    wm_view_get_size_constraints(view->view, &info->min_w, &info->max_w, &info->min_h, &info->max_h);
+    wm_view_get_offset(view->view, &info->offset_x, &info->offset_y);
+    wm_view_get_size(view->view, &info->width, &info->height);
+
+    info->focused = wm_view_is_focused(view->view);
+    info->fullscreen = wm_view_is_fullscreen(view->view);
+    info->maximized = wm_view_is_maximized(view->view);
+    info->resizing = wm_view_is_resizing(view->view);
 
-    int offset_x, offset_y;
-    wm_view_get_offset(view->view, &offset_x, &offset_y);
+    info->inhibiting_idle = wm_view_is_inhibiting_idle(view->view);
+}
+
+static void reset_view_actions(struct _pywm_update_view_actions* pending){
+    pending->width_pending = -1;
+    pending->height_pending = -1;
+    pending->focus_pending = -1;
+    pending->fullscreen_pending = -1;
+    pending->maximized_pending = -1;
+    pending->resizing_pending = -1;
+    pending->close_pending = -1;
+}
 
-    int width, height;
-    wm_view_get_size(view->view, &width, &height);
+static bool has_view_actions(const struct _pywm_update_view_actions* pending){
+    return (pending->width_pending > 0 && pending->height_pending > 0) ||
+        pending->focus_pending != -1 ||
+        pending->fullscreen_pending != -1 ||
+        pending->maximized_pending != -1 ||
+        pending->resizing_pending != -1 ||
+        pending->close_pending != -1;
+}
 
-    int is_focused = wm_view_is_focused(view->view);
-    int is_fullscreen = wm_view_is_fullscreen(view->view);
-    int is_maximized = wm_view_is_maximized(view->view);
-    int is_resizing = wm_view_is_resizing(view->view);
+void _pywm_view_call(const struct _pywm_update_view_info* info, struct _pywm_update_view* result, struct _pywm_update_actions* actions){
+    result->handle = info->handle;
+    result->valid = false;
 
-    int is_inhibiting_idle = wm_view_is_inhibiting_idle(view->view);
+    /* Only queued if there is any */
+    _pywm_update_reserve((void**)&actions->views, &actions->views_capacity,
+            actions->n_views + 1, sizeof(struct _pywm_update_view_actions));
+    struct _pywm_update_view_actions* pending = &actions->views[actions->n_views];
+    pending->handle = info->handle;
+    reset_view_actions(pending);
 
     PyObject* args = Py_BuildValue(
             "(llOissOsiiiiiiiiOOOOO)",
 
-            view->handle,
-            parent_handle,
-            xwayland ? Py_True : Py_False,
-            pid,
-            app_id,
-            role,
+            info->handle,
+            info->parent_handle,
+            info->xwayland ? Py_True : Py_False,
+            info->pid,
+            info->app_id,
+            info->role,
 
-            is_floating ? Py_True : Py_False,
-            title,
+            info->floating ? Py_True : Py_False,
+            info->title,
 
-            min_w,
-            max_w,
-            min_h,
-            max_h,
+            info->min_w,
+            info->max_w,
+            info->min_h,
+            info->max_h,
 
-            offset_x,
-            offset_y,
-            width,
-            height,
+            info->offset_x,
+            info->offset_y,
+            info->width,
+            info->height,
 
-            is_focused ? Py_True : Py_False,
-            is_fullscreen ? Py_True : Py_False,
-            is_maximized ? Py_True : Py_False,
-            is_resizing ? Py_True : Py_False,
-            is_inhibiting_idle ? Py_True : Py_False);
+            info->focused ? Py_True : Py_False,
+            info->fullscreen ? Py_True : Py_False,
+            info->maximized ? Py_True : Py_False,
+            info->resizing ? Py_True : Py_False,
+            info->inhibiting_idle ? Py_True : Py_False);
 
 
     PyObject* res = PyObject_Call(_pywm_callbacks_get_all()->update_view, args, NULL);
     Py_XDECREF(args);
 
     if(res && res != Py_None){
-        double x, y, w, h;
-        double opacity;
-        double mask_x, mask_y, mask_w, mask_h;
-        double corner_radius;
-        int focus_pending, resizing_pending, fullscreen_pending, maximized_pending, close_pending;
-        int width_pending, height_pending;
-        int accepts_input, z_index;
-        int lock_enabled;
-        
         if(!PyArg_ParseTuple(res, 
-                    "(dddd)(dddd)ddipp(ii)iiiii",
-                    &x, &y, &w, &h,
-                    &mask_x, &mask_y, &mask_w, &mask_h,
-                    &opacity,
-                    &corner_radius,
-
-                    &z_index,
-                    &accepts_input,
-                    &lock_enabled,
-
-                    &width_pending, &height_pending,
-                    &focus_pending,
-                    &fullscreen_pending,
-                    &maximized_pending,
-                    &resizing_pending,
-                    &close_pending
+                    "(dddd)(dddd)dd(id)ipp(ii)iiiii",
+                    &result->x, &result->y, &result->w, &result->h,
+                    &result->mask_x, &result->mask_y, &result->mask_w, &result->mask_h,
+                    &result->opacity,
+                    &result->corner_radius,
+                    &result->blur_passes, &result->blur_radius,
+
+                    &result->z_index,
+                    &result->accepts_input,
+                    &result->lock_enabled,
+
+                    &pending->width_pending, &pending->height_pending,
+                    &pending->focus_pending,
+                    &pending->fullscreen_pending,
+                    &pending->maximized_pending,
+                    &pending->resizing_pending,
+                    &pending->close_pending
         )){
             fprintf(stderr, "Error parsing update view return...\n");
             PyErr_SetString(PyExc_TypeError, "Cannot parse update_view return");
         }else{
-
-            wm_content_set_opacity(&view->view->super, opacity);
-            wm_content_set_mask(&view->view->super, mask_x, mask_y, mask_w, mask_h);
-            wm_content_set_corner_radius(&view->view->super, corner_radius);
-            if(w >= 0.0 && h >= 0.0)
-                wm_content_set_box(&view->view->super, x, y, w, h);
-            if(width_pending > 0 && height_pending > 0)
-                wm_view_request_size(view->view, width_pending, height_pending);
-            if(focus_pending != -1 && focus_pending)
-                wm_focus_view(view->view);
-            if(resizing_pending != -1)
-                wm_view_set_resizing(view->view, resizing_pending);
-            if(fullscreen_pending != -1)
-                wm_view_set_fullscreen(view->view, fullscreen_pending);
-            if(maximized_pending != -1)
-                wm_view_set_maximized(view->view, maximized_pending);
-            if(close_pending != -1 && close_pending)
-                wm_view_request_close(view->view);
-            wm_content_set_z_index(&view->view->super, z_index);
-            wm_content_set_lock_enabled(&view->view->super, lock_enabled);
-
-            view->view->accepts_input = accepts_input;
+            result->valid = true;
+            if(has_view_actions(pending)){
+                actions->n_views++;
+            }
         }
 
     }
@@ -154,6 +176,36 @@ void _pywm_view_update(struct _pywm_view* view){
     Py_XDECREF(res);
 }
 
+void _pywm_view_apply(struct _pywm_view* view, const struct _pywm_update_view* result){
+    if(result->valid){
+        wm_content_set_opacity(&view->view->super, result->opacity);
+        wm_content_set_mask(&view->view->super, result->mask_x, result->mask_y, result->mask_w, result->mask_h);
+        wm_content_set_corner_radius(&view->view->super, result->corner_radius);
+        wm_content_set_blur(&view->view->super, result->blur_passes, result->blur_radius);
+        if(result->w >= 0.0 && result->h >= 0.0)
+            wm_content_set_box(&view->view->super, result->x, result->y, result->w, result->h);
+        wm_content_set_z_index(&view->view->super, result->z_index);
+        wm_content_set_lock_enabled(&view->view->super, result->lock_enabled);
+
+        wm_view_set_accepts_input(view->view, result->accepts_input);
+    }
+}
+
+void _pywm_view_apply_actions(struct _pywm_view* view, const struct _pywm_update_view_actions* pending){
+    if(pending->width_pending > 0 && pending->height_pending > 0)
+        wm_view_request_size(view->view, pending->width_pending, pending->height_pending);
+    if(pending->focus_pending != -1 && pending->focus_pending)
+        wm_focus_view(view->view);
+    if(pending->resizing_pending != -1)
+        wm_view_set_resizing(view->view, pending->resizing_pending);
+    if(pending->fullscreen_pending != -1)
+        wm_view_set_fullscreen(view->view, pending->fullscreen_pending);
+    if(pending->maximized_pending != -1)
+        wm_view_set_maximized(view->view, pending->maximized_pending);
+    if(pending->close_pending != -1 && pending->close_pending)
+        wm_view_request_close(view->view);
+}
+
 long _pywm_views_add(struct wm_view* view){
     struct _pywm_view* it;
     for(it = views.first_view; it && it->next_view; it=it->next_view);
@@ -204,11 +256,60 @@ long _pywm_views_get_handle(struct wm_view* view){
     return 0;
 }
 
-void _pywm_views_update(){
-    TIMER_START(views_update);
+struct _pywm_view* _pywm_views_container_from_handle(long handle){
+    for(struct _pywm_view* it = views.first_view; it; it=it->next_view){
+        if(it->handle == handle) return it;
+    }
+
+    return NULL;
+}
+
+void _pywm_views_collect(struct _pywm_update_up* up){
+    int n = 0;
+    for(struct _pywm_view* view=views.first_view; view; view=view->next_view) n++;
+
+    _pywm_update_reserve((void**)&up->views, &up->views_capacity, n, sizeof(struct _pywm_update_view_info));
+
+    up->n_views = 0;
     for(struct _pywm_view* view=views.first_view; view; view=view->next_view){
-        _pywm_view_update(view);
+        _pywm_view_collect(view, &up->views[up->n_views++]);
+    }
+}
+
+void _pywm_views_call(const struct _pywm_update_up* up, struct _pywm_update_down* down, struct _pywm_update_actions* actions){
+    WM_TRACE_BEGIN("update_views");
+    _pywm_update_reserve((void**)&down->views, &down->views_capacity, up->n_views, sizeof(struct _pywm_update_view));
+
+    down->n_views = 0;
+    for(int i=0; i<up->n_views; i++){
+        /* Snapshot might be older than the destruction of the view */
+        if(_pywm_update_is_view_destroyed(up->views[i].handle, up->seq)){
+            continue;
+        }
+
+        _pywm_view_call(&up->views[i], &down->views[down->n_views++], actions);
+    }
+    WM_TRACE_END("update_views");
+}
+
+void _pywm_views_apply_actions(const struct _pywm_update_actions* actions){
+    for(int i=0; i<actions->n_views; i++){
+        struct _pywm_view* view = _pywm_views_container_from_handle(actions->views[i].handle);
+
+        /* Destroyed in the meantime */
+        if(!view) continue;
+
+        _pywm_view_apply_actions(view, &actions->views[i]);
+    }
+}
+
+void _pywm_views_apply(const struct _pywm_update_down* down){
+    for(int i=0; i<down->n_views; i++){
+        struct _pywm_view* view = _pywm_views_container_from_handle(down->views[i].handle);
+
+        /* Destroyed in the meantime */
+        if(!view) continue;
+
+        _pywm_view_apply(view, &down->views[i]);
     }
-    TIMER_STOP(views_update);
-    TIMER_PRINT(views_update);
 }
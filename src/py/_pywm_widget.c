@@ -1,6 +1,7 @@
 #include <Python.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <drm_fourcc.h>
 
@@ -8,73 +9,97 @@
 #include "wm/wm_widget.h"
 #include "py/_pywm_widget.h"
 #include "py/_pywm_callbacks.h"
+#include "py/_pywm_update.h"
+#include "wm/wm_trace.h"
 #include "wm/wm_util.h"
 
 static struct _pywm_widgets widgets = { 0 };
+
+/* Owned by whoever runs the update, see _pywm_widgets_call */
 static long next_handle = 1;
+static long* live_handles = NULL;
+static int n_live_handles = 0;
+static int live_handles_capacity = 0;
 
-void _pywm_widget_init(struct _pywm_widget* _widget, struct wm_widget* widget){
-    _widget->handle = (next_handle++);
+void _pywm_widget_init(struct _pywm_widget* _widget, struct wm_widget* widget, long handle){
+    _widget->handle = handle;
     _widget->widget = widget;
     _widget->next_widget = NULL;
 }
 
-void _pywm_widget_update(struct _pywm_widget* widget){
-    PyObject* args = Py_BuildValue("(l)", widget->handle);
+void _pywm_widget_call(long handle, struct _pywm_update_widget* result, struct _pywm_update_actions* actions){
+    result->handle = handle;
+    result->valid = false;
+
+    PyObject* args = Py_BuildValue("(l)", handle);
     PyObject* res = PyObject_Call(_pywm_callbacks_get_all()->update_widget, args, NULL);
     Py_XDECREF(args);
     if(res && res != Py_None){
-        double x, y, w, h;
-        double mask_x, mask_y, mask_w, mask_h;
-        double opacity;
-        int z_index;
-        int lock_enabled;
         if(!PyArg_ParseTuple(res, 
                     "p(dddd)(dddd)di",
-                    &lock_enabled,
-                    &x, &y, &w, &h,
-                    &mask_x, &mask_y, &mask_w, &mask_h,
-                    &opacity,
-                    &z_index)){
+                    &result->lock_enabled,
+                    &result->x, &result->y, &result->w, &result->h,
+                    &result->mask_x, &result->mask_y, &result->mask_w, &result->mask_h,
+                    &result->opacity,
+                    &result->z_index)){
             PyErr_SetString(PyExc_TypeError, "Cannot parse update_widget return");
+            Py_XDECREF(res);
             return;
         }
 
-
-        wm_content_set_opacity(&widget->widget->super, opacity);
-        if(w >= 0.0 && h >= 0.0)
-            wm_content_set_box(&widget->widget->super, x, y, w, h);
-        wm_content_set_mask(&widget->widget->super, mask_x, mask_y, mask_w, mask_h);
-        wm_content_set_z_index(&widget->widget->super, z_index);
-        wm_content_set_lock_enabled(&widget->widget->super, lock_enabled);
-
+        result->valid = true;
     }
     Py_XDECREF(res);
 
-    args = Py_BuildValue("(l)", widget->handle);
+    args = Py_BuildValue("(l)", handle);
     res = PyObject_Call(_pywm_callbacks_get_all()->update_widget_pixels, args, NULL);
     Py_XDECREF(args);
     if(res && res != Py_None){
         /* Handle update_pixels */
-        int stride, width, height;
+        _pywm_update_reserve((void**)&actions->pixels, &actions->pixels_capacity,
+                actions->n_pixels + 1, sizeof(struct _pywm_update_pixels));
+        struct _pywm_update_pixels* pixels = &actions->pixels[actions->n_pixels];
+        pixels->handle = handle;
+
         PyObject* data;
-        if(!PyArg_ParseTuple(res, "iiiS", &stride, &width, &height, &data)){
+        if(!PyArg_ParseTuple(res, "iiiS", &pixels->stride, &pixels->width, &pixels->height, &data)){
             PyErr_SetString(PyExc_TypeError, "Cannot parse update_widget_pixels return");
+            Py_XDECREF(res);
             return;
         }
 
-        wm_widget_set_pixels(widget->widget,
-                DRM_FORMAT_ARGB8888,
-                stride,
-                width,
-                height,
-                PyBytes_AsString(data));
+        /* Copy, the bytes object is not ours once the GIL is released */
+        size_t size = PyBytes_Size(data);
+        if(size < (size_t)pixels->stride * pixels->height){
+            PyErr_SetString(PyExc_TypeError, "Not enough data for update_widget_pixels");
+            Py_XDECREF(res);
+            return;
+        }
+
+        if(size > pixels->pixels_capacity){
+            free(pixels->pixels);
+            pixels->pixels = malloc(size);
+            pixels->pixels_capacity = size;
+        }
+        memcpy(pixels->pixels, PyBytes_AsString(data), size);
+        actions->n_pixels++;
     }
 
     Py_XDECREF(res);
 }
 
-long _pywm_widgets_add(struct wm_widget* widget){
+void _pywm_widget_apply(struct _pywm_widget* widget, const struct _pywm_update_widget* result){
+    if(result->valid){
+        wm_content_set_opacity(&widget->widget->super, result->opacity);
+        if(result->w >= 0.0 && result->h >= 0.0)
+            wm_content_set_box(&widget->widget->super, result->x, result->y, result->w, result->h);
+        wm_content_set_mask(&widget->widget->super, result->mask_x, result->mask_y, result->mask_w, result->mask_h);
+        wm_content_set_z_index(&widget->widget->super, result->z_index);
+        wm_content_set_lock_enabled(&widget->widget->super, result->lock_enabled);
+    }
+}
+
+long _pywm_widgets_add(struct wm_widget* widget, long handle){
     struct _pywm_widget* it;
     for(it = widgets.first_widget; it && it->next_widget; it=it->next_widget);
     struct _pywm_widget** insert;
@@ -85,7 +110,7 @@ long _pywm_widgets_add(struct wm_widget* widget){
     }
 
     *insert = malloc(sizeof(struct _pywm_widget));
-    _pywm_widget_init(*insert, widget);
+    _pywm_widget_init(*insert, widget, handle);
     return (*insert)->handle;
 }
 
@@ -119,8 +144,10 @@ long _pywm_widgets_get_handle(struct wm_widget* widget){
 }
 
 
-void _pywm_widgets_update(){
-    TIMER_START(widgets_update);
+void _pywm_widgets_call(struct _pywm_update_down* down, struct _pywm_update_actions* actions){
+    WM_TRACE_BEGIN("update_widgets");
+
+    down->n_widgets = 0;
 
     /* Query for a widget to destroy */
     PyObject* args = Py_BuildValue("()");
@@ -130,16 +157,22 @@ void _pywm_widgets_update(){
         long handle = PyLong_AsLong(res);
         if(handle < 0){
             PyErr_SetString(PyExc_TypeError, "Expected long");
+            Py_XDECREF(res);
             goto err;
         }
 
-        struct wm_widget* widget = _pywm_widgets_from_handle(handle);
-        if(!widget){
+        int i;
+        for(i=0; i<n_live_handles && live_handles[i] != handle; i++);
+        if(i == n_live_handles){
             PyErr_SetString(PyExc_TypeError, "Widget has been destroyed");
+            Py_XDECREF(res);
             goto err;
         }
-        _pywm_widgets_remove(widget);
-        wm_destroy_widget(widget);
+        live_handles[i] = live_handles[--n_live_handles];
+
+        _pywm_update_reserve((void**)&actions->destroy_widgets, &actions->destroy_widgets_capacity,
+                actions->n_destroy_widgets + 1, sizeof(long));
+        actions->destroy_widgets[actions->n_destroy_widgets++] = handle;
     }
     Py_XDECREF(res);
 
@@ -148,21 +181,64 @@ void _pywm_widgets_update(){
     res = PyObject_Call(_pywm_callbacks_get_all()->query_new_widget, args, NULL);
     Py_XDECREF(args);
     if(res == Py_True){
-        struct wm_widget* widget = wm_create_widget();
-        _pywm_widgets_add(widget);
+        _pywm_update_reserve((void**)&live_handles, &live_handles_capacity,
+                n_live_handles + 1, sizeof(long));
+        live_handles[n_live_handles++] = next_handle;
+
+        _pywm_update_reserve((void**)&actions->new_widgets, &actions->new_widgets_capacity,
+                actions->n_new_widgets + 1, sizeof(long));
+        actions->new_widgets[actions->n_new_widgets++] = next_handle;
+
+        next_handle++;
     }
     Py_XDECREF(res);
 
     /* Update existing widgets */
-    for(struct _pywm_widget* widget = widgets.first_widget; widget; widget=widget->next_widget){
-        _pywm_widget_update(widget);
+    _pywm_update_reserve((void**)&down->widgets, &down->widgets_capacity,
+            n_live_handles, sizeof(struct _pywm_update_widget));
+    for(int i=0; i<n_live_handles; i++){
+        _pywm_widget_call(live_handles[i], &down->widgets[down->n_widgets++], actions);
     }
 
 err:
+    WM_TRACE_END("update_widgets");
+}
+
+void _pywm_widgets_apply_actions(const struct _pywm_update_actions* actions){
+    for(int i=0; i<actions->n_new_widgets; i++){
+        struct wm_widget* widget = wm_create_widget();
+        _pywm_widgets_add(widget, actions->new_widgets[i]);
+    }
+
+    for(int i=0; i<actions->n_destroy_widgets; i++){
+        struct wm_widget* widget = _pywm_widgets_from_handle(actions->destroy_widgets[i]);
+        if(!widget) continue;
+
+        _pywm_widgets_remove(widget);
+        wm_destroy_widget(widget);
+    }
 
+    for(int i=0; i<actions->n_pixels; i++){
+        const struct _pywm_update_pixels* pixels = &actions->pixels[i];
+        struct wm_widget* widget = _pywm_widgets_from_handle(pixels->handle);
+        if(!widget) continue;
 
-    TIMER_STOP(widgets_update);
-    TIMER_PRINT(widgets_update);
+        wm_widget_set_pixels(widget,
+                DRM_FORMAT_ARGB8888,
+                pixels->stride,
+                pixels->width,
+                pixels->height,
+                pixels->pixels);
+    }
+}
+
+void _pywm_widgets_apply(const struct _pywm_update_down* down){
+    for(int i=0; i<down->n_widgets; i++){
+        struct _pywm_widget* widget = _pywm_widgets_container_from_handle(down->widgets[i].handle);
+        if(!widget) continue;
+
+        _pywm_widget_apply(widget, &down->widgets[i]);
+    }
 }
 
 
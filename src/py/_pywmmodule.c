@@ -7,9 +7,11 @@
 #include <wlr/util/log.h>
 #include "wm/wm.h"
 #include "wm/wm_config.h"
+#include "wm/wm_output.h"
 #include "py/_pywm_callbacks.h"
 #include "py/_pywm_view.h"
 #include "py/_pywm_widget.h"
+#include "py/_pywm_update.h"
 
 static void sig_handler(int sig) {
     void *array[10];
@@ -22,45 +24,6 @@ static void sig_handler(int sig) {
 }
 
 
-static void handle_update(){
-    PyGILState_STATE gil = PyGILState_Ensure();
-
-    PyObject* args = Py_BuildValue("()");
-    PyObject* res = PyObject_Call(_pywm_callbacks_get_all()->update, args, NULL);
-    Py_XDECREF(args);
-
-    int update_cursor;
-    double lock_perc;
-    int terminate;
-
-    if(!PyArg_ParseTuple(res, 
-                "idp",
-                &update_cursor,
-                &lock_perc,
-                &terminate)){
-        PyErr_SetString(PyExc_TypeError, "Cannot parse query return");
-    }else{
-        if(update_cursor >= 0){
-            wm_update_cursor(update_cursor);
-        }
-        wm_set_locked(lock_perc);
-        if(terminate){
-            wm_terminate();
-        }
-    }
-    Py_XDECREF(res);
-
-
-    _pywm_widgets_update();
-    
-    _pywm_views_update();
-
-
-    PyGILState_Release(gil);
-}
-
-
-
 static PyObject* _pywm_run(PyObject* self, PyObject* args, PyObject* kwargs){
     /* Dubug: Print stacktrace upon segfault etc. */
     signal(SIGSEGV, sig_handler);
@@ -92,6 +55,7 @@ static PyObject* _pywm_run(PyObject* self, PyObject* args, PyObject* kwargs){
         o = PyDict_GetItemString(kwargs, "output_width"); if(o){ conf.output_width = PyLong_AsLong(o); }
         o = PyDict_GetItemString(kwargs, "output_height"); if(o){ conf.output_height = PyLong_AsLong(o); }
         o = PyDict_GetItemString(kwargs, "output_mHz"); if(o){ conf.output_mHz= PyLong_AsLong(o); }
+        o = PyDict_GetItemString(kwargs, "output_mirror"); if(o){ conf.output_mirror = o == Py_True; }
 
         o = PyDict_GetItemString(kwargs, "tap_to_click"); if(o){ conf.tap_to_click = o == Py_True; }
         o = PyDict_GetItemString(kwargs, "natural_scroll"); if(o){ conf.natural_scroll = o == Py_True; }
@@ -99,17 +63,24 @@ static PyObject* _pywm_run(PyObject* self, PyObject* args, PyObject* kwargs){
         o = PyDict_GetItemString(kwargs, "focus_follows_mouse"); if(o){ conf.focus_follows_mouse = o == Py_True; }
         o = PyDict_GetItemString(kwargs, "constrain_popups_to_toplevel"); if(o){ conf.constrain_popups_to_toplevel = o == Py_True; }
         o = PyDict_GetItemString(kwargs, "encourage_csd"); if(o){ conf.encourage_csd = o == Py_True; }
+
+        o = PyDict_GetItemString(kwargs, "frame_scheduling"); if(o){ conf.frame_scheduling = o == Py_True; }
+        o = PyDict_GetItemString(kwargs, "frame_margin_min"); if(o){ conf.frame_margin_min = PyFloat_AsDouble(o); }
+        o = PyDict_GetItemString(kwargs, "frame_margin_max"); if(o){ conf.frame_margin_max = PyFloat_AsDouble(o); }
+        o = PyDict_GetItemString(kwargs, "adaptive_sync"); if(o){ conf.adaptive_sync = o == Py_True; }
+        o = PyDict_GetItemString(kwargs, "trace"); if(o){ conf.trace = o == Py_True; }
         o = PyDict_GetItemString(kwargs, "debug_f1"); if(o){ conf.debug_f1 = o == Py_True; }
     }
 
     /* Register callbacks immediately, might be called during init */
-    get_wm()->callback_update = handle_update;
+    _pywm_update_init();
     _pywm_callbacks_init();
 
     wm_init(&conf);
 
     Py_BEGIN_ALLOW_THREADS;
     status = wm_run();
+    _pywm_update_stop();
     Py_END_ALLOW_THREADS;
 
     fprintf(stderr, "...finished\n");
@@ -145,10 +116,66 @@ static PyObject* _pywm_register(PyObject* self, PyObject* args){
     return Py_None;
 }
 
+static PyObject* _pywm_request_update(PyObject* self, PyObject* args){
+    wm_request_update();
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static void frames_append(const char* name, const struct wm_output_frame* frames, int n_frames, void* data){
+    PyObject* list = data;
+
+    PyObject* bytes = PyBytes_FromStringAndSize((const char*)frames, n_frames * sizeof(struct wm_output_frame));
+    PyObject* item = Py_BuildValue("(sN)", name, bytes);
+    if(item){
+        PyList_Append(list, item);
+        Py_DECREF(item);
+    }
+}
+
+static PyObject* _pywm_trace(PyObject* self, PyObject* args){
+    int enabled;
+    if(!PyArg_ParseTuple(args, "p", &enabled)){
+        PyErr_SetString(PyExc_TypeError, "Invalid parameters");
+        return NULL;
+    }
+
+    wm_set_tracing(enabled);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* _pywm_trace_dump(PyObject* self, PyObject* args){
+    const char* path;
+    if(!PyArg_ParseTuple(args, "s", &path)){
+        PyErr_SetString(PyExc_TypeError, "Invalid parameters");
+        return NULL;
+    }
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS;
+    ok = wm_dump_trace(path);
+    Py_END_ALLOW_THREADS;
+
+    return PyBool_FromLong(ok);
+}
+
+static PyObject* _pywm_frames(PyObject* self, PyObject* args){
+    PyObject* list = PyList_New(0);
+    wm_frames(&frames_append, list);
+    return list;
+}
+
 
 static PyMethodDef _pywm_methods[] = {
     { "run",                       (PyCFunction)_pywm_run,           METH_VARARGS | METH_KEYWORDS,   "Start the compositor in this thread" },
     { "register",                  _pywm_register,                   METH_VARARGS,                   "Register callback"  },
+    { "request_update",            _pywm_request_update,             METH_NOARGS,                    "Have update called soon, even if idle (thread-safe)"  },
+    { "frames",                    _pywm_frames,                     METH_NOARGS,                    "Recent frames of every output as list of (name, packed records) (thread-safe)"  },
+    { "trace",                     _pywm_trace,                      METH_VARARGS,                   "Enable / disable recording of trace spans (thread-safe)"  },
+    { "trace_dump",                _pywm_trace_dump,                 METH_VARARGS,                   "Write recorded trace spans as Chrome trace JSON (thread-safe)"  },
 
     { NULL, NULL, 0, NULL }
 };
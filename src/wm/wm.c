@@ -4,16 +4,21 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-server.h>
 #include <wlr/backend.h>
 #include <wlr/util/log.h>
 #include <wlr/xwayland.h>
 
+#include "wm/wm_config.h"
 #include "wm/wm_cursor.h"
 #include "wm/wm_layout.h"
+#include "wm/wm_output.h"
 #include "wm/wm_seat.h"
 #include "wm/wm_server.h"
+#include "wm/wm_trace.h"
+#include "wm/wm_util.h"
 #include "wm/wm_view.h"
 #include "wm/wm_widget.h"
 
@@ -24,6 +29,10 @@ void wm_init(struct wm_config *config) {
         return;
 
     wlr_log_init(WLR_DEBUG, NULL);
+    wm_trace_set_thread_name("compositor");
+    if (config->trace)
+        wm_trace_set_enabled(true);
+
     wm.server = calloc(1, sizeof(struct wm_server));
     wm_server_init(wm.server, config);
 }
@@ -116,6 +125,43 @@ void wm_set_locked(double locked) {
     wm_server_set_locked(wm.server, locked);
 }
 
+void wm_request_apply_update() {
+    if (!wm.server)
+        return;
+
+    wm_server_request_apply_update(wm.server);
+}
+
+void wm_request_update() {
+    if (!wm.server)
+        return;
+
+    wm_server_request_update(wm.server);
+}
+
+void wm_set_tracing(bool enabled) {
+    wm_trace_set_enabled(enabled);
+}
+
+bool wm_dump_trace(const char *path) {
+    return wm_trace_dump(path);
+}
+
+void wm_set_update_state(enum wm_update_state state, int deadline_msec) {
+    if (!wm.server)
+        return;
+
+    wm_server_set_update_state(wm.server, state, deadline_msec);
+}
+
+void wm_frames(void (*callback)(const char *name, const struct wm_output_frame *frames, int n_frames, void *data),
+        void *data) {
+    if (!wm.server)
+        return;
+
+    wm_layout_frames(wm.server->wm_layout, callback, data);
+}
+
 struct wm_widget *wm_create_widget() {
     if (!wm.server)
         return NULL;
@@ -135,85 +181,138 @@ struct wm *get_wm() {
 /*
  * Callbacks
  */
+
+/* Python might want to react, make sure an update follows */
+static void schedule_update() {
+    if (wm.server)
+        wm_server_schedule_update(wm.server);
+}
+
 void wm_callback_layout_change(struct wm_layout *layout) {
+    schedule_update();
+
     if (!wm.callback_layout_change) {
         return;
     }
 
-    return (*wm.callback_layout_change)(layout);
+    WM_TRACE_BEGIN("callback_layout_change");
+    (*wm.callback_layout_change)(layout);
+    WM_TRACE_END("callback_layout_change");
 }
 
 bool wm_callback_key(struct wlr_event_keyboard_key *event,
                      const char *keysyms) {
+    schedule_update();
+
     if (!wm.callback_key) {
         return false;
     }
 
-    return (*wm.callback_key)(event, keysyms);
+    WM_TRACE_BEGIN("callback_key");
+    bool result = (*wm.callback_key)(event, keysyms);
+    WM_TRACE_END("callback_key");
+    return result;
 }
 
 bool wm_callback_modifiers(struct wlr_keyboard_modifiers *modifiers) {
+    schedule_update();
+
     if (!wm.callback_modifiers) {
         return false;
     }
 
-    return (*wm.callback_modifiers)(modifiers);
+    WM_TRACE_BEGIN("callback_modifiers");
+    bool result = (*wm.callback_modifiers)(modifiers);
+    WM_TRACE_END("callback_modifiers");
+    return result;
 }
 
 bool wm_callback_motion(double delta_x, double delta_y, uint32_t time_msec) {
+    schedule_update();
+
     if (!wm.callback_motion) {
         return false;
     }
 
-    return (*wm.callback_motion)(delta_x, delta_y, time_msec);
+    WM_TRACE_BEGIN("callback_motion");
+    bool result = (*wm.callback_motion)(delta_x, delta_y, time_msec);
+    WM_TRACE_END("callback_motion");
+    return result;
 }
 
 bool wm_callback_motion_absolute(double x, double y, uint32_t time_msec) {
+    schedule_update();
+
     if (!wm.callback_motion_absolute) {
         return false;
     }
 
-    return (*wm.callback_motion_absolute)(x, y, time_msec);
+    WM_TRACE_BEGIN("callback_motion_absolute");
+    bool result = (*wm.callback_motion_absolute)(x, y, time_msec);
+    WM_TRACE_END("callback_motion_absolute");
+    return result;
 }
 
 bool wm_callback_button(struct wlr_event_pointer_button *event) {
+    schedule_update();
+
     if (!wm.callback_button) {
         return false;
     }
 
-    return (*wm.callback_button)(event);
+    WM_TRACE_BEGIN("callback_button");
+    bool result = (*wm.callback_button)(event);
+    WM_TRACE_END("callback_button");
+    return result;
 }
 
 bool wm_callback_axis(struct wlr_event_pointer_axis *event) {
+    schedule_update();
+
     if (!wm.callback_axis) {
         return false;
     }
 
-    return (*wm.callback_axis)(event);
+    WM_TRACE_BEGIN("callback_axis");
+    bool result = (*wm.callback_axis)(event);
+    WM_TRACE_END("callback_axis");
+    return result;
 }
 
 void wm_callback_init_view(struct wm_view *view) {
+    schedule_update();
+
     if (!wm.callback_init_view) {
         return;
     }
 
-    return (*wm.callback_init_view)(view);
+    WM_TRACE_BEGIN("callback_init_view");
+    (*wm.callback_init_view)(view);
+    WM_TRACE_END("callback_init_view");
 }
 
 void wm_callback_destroy_view(struct wm_view *view) {
+    schedule_update();
+
     if (!wm.callback_destroy_view) {
         return;
     }
 
-    return (*wm.callback_destroy_view)(view);
+    WM_TRACE_BEGIN("callback_destroy_view");
+    (*wm.callback_destroy_view)(view);
+    WM_TRACE_END("callback_destroy_view");
 }
 
 void wm_callback_view_event(struct wm_view *view, const char *event) {
+    schedule_update();
+
     if (!wm.callback_view_event) {
         return;
     }
 
-    return (*wm.callback_view_event)(view, event);
+    WM_TRACE_BEGIN("callback_view_event");
+    (*wm.callback_view_event)(view, event);
+    WM_TRACE_END("callback_view_event");
 }
 
 void wm_callback_update() {
@@ -221,7 +320,30 @@ void wm_callback_update() {
         return;
     }
 
-    return (*wm.callback_update)();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* Updates are driven by the default output, see wm_output handle_present */
+    int64_t present_nsec = timespec_nsec(now);
+    int refresh_nsec = 0;
+    if (wm.server->wm_layout->default_output) {
+        wm_output_predict_present(wm.server->wm_layout->default_output, now,
+                                  &present_nsec, &refresh_nsec);
+    }
+
+    WM_TRACE_BEGIN("callback_update");
+    (*wm.callback_update)(present_nsec, refresh_nsec);
+    WM_TRACE_END("callback_update");
+}
+
+void wm_callback_apply_update() {
+    if (!wm.callback_apply_update) {
+        return;
+    }
+
+    WM_TRACE_BEGIN("callback_apply_update");
+    (*wm.callback_apply_update)();
+    WM_TRACE_END("callback_apply_update");
 }
 
 void wm_callback_ready() {
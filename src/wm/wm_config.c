@@ -16,6 +16,7 @@ void wm_config_init_default(struct wm_config* config){
     config->output_width = 0;
     config->output_height = 0;
     config->output_mHz = 0;
+    config->output_mirror = false;
 
     config->xcursor_theme = NULL;
     config->xcursor_size = 24;
@@ -27,5 +28,11 @@ void wm_config_init_default(struct wm_config* config){
     config->constrain_popups_to_toplevel = false;
 
     config->encourage_csd = true;
+
+    config->frame_scheduling = true;
+    config->frame_margin_min = 1.;
+    config->frame_margin_max = 8.;
+    config->adaptive_sync = false;
+    config->trace = false;
     config->debug_f1 = false;
 }
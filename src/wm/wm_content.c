@@ -1,16 +1,51 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include <assert.h>
+#include <math.h>
 #include <stdlib.h>
 #include <wayland-server.h>
 #include <wlr/util/log.h>
 
 #include "wm/wm_content.h"
+#include "wm/wm_content_arrays.h"
+#include "wm/wm_grid.h"
 #include "wm/wm_server.h"
 #include "wm/wm_layout.h"
+#include "wm/wm_output.h"
+#include "wm/wm_renderer.h"
 
 struct wm_content_vtable wm_content_base_vtable;
 
+/*
+ * Insert content into wm_contents, starting the search at pos; it ends up
+ * in front of all contents with lower z-index, behind those with higher or
+ * (if behind_equal) equal z-index. This way the order among equal z-index
+ * stays the same as with a stable sort.
+ */
+static void insert_sorted(struct wm_content* content, struct wl_list* pos, bool behind_equal){
+    struct wl_list* head = &content->wm_server->wm_contents;
+
+    if(behind_equal){
+        /* Move towards the front */
+        while(pos != head){
+            struct wm_content* other = wl_container_of(pos, other, link);
+            if(other->z_index >= content->z_index) break;
+            pos = pos->prev;
+        }
+        wl_list_insert(pos, &content->link);
+    }else{
+        /* Move towards the back */
+        while(pos != head){
+            struct wm_content* other = wl_container_of(pos, other, link);
+            if(other->z_index <= content->z_index) break;
+            pos = pos->next;
+        }
+        wl_list_insert(pos->prev, &content->link);
+    }
+
+    content->wm_server->contents_generation++;
+}
+
 void wm_content_init(struct wm_content* content, struct wm_server* server) {
     content->vtable = &wm_content_base_vtable;
 
@@ -22,13 +57,29 @@ void wm_content_init(struct wm_content* content, struct wm_server* server) {
     content->corner_radius = 0.;
 
     content->z_index = 0;
-    wl_list_insert(&content->wm_server->wm_contents, &content->link);
+    insert_sorted(content, server->wm_contents.next, false);
+    server->n_contents++;
 
     content->lock_enabled = false;
+
+    content->blur_passes = 0;
+    content->blur_radius = 0.;
+    content->blur = NULL;
+    wl_list_init(&content->blur_link);
+
+    content->grid_dirty = false;
+    content->grid_indexed = false;
+    content->bounds = (struct wlr_fbox){ 0 };
+    content->z_order = 0;
 }
 
 void wm_content_base_destroy(struct wm_content* content) {
     wl_list_remove(&content->link);
+    content->wm_server->n_contents--;
+    content->wm_server->contents_generation++;
+    wm_grid_remove(content->wm_server->wm_grid, content);
+    wl_list_remove(&content->blur_link);
+    wm_renderer_destroy_blur(content->wm_server->wm_renderer, content->blur);
 }
 
 void wm_content_set_box(struct wm_content* content, double x, double y, double width, double height) {
@@ -43,6 +94,7 @@ void wm_content_set_box(struct wm_content* content, double x, double y, double w
     content->display_y = y;
     content->display_width = width;
     content->display_height = height;
+    wm_content_arrays_update_content(content->wm_server->wm_content_arrays, content);
     wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
 }
 
@@ -56,7 +108,16 @@ void wm_content_get_box(struct wm_content* content, double* display_x, double* d
 void wm_content_set_z_index(struct wm_content* content, int z_index){
     if(z_index == content->z_index) return;
 
+    /* Blurs above the old position have to drop the content as well */
+    wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
+
+    /* Only contents between the old and the new position are passed */
+    bool up = z_index > content->z_index;
+    struct wl_list* pos = up ? content->link.prev : content->link.next;
+    wl_list_remove(&content->link);
+
     content->z_index = z_index;
+    insert_sorted(content, pos, up);
     wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
 }
 int wm_content_get_z_index(struct wm_content* content){
@@ -67,6 +128,7 @@ void wm_content_set_opacity(struct wm_content* content, double opacity){
     if(fabs(content->opacity - opacity) < 0.01) return;
 
     content->opacity = opacity;
+    wm_content_arrays_update_content(content->wm_server->wm_content_arrays, content);
     wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
 }
 
@@ -79,6 +141,7 @@ void wm_content_set_mask(struct wm_content* content, double mask_x, double mask_
     content->mask_y = mask_y;
     content->mask_w = mask_w;
     content->mask_h = mask_h;
+    wm_content_arrays_update_content(content->wm_server->wm_content_arrays, content);
 
     wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
 }
@@ -102,7 +165,10 @@ void wm_content_set_corner_radius(struct wm_content* content, double corner_radi
 void wm_content_set_lock_enabled(struct wm_content* content, bool lock_enabled){
     if(lock_enabled == content->lock_enabled) return;
 
+    /* Moves between lock screen and contents behind it */
+    wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
     content->lock_enabled = lock_enabled;
+    wm_content_arrays_update_content(content->wm_server->wm_content_arrays, content);
     wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
 }
 
@@ -110,6 +176,40 @@ double wm_content_get_corner_radius(struct wm_content* content){
     return content->corner_radius;
 }
 
+void wm_content_set_blur(struct wm_content* content, int passes, double radius){
+    if(passes == content->blur_passes && fabs(radius - content->blur_radius) < 0.01) return;
+
+    if((passes > 0) != (content->blur_passes > 0)){
+        wl_list_remove(&content->blur_link);
+        if(passes > 0){
+            wl_list_insert(&content->wm_server->blurred_contents, &content->blur_link);
+        }else{
+            wl_list_init(&content->blur_link);
+        }
+    }
+
+    content->blur_passes = passes;
+    content->blur_radius = radius;
+    wm_content_arrays_update_content(content->wm_server->wm_content_arrays, content);
+    wm_layout_damage_from(content->wm_server->wm_layout, content, NULL);
+}
+
+void wm_content_get_blur_box(struct wm_content* content, struct wm_output* output, struct wlr_fbox* box){
+    double mask_x, mask_y, mask_w, mask_h;
+    wm_content_get_mask(content, &mask_x, &mask_y, &mask_w, &mask_h);
+
+    double x1 = fmax(0., mask_x);
+    double y1 = fmax(0., mask_y);
+    double x2 = fmin(content->display_width, mask_x + mask_w);
+    double y2 = fmin(content->display_height, mask_y + mask_h);
+
+    double scale = output->wlr_output->scale;
+    box->x = (content->display_x - output->layout_x + x1) * scale;
+    box->y = (content->display_y - output->layout_y + y1) * scale;
+    box->width = fmax(0., x2 - x1) * scale;
+    box->height = fmax(0., y2 - y1) * scale;
+}
+
 struct wm_content_vtable wm_content_base_vtable = {
     .destroy = wm_content_base_destroy,
 };
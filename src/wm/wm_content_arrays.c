@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <pixman.h>
+#include <wayland-server.h>
+#include <wlr/util/log.h>
+
+#include "wm/wm_content_arrays.h"
+#include "wm/wm_content.h"
+#include "wm/wm_drag.h"
+#include "wm/wm_grid.h"
+#include "wm/wm_server.h"
+#include "wm/wm_view.h"
+
+static void grow(struct wm_content_arrays* arrays, int capacity){
+    if(capacity <= arrays->capacity) return;
+
+    int old_capacity = arrays->capacity;
+    int new_capacity = old_capacity ? old_capacity : 16;
+    while(new_capacity < capacity) new_capacity *= 2;
+    arrays->capacity = new_capacity;
+
+    arrays->content = realloc(arrays->content, new_capacity * sizeof(struct wm_content*));
+    arrays->x = realloc(arrays->x, new_capacity * sizeof(double));
+    arrays->y = realloc(arrays->y, new_capacity * sizeof(double));
+    arrays->width = realloc(arrays->width, new_capacity * sizeof(double));
+    arrays->height = realloc(arrays->height, new_capacity * sizeof(double));
+    arrays->bounds_x = realloc(arrays->bounds_x, new_capacity * sizeof(double));
+    arrays->bounds_y = realloc(arrays->bounds_y, new_capacity * sizeof(double));
+    arrays->bounds_width = realloc(arrays->bounds_width, new_capacity * sizeof(double));
+    arrays->bounds_height = realloc(arrays->bounds_height, new_capacity * sizeof(double));
+    arrays->mask_x = realloc(arrays->mask_x, new_capacity * sizeof(double));
+    arrays->mask_y = realloc(arrays->mask_y, new_capacity * sizeof(double));
+    arrays->mask_width = realloc(arrays->mask_width, new_capacity * sizeof(double));
+    arrays->mask_height = realloc(arrays->mask_height, new_capacity * sizeof(double));
+    arrays->opacity = realloc(arrays->opacity, new_capacity * sizeof(double));
+    arrays->z_index = realloc(arrays->z_index, new_capacity * sizeof(int));
+    arrays->flags = realloc(arrays->flags, new_capacity * sizeof(uint8_t));
+    arrays->type = realloc(arrays->type, new_capacity * sizeof(uint8_t));
+    arrays->visible = realloc(arrays->visible, new_capacity * sizeof(int));
+    arrays->damage = realloc(arrays->damage, new_capacity * sizeof(pixman_region32_t));
+
+    assert(arrays->content && arrays->x && arrays->y && arrays->width && arrays->height &&
+            arrays->bounds_x && arrays->bounds_y && arrays->bounds_width && arrays->bounds_height &&
+            arrays->mask_x && arrays->mask_y && arrays->mask_width && arrays->mask_height &&
+            arrays->opacity && arrays->z_index && arrays->flags && arrays->type &&
+            arrays->visible && arrays->damage);
+
+    /* Regions only hold a pointer to their rects, so they survive the move */
+    for(int i=old_capacity; i<new_capacity; i++){
+        pixman_region32_init(&arrays->damage[i]);
+    }
+}
+
+static void fill(struct wm_content_arrays* arrays, int i, struct wm_content* content){
+    arrays->content[i] = content;
+    arrays->x[i] = content->display_x;
+    arrays->y[i] = content->display_y;
+    arrays->width[i] = content->display_width;
+    arrays->height[i] = content->display_height;
+    arrays->bounds_x[i] = content->bounds.x;
+    arrays->bounds_y[i] = content->bounds.y;
+    arrays->bounds_width[i] = content->bounds.width;
+    arrays->bounds_height[i] = content->bounds.height;
+
+    double mask_x, mask_y, mask_w, mask_h;
+    wm_content_get_mask(content, &mask_x, &mask_y, &mask_w, &mask_h);
+    double x1 = fmax(0., mask_x);
+    double y1 = fmax(0., mask_y);
+    double x2 = fmin(content->display_width, mask_x + mask_w);
+    double y2 = fmin(content->display_height, mask_y + mask_h);
+    arrays->mask_x[i] = content->display_x + x1;
+    arrays->mask_y[i] = content->display_y + y1;
+    arrays->mask_width[i] = fmax(0., x2 - x1);
+    arrays->mask_height[i] = fmax(0., y2 - y1);
+
+    arrays->opacity[i] = content->opacity;
+    arrays->z_index[i] = content->z_index;
+
+    arrays->flags[i] = 0;
+    if(content->lock_enabled) arrays->flags[i] |= WM_CONTENT_FLAG_LOCK_ENABLED;
+    if(content->blur_passes > 0) arrays->flags[i] |= WM_CONTENT_FLAG_BLUR;
+}
+
+/*
+ * Class implementation
+ */
+void wm_content_arrays_init(struct wm_content_arrays* arrays){
+    arrays->n = 0;
+    arrays->capacity = 0;
+
+    /* contents_generation starts at zero, so the first update rebuilds */
+    arrays->generation = UINT64_MAX;
+
+    arrays->content = NULL;
+    arrays->x = NULL;
+    arrays->y = NULL;
+    arrays->width = NULL;
+    arrays->height = NULL;
+    arrays->bounds_x = NULL;
+    arrays->bounds_y = NULL;
+    arrays->bounds_width = NULL;
+    arrays->bounds_height = NULL;
+    arrays->mask_x = NULL;
+    arrays->mask_y = NULL;
+    arrays->mask_width = NULL;
+    arrays->mask_height = NULL;
+    arrays->opacity = NULL;
+    arrays->z_index = NULL;
+    arrays->flags = NULL;
+    arrays->type = NULL;
+    arrays->visible = NULL;
+    arrays->damage = NULL;
+}
+
+void wm_content_arrays_destroy(struct wm_content_arrays* arrays){
+    free(arrays->content);
+    free(arrays->x);
+    free(arrays->y);
+    free(arrays->width);
+    free(arrays->height);
+    free(arrays->bounds_x);
+    free(arrays->bounds_y);
+    free(arrays->bounds_width);
+    free(arrays->bounds_height);
+    free(arrays->mask_x);
+    free(arrays->mask_y);
+    free(arrays->mask_width);
+    free(arrays->mask_height);
+    free(arrays->opacity);
+    free(arrays->z_index);
+    free(arrays->flags);
+    free(arrays->type);
+    free(arrays->visible);
+    for(int i=0; i<arrays->capacity; i++){
+        pixman_region32_fini(&arrays->damage[i]);
+    }
+    free(arrays->damage);
+    wm_content_arrays_init(arrays);
+}
+
+struct wm_content_arrays* wm_content_arrays_update(struct wm_server* server){
+    /* Bounds are mirrored as well */
+    wm_grid_flush(server->wm_grid);
+
+    struct wm_content_arrays* arrays = server->wm_content_arrays;
+    if(arrays->generation == server->contents_generation) return arrays;
+    arrays->generation = server->contents_generation;
+
+    grow(arrays, server->n_contents);
+
+    int i = 0;
+    struct wm_content* content;
+    wl_list_for_each(content, &server->wm_contents, link){
+        content->z_order = i;
+        fill(arrays, i, content);
+
+        /* Subclasses set their vtable after wm_content_init, hence only here */
+        if(wm_content_is_view(content)){
+            arrays->type[i] = WM_CONTENT_TYPE_VIEW;
+        }else if(wm_content_is_drag(content)){
+            arrays->type[i] = WM_CONTENT_TYPE_DRAG;
+        }else{
+            arrays->type[i] = WM_CONTENT_TYPE_OTHER;
+        }
+        i++;
+    }
+    assert(i == server->n_contents);
+    arrays->n = i;
+
+    return arrays;
+}
+
+void wm_content_arrays_update_content(struct wm_content_arrays* arrays, struct wm_content* content){
+    /* Otherwise the next wm_content_arrays_update picks the change up anyway */
+    if(arrays->generation != content->wm_server->contents_generation) return;
+
+    assert(content->z_order < arrays->n && arrays->content[content->z_order] == content);
+    fill(arrays, content->z_order, content);
+}
@@ -11,6 +11,7 @@
 #include "wm/wm_config.h"
 #include "wm/wm_server.h"
 #include "wm/wm_content.h"
+#include "wm/wm_content_arrays.h"
 #include "wm/wm_drag.h"
 #include "wm/wm.h"
 #include "wm/wm_util.h"
@@ -134,10 +135,10 @@ void wm_cursor_add_pointer(struct wm_cursor* cursor, struct wm_pointer* pointer)
 }
 
 void wm_cursor_update(struct wm_cursor* cursor){
-    struct wm_content* r;
-    wl_list_for_each(r, &cursor->wm_seat->wm_server->wm_contents, link) {
-        if(wm_content_is_drag(r)){
-            struct wm_drag* drag = wm_cast(wm_drag, r);
+    struct wm_content_arrays* arrays = wm_content_arrays_update(cursor->wm_seat->wm_server);
+    for(int i=0; i<arrays->n; i++){
+        if(arrays->type[i] == WM_CONTENT_TYPE_DRAG){
+            struct wm_drag* drag = wm_cast(wm_drag, arrays->content[i]);
             wm_drag_update_position(drag);
         }
     }
@@ -116,8 +116,8 @@ static void wm_drag_render(struct wm_content* super, struct wm_output* output, p
     if(!drag->wlr_drag_icon) return;
 
     struct wlr_box box = {
-        .x = round(drag->super.display_x * output->wlr_output->scale),
-        .y = round(drag->super.display_y * output->wlr_output->scale),
+        .x = round((drag->super.display_x - output->layout_x) * output->wlr_output->scale),
+        .y = round((drag->super.display_y - output->layout_y) * output->wlr_output->scale),
         .width = round(drag->super.display_width * output->wlr_output->scale),
         .height = round(drag->super.display_height * output->wlr_output->scale)};
 
@@ -128,15 +128,14 @@ static void wm_drag_render(struct wm_content* super, struct wm_output* output, p
     wm_renderer_render_texture_at(
             output->wm_server->wm_renderer, output_damage,
             texture, &box,
-            wm_content_get_opacity(super), 0, 0, 0, 0, 0,
-            super->lock_enabled ? 0.0 : super->wm_server->lock_perc);
+            wm_content_get_opacity(super), NULL, 0);
 }
 
 static void wm_drag_damage_output(struct wm_content* super, struct wm_output* output, struct wlr_surface* origin){
     struct wm_drag* drag = wm_cast(wm_drag, super);
 
-    double x = drag->super.display_x * output->wlr_output->scale;
-    double y = drag->super.display_y * output->wlr_output->scale;
+    double x = (drag->super.display_x - output->layout_x) * output->wlr_output->scale;
+    double y = (drag->super.display_y - output->layout_y) * output->wlr_output->scale;
     double width = drag->super.display_width * output->wlr_output->scale;
     double height = drag->super.display_height * output->wlr_output->scale;
     struct wlr_box box = {
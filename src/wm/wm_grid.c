@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_surface.h>
+#include <wlr/util/log.h>
+
+#include "wm/wm_grid.h"
+#include "wm/wm_content.h"
+#include "wm/wm_content_arrays.h"
+#include "wm/wm_server.h"
+#include "wm/wm_util.h"
+#include "wm/wm_view.h"
+
+/*
+ * Buckets
+ */
+static void bucket_add(struct wm_grid_bucket* bucket, struct wm_content* content){
+    if(bucket->n_contents == bucket->contents_capacity){
+        bucket->contents_capacity = bucket->contents_capacity ? 2 * bucket->contents_capacity : 4;
+        bucket->contents = realloc(bucket->contents, bucket->contents_capacity * sizeof(struct wm_content*));
+        assert(bucket->contents);
+    }
+    bucket->contents[bucket->n_contents++] = content;
+}
+
+/* Removes a single occurrence, cells of one box might share a bucket */
+static void bucket_remove(struct wm_grid_bucket* bucket, struct wm_content* content){
+    for(int i=0; i<bucket->n_contents; i++){
+        if(bucket->contents[i] == content){
+            bucket->contents[i] = bucket->contents[--bucket->n_contents];
+            return;
+        }
+    }
+}
+
+static void bucket_destroy(struct wm_grid_bucket* bucket){
+    free(bucket->contents);
+    bucket->contents = NULL;
+    bucket->n_contents = 0;
+    bucket->contents_capacity = 0;
+}
+
+static struct wm_grid_bucket* cell_bucket(struct wm_grid* grid, int cell_x, int cell_y){
+    unsigned int hash = ((unsigned int)cell_x * 73856093u) ^ ((unsigned int)cell_y * 19349663u);
+    return &grid->buckets[hash % WM_GRID_BUCKETS];
+}
+
+/* Clamped, so far off boxes cannot overflow but end up in the large list */
+static int cell_of(double coord){
+    double cell = floor(coord / WM_GRID_CELL_SIZE);
+    if(!(cell > -1000000.)) return -1000000;
+    if(cell > 1000000.) return 1000000;
+    return (int)cell;
+}
+
+/*
+ * Boxes
+ */
+struct surface_bounds {
+    int x1, y1, x2, y2;
+};
+
+static void extend_bounds(struct wlr_surface* surface, int sx, int sy, void* _data){
+    struct surface_bounds* bounds = _data;
+    if(sx < bounds->x1) bounds->x1 = sx;
+    if(sy < bounds->y1) bounds->y1 = sy;
+    if(sx + surface->current.width > bounds->x2) bounds->x2 = sx + surface->current.width;
+    if(sy + surface->current.height > bounds->y2) bounds->y2 = sy + surface->current.height;
+}
+
+/* Layout coordinates of the area in which wm_view_surface_at might find something */
+static bool input_box(struct wm_content* content, struct wlr_fbox* box){
+    if(!wm_content_is_view(content)) return false;
+    struct wm_view* view = wm_cast(wm_view, content);
+
+    int width, height;
+    wm_view_get_size(view, &width, &height);
+    if(width <= 0 || height <= 0) return false;
+
+    struct surface_bounds bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+    wm_view_for_each_surface(view, extend_bounds, &bounds);
+    if(bounds.x1 >= bounds.x2 || bounds.y1 >= bounds.y2) return false;
+
+    double display_x, display_y, display_width, display_height;
+    wm_content_get_box(content, &display_x, &display_y, &display_width, &display_height);
+
+    /* Extended by one surface pixel, as wm_server_surface_at rounds */
+    double scale_x = display_width / width;
+    double scale_y = display_height / height;
+    box->x = display_x + (bounds.x1 - 1) * scale_x;
+    box->y = display_y + (bounds.y1 - 1) * scale_y;
+    box->width = (bounds.x2 - bounds.x1 + 2) * scale_x;
+    box->height = (bounds.y2 - bounds.y1 + 2) * scale_y;
+    return true;
+}
+
+static void unindex_content(struct wm_grid* grid, struct wm_content* content){
+    if(!content->grid_indexed) return;
+    content->grid_indexed = false;
+
+    if(content->grid_large){
+        bucket_remove(&grid->large, content);
+        return;
+    }
+
+    for(int x=content->grid_cells[0]; x<=content->grid_cells[2]; x++){
+        for(int y=content->grid_cells[1]; y<=content->grid_cells[3]; y++){
+            bucket_remove(cell_bucket(grid, x, y), content);
+        }
+    }
+}
+
+static void index_content(struct wm_grid* grid, struct wm_content* content){
+    assert(!content->grid_indexed);
+    if(!input_box(content, &content->grid_box)) return;
+    content->grid_indexed = true;
+
+    struct wlr_fbox* box = &content->grid_box;
+    content->grid_cells[0] = cell_of(box->x);
+    content->grid_cells[1] = cell_of(box->y);
+    content->grid_cells[2] = cell_of(box->x + box->width);
+    content->grid_cells[3] = cell_of(box->y + box->height);
+
+    long n_cells = (long)(content->grid_cells[2] - content->grid_cells[0] + 1) *
+        (content->grid_cells[3] - content->grid_cells[1] + 1);
+    content->grid_large = n_cells > WM_GRID_MAX_CELLS;
+
+    if(content->grid_large){
+        bucket_add(&grid->large, content);
+        return;
+    }
+
+    for(int x=content->grid_cells[0]; x<=content->grid_cells[2]; x++){
+        for(int y=content->grid_cells[1]; y<=content->grid_cells[3]; y++){
+            bucket_add(cell_bucket(grid, x, y), content);
+        }
+    }
+}
+
+/* Box of content, extended by its input box */
+static void update_bounds(struct wm_grid* grid, struct wm_content* content){
+    double x1 = content->display_x;
+    double y1 = content->display_y;
+    double x2 = content->display_x + content->display_width;
+    double y2 = content->display_y + content->display_height;
+
+    if(content->grid_indexed){
+        struct wlr_fbox* box = &content->grid_box;
+        x1 = fmin(x1, box->x);
+        y1 = fmin(y1, box->y);
+        x2 = fmax(x2, box->x + box->width);
+        y2 = fmax(y2, box->y + box->height);
+    }
+
+    content->bounds = (struct wlr_fbox){ x1, y1, x2 - x1, y2 - y1 };
+    wm_content_arrays_update_content(grid->wm_server->wm_content_arrays, content);
+}
+
+static void add_result(struct wm_grid* grid, struct wm_grid_bucket* bucket, double x, double y){
+    for(int i=0; i<bucket->n_contents; i++){
+        struct wm_content* content = bucket->contents[i];
+        struct wlr_fbox* box = &content->grid_box;
+        if(x < box->x || y < box->y || x >= box->x + box->width || y >= box->y + box->height) continue;
+
+        bool duplicate = false;
+        for(int j=0; j<grid->result.n_contents; j++){
+            if(grid->result.contents[j] == content){
+                duplicate = true;
+                break;
+            }
+        }
+        if(!duplicate) bucket_add(&grid->result, content);
+    }
+}
+
+/*
+ * Class implementation
+ */
+void wm_grid_init(struct wm_grid* grid, struct wm_server* server){
+    grid->wm_server = server;
+    wl_list_init(&grid->dirty);
+    grid->generation = 0;
+}
+
+void wm_grid_destroy(struct wm_grid* grid){
+    struct wm_content* content;
+    struct wm_content* tmp;
+    wl_list_for_each_safe(content, tmp, &grid->dirty, grid_dirty_link){
+        wl_list_remove(&content->grid_dirty_link);
+        content->grid_dirty = false;
+    }
+
+    for(int i=0; i<WM_GRID_BUCKETS; i++){
+        bucket_destroy(&grid->buckets[i]);
+    }
+    bucket_destroy(&grid->large);
+    bucket_destroy(&grid->result);
+}
+
+void wm_grid_mark_dirty(struct wm_grid* grid, struct wm_content* content){
+    grid->generation++;
+    if(content->grid_dirty) return;
+
+    content->grid_dirty = true;
+    wl_list_insert(&grid->dirty, &content->grid_dirty_link);
+}
+
+void wm_grid_update(struct wm_grid* grid, struct wm_content* content){
+    if(!content->grid_dirty) return;
+
+    wl_list_remove(&content->grid_dirty_link);
+    content->grid_dirty = false;
+
+    unindex_content(grid, content);
+    index_content(grid, content);
+    update_bounds(grid, content);
+}
+
+void wm_grid_flush(struct wm_grid* grid){
+    struct wm_content* content;
+    struct wm_content* tmp;
+    wl_list_for_each_safe(content, tmp, &grid->dirty, grid_dirty_link){
+        wm_grid_update(grid, content);
+    }
+}
+
+void wm_grid_invalidate(struct wm_grid* grid){
+    grid->generation++;
+}
+
+void wm_grid_remove(struct wm_grid* grid, struct wm_content* content){
+    grid->generation++;
+    if(content->grid_dirty){
+        wl_list_remove(&content->grid_dirty_link);
+        content->grid_dirty = false;
+    }
+    unindex_content(grid, content);
+}
+
+int wm_grid_query(struct wm_grid* grid, double x, double y, struct wm_content*** result){
+    wm_grid_flush(grid);
+
+    grid->result.n_contents = 0;
+    add_result(grid, cell_bucket(grid, cell_of(x), cell_of(y)), x, y);
+    add_result(grid, &grid->large, x, y);
+
+    *result = grid->result.contents;
+    return grid->result.n_contents;
+}
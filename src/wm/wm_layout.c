@@ -2,13 +2,30 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <math.h>
 #include <wlr/util/log.h>
 #include "wm/wm_layout.h"
+#include "wm/wm_grid.h"
 #include "wm/wm_output.h"
+#include "wm/wm_renderer.h"
 #include "wm/wm.h"
 #include "wm/wm_view.h"
 #include "wm/wm_server.h"
 #include "wm/wm_config.h"
+#include "wm/wm_trace.h"
+#include "wm/wm_util.h"
+
+/* Outputs have changed, see wm_view_update_outputs */
+static void update_view_outputs(struct wm_layout* layout){
+    wm_grid_flush(layout->wm_server->wm_grid);
+
+    struct wm_content* content;
+    wl_list_for_each(content, &layout->wm_server->wm_contents, link){
+        if(wm_content_is_view(content)){
+            wm_view_update_outputs(wm_cast(wm_view, content));
+        }
+    }
+}
 
 /*
  * Callbacks
@@ -17,15 +34,69 @@ static void handle_change(struct wl_listener* listener, void* data){
     wlr_log(WLR_DEBUG, "Layout: Change");
     struct wm_layout* layout = wl_container_of(listener, layout, change);
 
-    if(layout->default_output){
-        wlr_output_effective_resolution(layout->default_output->wlr_output, &layout->width, &layout->height);
+    struct wm_output* output;
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        struct wlr_output_layout_output* l = wlr_output_layout_get(layout->wlr_output_layout, output->wlr_output);
+        if(!l) continue;
+
+        output->layout_x = l->x;
+        output->layout_y = l->y;
+        wlr_log(WLR_DEBUG, "Layout: %s at %d, %d", output->wlr_output->name, l->x, l->y);
+    }
+
+    /* Extents, starting from the origin */
+    if(!wl_list_empty(&layout->wm_outputs)){
+        struct wlr_box* box = wlr_output_layout_get_box(layout->wlr_output_layout, NULL);
+        layout->width = box->x + box->width;
+        layout->height = box->y + box->height;
     }else{
         layout->width = 0;
         layout->height = 0;
     }
+
+    /* Contents might have ended up on different outputs */
+    update_view_outputs(layout);
+    wm_layout_damage_whole(layout);
+
     wm_callback_layout_change(layout);
 }
 
+/*
+ * With output_mirror, every output but the default one shows a copy of it,
+ * see render_mirror in wm_output.c, and is taken out of the layout
+ */
+static void update_mirrors(struct wm_layout* layout){
+    bool mirror = layout->wm_server->wm_config->output_mirror;
+    bool changed = false;
+
+    struct wm_output* output;
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        struct wm_output* mirror_of = mirror && output != layout->default_output ?
+            layout->default_output : NULL;
+        bool in_layout = wlr_output_layout_get(layout->wlr_output_layout, output->wlr_output);
+
+        if(output->mirror_of != mirror_of){
+            if(mirror_of){
+                wlr_log(WLR_INFO, "Layout: %s mirrors %s", output->wlr_output->name, mirror_of->wlr_output->name);
+            }
+            output->mirror_of = mirror_of;
+            wlr_output_damage_add_whole(output->wlr_output_damage);
+            changed = true;
+        }
+
+        if(mirror_of && in_layout){
+            wlr_output_layout_remove(layout->wlr_output_layout, output->wlr_output);
+        }else if(!mirror_of && !in_layout){
+            wlr_output_layout_add_auto(layout->wlr_output_layout, output->wlr_output);
+        }
+    }
+
+    /* New mirrors need a whole frame to copy */
+    if(changed && layout->default_output){
+        wlr_output_damage_add_whole(layout->default_output->wlr_output_damage);
+    }
+}
+
 /*
  * Class implementation
  */
@@ -42,10 +113,13 @@ void wm_layout_init(struct wm_layout* layout, struct wm_server* server){
     layout->default_output = NULL;
     layout->width = 0;
     layout->height = 0;
+
+    pthread_mutex_init(&layout->frames_mutex, NULL);
 }
 
 void wm_layout_destroy(struct wm_layout* layout) {
     wl_list_remove(&layout->change.link);
+    pthread_mutex_destroy(&layout->frames_mutex);
 }
 
 void wm_layout_add_output(struct wm_layout* layout, struct wlr_output* out){
@@ -53,38 +127,237 @@ void wm_layout_add_output(struct wm_layout* layout, struct wlr_output* out){
 
     struct wm_output* output = calloc(1, sizeof(struct wm_output));
     wm_output_init(output, layout->wm_server, layout, out);
+
+    pthread_mutex_lock(&layout->frames_mutex);
     wl_list_insert(&layout->wm_outputs, &output->link);
+    pthread_mutex_unlock(&layout->frames_mutex);
 
-    if((strlen(layout->wm_server->wm_config->output_name) == 0 || !strcmp(layout->wm_server->wm_config->output_name, out->name)) && 
-            !layout->default_output){
+    /* output_name only picks the default output, the others are used as well */
+    const char* name = layout->wm_server->wm_config->output_name;
+    if(!layout->default_output || (strlen(name) > 0 && !strcmp(name, out->name) &&
+                strcmp(name, layout->default_output->wlr_output->name))){
+        wlr_log(WLR_INFO, "Default output: %s", out->name);
         layout->default_output = output;
-    }else{
-        wlr_log(WLR_ERROR, "Only one output supported - ignoring %s", out->name);
     }
 
-    wlr_output_layout_add_auto(layout->wlr_output_layout, out);
+    update_mirrors(layout);
 }
 
 void wm_layout_remove_output(struct wm_layout* layout, struct wm_output* output){
+    struct wm_content* content;
+    wl_list_for_each(content, &layout->wm_server->wm_contents, link){
+        if(wm_content_is_view(content)){
+            wm_view_forget_output(wm_cast(wm_view, content), output);
+        }
+    }
+
     if(output == layout->default_output){
         layout->default_output = NULL;
+
+        struct wm_output* other;
+        wl_list_for_each(other, &layout->wm_outputs, link){
+            if(other != output){
+                wlr_log(WLR_INFO, "Default output: %s", other->wlr_output->name);
+                layout->default_output = other;
+                break;
+            }
+        }
     }
     wlr_output_layout_remove(layout->wlr_output_layout, output->wlr_output);
+
+    update_mirrors(layout);
+}
+
+static bool intersects_bounds(struct wm_output* output, struct wlr_fbox* bounds){
+    return wm_output_intersects(output, bounds->x, bounds->y, bounds->width, bounds->height);
+}
+
+/*
+ * Bring wm_content::bounds up to date, should content have changed, and let
+ * views know which outputs they are on now
+ */
+static void update_bounds(struct wm_layout* layout, struct wm_content* content, struct wlr_fbox* old_bounds){
+    *old_bounds = content->bounds;
+    wm_grid_update(layout->wm_server->wm_grid, content);
+
+    struct wlr_fbox* bounds = &content->bounds;
+    if(wm_content_is_view(content) && (bounds->x != old_bounds->x || bounds->y != old_bounds->y ||
+                bounds->width != old_bounds->width || bounds->height != old_bounds->height)){
+        wm_view_update_outputs(wm_cast(wm_view, content));
+    }
+}
+
+/* Damage content on every output it is visible on, or has been before the change */
+static void damage_content(struct wm_layout* layout, struct wm_content* content, struct wlr_surface* origin){
+    struct wlr_fbox old_bounds;
+    update_bounds(layout, content, &old_bounds);
+
+    struct wm_output* output;
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        if(!intersects_bounds(output, &content->bounds) && !intersects_bounds(output, &old_bounds)){
+            continue;
+        }
+
+        wm_content_damage_output(content, output, origin);
+    }
+}
+
+
+/*
+ * Blurred backgrounds are cached until anything below changes. Then they need
+ * to be damaged as a whole, as the blur is taken from what is rendered behind.
+ * content == NULL means everything has changed (and is damaged anyway).
+ */
+static void invalidate_blur(struct wm_layout* layout, struct wm_content* content, bool self){
+    if(wl_list_empty(&layout->wm_server->blurred_contents)) return;
+
+    struct wm_content* blurred;
+    wl_list_for_each(blurred, &layout->wm_server->blurred_contents, blur_link){
+        if(!blurred->blur) continue;
+        if(blurred == content && !self) continue;
+
+        if(content && blurred != content){
+            if(content->z_index > blurred->z_index) continue;
+
+            if(content->display_x >= blurred->display_x + blurred->display_width ||
+                    content->display_y >= blurred->display_y + blurred->display_height ||
+                    content->display_x + content->display_width <= blurred->display_x ||
+                    content->display_y + content->display_height <= blurred->display_y){
+                continue;
+            }
+        }
+
+        wm_renderer_invalidate_blur(blurred->blur);
+        if(content){
+            damage_content(layout, blurred, NULL);
+        }
+    }
+}
+
+/* Contents behind the lock screen are cached while locked, see render in wm_output.c */
+static void invalidate_lock_cache(struct wm_layout* layout){
+    if(!wm_server_is_locked(layout->wm_server)) return;
+
+    struct wm_output* output;
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        wm_renderer_invalidate_lock_cache(output->lock_cache, NULL);
+    }
 }
 
+/*
+ * Content behind the lock screen has changed: the caches are only rendered
+ * again where it is, the outputs only where the lock effect moves it to
+ */
+static void add_bounds(pixman_region32_t* region, struct wm_output* output, struct wlr_fbox* bounds){
+    double scale = output->wlr_output->scale;
+    double x1 = (bounds->x - output->layout_x) * scale;
+    double y1 = (bounds->y - output->layout_y) * scale;
+    double x2 = x1 + bounds->width * scale;
+    double y2 = y1 + bounds->height * scale;
+
+    pixman_region32_union_rect(region, region, floor(x1), floor(y1),
+            ceil(x2) - floor(x1), ceil(y2) - floor(y1));
+}
+
+static void damage_behind_lock(struct wm_layout* layout, struct wm_content* content){
+    struct wlr_fbox old_bounds;
+    update_bounds(layout, content, &old_bounds);
+
+    struct wm_output* output;
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        if(!intersects_bounds(output, &content->bounds) && !intersects_bounds(output, &old_bounds)){
+            continue;
+        }
+
+        pixman_region32_t region;
+        pixman_region32_init(&region);
+        add_bounds(&region, output, &old_bounds);
+        add_bounds(&region, output, &content->bounds);
+        wm_renderer_invalidate_lock_cache(output->lock_cache, &region);
+
+        pixman_region32_t damage;
+        pixman_region32_init(&damage);
+        wm_renderer_lock_effect_damage(output, &region, &damage);
+        wlr_output_damage_add(output->wlr_output_damage, &damage);
+        pixman_region32_fini(&damage);
+        pixman_region32_fini(&region);
+
+        /* Blurred on top of the lock screen, somewhere in the damaged part */
+        struct wm_content* blurred;
+        wl_list_for_each(blurred, &layout->wm_server->blurred_contents, blur_link){
+            if(!blurred->blur || !blurred->lock_enabled) continue;
+            if(!wm_output_intersects(output, blurred->display_x, blurred->display_y,
+                        blurred->display_width, blurred->display_height)){
+                continue;
+            }
+
+            wm_renderer_invalidate_blur(blurred->blur);
+            damage_content(layout, blurred, NULL);
+        }
+    }
+}
 
 void wm_layout_damage_whole(struct wm_layout* layout){
-    if(!layout->default_output) return;
+    /* E.g. a view or popup has been unmapped */
+    wm_grid_invalidate(layout->wm_server->wm_grid);
+
+    invalidate_lock_cache(layout);
+    wm_layout_damage_lock(layout);
+}
+
+void wm_layout_damage_lock(struct wm_layout* layout){
+    invalidate_blur(layout, NULL, true);
 
-    wlr_output_damage_add_whole(layout->default_output->wlr_output_damage);
+    struct wm_output* output;
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        wlr_output_damage_add_whole(output->wlr_output_damage);
+    }
 }
 
 void wm_layout_damage_from(struct wm_layout* layout, struct wm_content* content, struct wlr_surface* origin){
-    if(!layout->default_output) return;
+    /* Every change to the box or the surfaces of a content passes here */
+    wm_grid_mark_dirty(layout->wm_server->wm_grid, content);
+
+    /* Commits and maps of surfaces */
+    if(origin && wm_content_is_view(content)){
+        wm_view_invalidate_surfaces(wm_cast(wm_view, content));
+    }
+
+    if(wl_list_empty(&layout->wm_outputs)) return;
+
+    WM_TRACE_BEGIN("damage");
+
+    /* Commits of own surfaces do not change what is behind */
+    invalidate_blur(layout, content, !origin);
 
     if(!content->lock_enabled && wm_server_is_locked(layout->wm_server)){
-        wm_content_damage_output(content, layout->default_output, NULL);
-    }else{
-        wm_content_damage_output(content, layout->default_output, origin);
+        damage_behind_lock(layout, content);
+        WM_TRACE_END("damage");
+        return;
+    }
+
+    damage_content(layout, content, origin);
+
+    WM_TRACE_END("damage");
+}
+
+void wm_layout_frames(struct wm_layout* layout,
+        void (*callback)(const char* name, const struct wm_output_frame* frames, int n_frames, void* data),
+        void* data){
+    struct wm_output_frame frames[WM_OUTPUT_FRAMES];
+
+    pthread_mutex_lock(&layout->frames_mutex);
+
+    struct wm_output* output;
+    wl_list_for_each_reverse(output, &layout->wm_outputs, link){
+        /* Unwrap the ring */
+        int first = (output->frames_idx - output->n_frames + WM_OUTPUT_FRAMES) % WM_OUTPUT_FRAMES;
+        for(int i=0; i<output->n_frames; i++){
+            frames[i] = output->frames[(first + i) % WM_OUTPUT_FRAMES];
+        }
+
+        callback(output->wlr_output->name, frames, output->n_frames, data);
     }
+
+    pthread_mutex_unlock(&layout->frames_mutex);
 }
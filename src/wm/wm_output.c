@@ -1,18 +1,26 @@
 #define _POSIX_C_SOURCE 200112L
 
+#include "wm/wm.h"
 #include "wm/wm_output.h"
 #include "wm/wm_config.h"
+#include "wm/wm_content_arrays.h"
 #include "wm/wm_layout.h"
 #include "wm/wm_renderer.h"
 #include "wm/wm_server.h"
+#include "wm/wm_trace.h"
 #include "wm/wm_util.h"
 #include "wm/wm_view.h"
 #include "wm/wm_widget.h"
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <wlr/util/log.h>
 #include <wlr/util/region.h>
 #include <wlr/types/wlr_matrix.h>
+#include <wlr/types/wlr_presentation_time.h>
 
 /* #define DEBUG_DAMAGE_HIGHLIGHT */
 /* #define DEBUG_DAMAGE_RERENDER */
@@ -35,73 +43,419 @@ static void handle_mode(struct wl_listener *listener, void *data) {
     struct wm_output *output = wl_container_of(listener, output, mode);
 }
 
+/*
+ * Frame scheduling: the frame event fires right after vblank, but rendering
+ * right away means client commits arriving a few ms later miss the frame. So
+ * delay rendering until it is expected to only just finish before the next
+ * vblank, based on recent render durations plus a safety margin. The margin
+ * grows whenever a scheduled frame misses its vblank and slowly shrinks back
+ * while frames are on time.
+ */
+static void frame_add_render_sample(struct wm_output *output, double msec) {
+    output->render_msec[output->render_msec_idx] = msec;
+    output->render_msec_idx = (output->render_msec_idx + 1) % WM_OUTPUT_RENDER_SAMPLES;
+    if(output->n_render_msec < WM_OUTPUT_RENDER_SAMPLES) output->n_render_msec++;
+}
+
+static double frame_render_estimate(struct wm_output *output) {
+    double estimate = 0.;
+    for(int i=0; i<output->n_render_msec; i++){
+        if(output->render_msec[i] > estimate) estimate = output->render_msec[i];
+    }
+    return estimate;
+}
+
+static void frame_adapt_margin(struct wm_output *output, double late_msec) {
+    struct wm_config *config = output->wm_server->wm_config;
+    double refresh = output->refresh_nsec / 1000000.;
+
+    if(late_msec > .5 * refresh){
+        output->frames_on_time = 0;
+        output->frame_margin = fmin(config->frame_margin_max, 2. * output->frame_margin);
+        wlr_log(WLR_DEBUG, "Output: Missed frame by %.2fms - margin %.2fms", late_msec, output->frame_margin);
+    }else if(++output->frames_on_time >= 120){
+        output->frames_on_time = 0;
+        output->frame_margin = fmax(config->frame_margin_min, output->frame_margin - .5);
+    }
+}
+
+/* Delay (ms) of rendering after the frame event, 0 to render immediately */
+static int frame_delay(struct wm_output *output) {
+    struct wm_config *config = output->wm_server->wm_config;
+    if(!config->frame_scheduling) return 0;
+    if(output->refresh_nsec <= 0 || !output->n_render_msec) return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* Vblanks keep their phase even if nothing has been presented */
+    double refresh = output->refresh_nsec / 1000000.;
+    double since_present = msec_diff_f(now, output->last_present);
+    if(since_present < 0. || since_present > 1000.) return 0;
+    double until_vblank = refresh - fmod(since_present, refresh);
+
+    output->frame_margin = fmax(config->frame_margin_min,
+            fmin(config->frame_margin_max, output->frame_margin));
+    double delay = until_vblank - frame_render_estimate(output) - output->frame_margin;
+    if(delay < 1.) return 0;
+
+    output->frame_target = timespec_add_msec(now, until_vblank);
+    return (int)delay;
+}
+
+/*
+ * Frame records, see wm_layout_frames
+ */
+static int64_t region_area(pixman_region32_t *region) {
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &nrects);
+
+    int64_t area = 0;
+    for(int i=0; i<nrects; i++){
+        area += (int64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+    }
+    return area;
+}
+
+static void frame_record(struct wm_output *output, struct wm_output_frame *frame) {
+    pthread_mutex_lock(&output->wm_layout->frames_mutex);
+
+    frame->seq = output->frames_seq++;
+    output->frames[output->frames_idx] = *frame;
+    output->frames_idx = (output->frames_idx + 1) % WM_OUTPUT_FRAMES;
+    if(output->n_frames < WM_OUTPUT_FRAMES) output->n_frames++;
+    if(output->n_frames_unpresented < output->n_frames) output->n_frames_unpresented++;
+
+    pthread_mutex_unlock(&output->wm_layout->frames_mutex);
+}
+
+/* Present events arrive in the order of commits */
+static void frame_record_present(struct wm_output *output, struct timespec *when) {
+    pthread_mutex_lock(&output->wm_layout->frames_mutex);
+
+    if(output->n_frames_unpresented > 0){
+        int idx = (output->frames_idx - output->n_frames_unpresented + WM_OUTPUT_FRAMES) % WM_OUTPUT_FRAMES;
+        struct wm_output_frame *frame = &output->frames[idx];
+        if(when){
+            frame->present_nsec = timespec_nsec(*when);
+            frame->flags |= WM_OUTPUT_FRAME_PRESENTED;
+        }else{
+            frame->flags |= WM_OUTPUT_FRAME_DISCARDED;
+        }
+        output->n_frames_unpresented--;
+    }
+
+    pthread_mutex_unlock(&output->wm_layout->frames_mutex);
+}
+
+/*
+ * Presentation feedback: surfaces report being sampled while a frame is
+ * rendered; once committed, their feedbacks wait for the present event of
+ * the output, which carries the actual vblank timestamp, refresh and flags
+ */
+static void feedbacks_destroy(struct wl_array *feedbacks) {
+    struct wlr_presentation_feedback **feedback;
+    wl_array_for_each(feedback, feedbacks){
+        /* Sends discarded, if not presented */
+        wlr_presentation_feedback_destroy(*feedback);
+    }
+    feedbacks->size = 0;
+}
+
+static void feedbacks_commit(struct wm_output *output, bool committed) {
+    if(!committed || !output->feedbacks_pending.size){
+        feedbacks_destroy(&output->feedbacks_pending);
+        return;
+    }
+
+    void *dst = wl_array_add(&output->feedbacks_committed, output->feedbacks_pending.size);
+    if(!dst){
+        feedbacks_destroy(&output->feedbacks_pending);
+        return;
+    }
+    memcpy(dst, output->feedbacks_pending.data, output->feedbacks_pending.size);
+    output->feedbacks_pending.size = 0;
+}
+
+static void feedbacks_present(struct wm_output *output, struct wlr_output_event_present *event) {
+    if(event->when){
+        struct wlr_presentation_event presentation_event;
+        wlr_presentation_event_from_output(&presentation_event, event);
+
+        struct wlr_presentation_feedback **feedback;
+        wl_array_for_each(feedback, &output->feedbacks_committed){
+            wlr_presentation_feedback_send_presented(*feedback, &presentation_event);
+        }
+    }
+
+    feedbacks_destroy(&output->feedbacks_committed);
+}
+
+static void present_metric(struct wm_output *output, struct timespec when) {
+    double interval = msec_diff_f(when, output->last_present);
+    if(output->last_present.tv_sec > 0 && interval > 0. && interval < 1000.){
+        if(!output->n_presents || interval < output->present_interval_min) output->present_interval_min = interval;
+        if(!output->n_presents || interval > output->present_interval_max) output->present_interval_max = interval;
+        output->present_interval_sum += interval;
+        output->n_presents++;
+    }
+
+    long msec = msec_diff(when, output->present_metric_since);
+    if(msec < 1000) return;
+
+    if(output->n_presents){
+        wlr_log(WLR_DEBUG, "Output: %s: %.2f frames/s, interval min / avg / max %.2f / %.2f / %.2fms%s",
+                output->wlr_output->name,
+                1000. * output->n_presents / msec,
+                output->present_interval_min,
+                output->present_interval_sum / output->n_presents,
+                output->present_interval_max,
+                output->adaptive_sync ? " (adaptive sync)" : "");
+    }
+
+    output->n_presents = 0;
+    output->present_interval_sum = 0.;
+    output->present_metric_since = when;
+}
+
 static void handle_present(struct wl_listener *listener, void *data) {
     struct wm_output *output = wl_container_of(listener, output, present);
+    struct wlr_output_event_present *event = data;
+
+    frame_record_present(output, event->when);
+    feedbacks_present(output, event);
+
+    if(event->when){
+        present_metric(output, *event->when);
+        output->last_present = *event->when;
+        output->refresh_nsec = event->refresh;
+
+        if(output->frame_target_valid){
+            output->frame_target_valid = false;
+            frame_adapt_margin(output, msec_diff_f(*event->when, output->frame_target));
+        }
+    }
 
     /* 
      * Synchronous update is best scheduled immediately after
-     * frame present
+     * frame present - of one output, the others get the same state
      */
-    wm_server_callback_update(output->wm_server);
+    if(output == output->wm_layout->default_output){
+        wm_server_callback_update(output->wm_server);
+    }
+}
+
+/*
+ * While locked, contents behind the lock screen are rendered into the lock
+ * cache, the lock screen itself on top of the cache with the lock effect
+ * applied
+ */
+enum render_pass {
+    RENDER_PASS_ALL,
+    RENDER_PASS_LOCK_SCENE,
+    RENDER_PASS_LOCK_SCREEN
+};
+
+static bool render_pass_includes(enum render_pass pass, uint8_t flags){
+    switch(pass){
+    case RENDER_PASS_LOCK_SCENE:
+        return !(flags & WM_CONTENT_FLAG_LOCK_ENABLED);
+    case RENDER_PASS_LOCK_SCREEN:
+        return flags & WM_CONTENT_FLAG_LOCK_ENABLED;
+    default:
+        return true;
+    }
 }
 
-static void render(struct wm_output *output, struct timespec now, pixman_region32_t *damage) {
+static void render_blur(struct wm_output *output, struct wm_content *content, pixman_region32_t *damage) {
+    struct wlr_fbox box;
+    wm_content_get_blur_box(content, output, &box);
+
+    wm_renderer_render_blur(output->wm_server->wm_renderer, damage, &content->blur, &box,
+            wm_content_get_corner_radius(content) * output->wlr_output->scale,
+            wm_content_get_opacity(content), content->blur_passes, content->blur_radius);
+}
+
+/* Returns the number of contents drawn */
+static int render_contents(struct wm_output *output, struct timespec now, pixman_region32_t *damage, enum render_pass pass) {
     struct wm_renderer *renderer = output->wm_server->wm_renderer;
 
-    /* Ensure z-index */
-    wm_server_update_contents(output->wm_server);
+    /* Pass, opacity and output culling on the content arrays only */
+    struct wm_content_arrays *arrays = wm_content_arrays_update(output->wm_server);
+    int *visible = arrays->visible;
+    int n_visible = 0;
+
+    int output_width, output_height;
+    wlr_output_effective_resolution(output->wlr_output, &output_width, &output_height);
+    double x1 = output->layout_x;
+    double y1 = output->layout_y;
+    double x2 = x1 + output_width;
+    double y2 = y1 + output_height;
+
+    for(int i=0; i<arrays->n; i++){
+        if(!render_pass_includes(pass, arrays->flags[i])) continue;
+        if(arrays->opacity[i] < 0.0001) continue;
+        if(arrays->bounds_x[i] >= x2 || arrays->bounds_y[i] >= y2 ||
+                arrays->bounds_x[i] + arrays->bounds_width[i] <= x1 ||
+                arrays->bounds_y[i] + arrays->bounds_height[i] <= y1) continue;
+
+        /* Views only mask their root surface, widgets are drawn within the mask entirely */
+        if(arrays->type[i] == WM_CONTENT_TYPE_OTHER &&
+                (arrays->mask_width[i] <= 0. || arrays->mask_height[i] <= 0. ||
+                 arrays->mask_x[i] >= x2 || arrays->mask_y[i] >= y2 ||
+                 arrays->mask_x[i] + arrays->mask_width[i] <= x1 ||
+                 arrays->mask_y[i] + arrays->mask_height[i] <= y1)) continue;
+
+        visible[n_visible++] = i;
+    }
 
-    /* Begin render */
-    wm_renderer_begin(renderer, output);
+    /*
+     * Occlusion culling: walk front to back and hand every content
+     * only the damage not covered by opaque contents above it
+     */
+    pixman_region32_t* content_damage = arrays->damage;
 
-#ifdef DEBUG_DAMAGE_HIGHLIGHT
-    wlr_renderer_clear(renderer->wlr_renderer, (float[]){1, 1, 0, 1});
-#endif
+    pixman_region32_t occluded;
+    pixman_region32_init(&occluded);
 
-    bool needs_clear = false;
-    struct wm_content *r;
-    wl_list_for_each_reverse(r, &output->wm_server->wm_contents, link) {
-        if(wm_content_get_opacity(r) < 1. - 0.0001){
-            needs_clear=true;
+    int n_damaged = 0;
+    for(; n_damaged<n_visible; n_damaged++){
+        int i = visible[n_damaged];
+        struct wm_content *r = arrays->content[i];
+
+        pixman_region32_subtract(&content_damage[n_damaged], damage, &occluded);
+        if(!pixman_region32_not_empty(&content_damage[n_damaged])){
+            /* Nothing below can be visible either */
             break;
         }
+
+        /* Blur needs everything behind, regardless of what covers it */
+        if(arrays->flags[i] & WM_CONTENT_FLAG_BLUR){
+            struct wlr_fbox blur_box;
+            wm_content_get_blur_box(r, output, &blur_box);
+            pixman_region32_t blur_region;
+            pixman_region32_init_rect(&blur_region,
+                    floor(blur_box.x), floor(blur_box.y),
+                    ceil(blur_box.x + blur_box.width) - floor(blur_box.x),
+                    ceil(blur_box.y + blur_box.height) - floor(blur_box.y));
+            pixman_region32_subtract(&occluded, &occluded, &blur_region);
+            pixman_region32_fini(&blur_region);
+        }
+
+        if(arrays->opacity[i] > 1. - 0.0001){
+            wm_content_opaque_region(r, output, &occluded);
+        }
     }
 
-    if(needs_clear){
-        int nrects;
-        pixman_box32_t* rects = pixman_region32_rectangles(damage, &nrects);
-        for(int i=0; i<nrects; i++){
-            struct wlr_box damage_box = {
-                .x = rects[i].x1,
-                .y = rects[i].y1,
-                .width = rects[i].x2 - rects[i].x1,
-                .height = rects[i].y2 - rects[i].y1
-            };
+    /* Only fill what is not covered by opaque contents anyway */
+    pixman_region32_t background;
+    pixman_region32_init(&background);
+    pixman_region32_subtract(&background, damage, &occluded);
+    if(pass == RENDER_PASS_LOCK_SCREEN){
+        wm_renderer_render_lock_cache(renderer, output->lock_cache, &background, output->wm_server->lock_perc);
+    }else{
+        wm_renderer_clear_region(renderer, &background, (float[]){0., 0., 0., 1.});
+    }
+    pixman_region32_fini(&background);
+
+    int n_drawn = 0;
+    for(int j=n_damaged-1; j>=0; j--){
+        int i = visible[j];
+        struct wm_content *r = arrays->content[i];
+        if(pixman_region32_not_empty(&content_damage[j])){
+            if(arrays->flags[i] & WM_CONTENT_FLAG_BLUR){
+                render_blur(output, r, &content_damage[j]);
+            }
+            wm_content_render(r, output, &content_damage[j], now);
+            n_drawn++;
+        }
+    }
+
+    pixman_region32_fini(&occluded);
+
+    return n_drawn;
+}
 
-            float matrix[9];
-            wlr_matrix_project_box(matrix, &damage_box,
-                    WL_OUTPUT_TRANSFORM_NORMAL, 0,
-                    renderer->current->wlr_output->transform_matrix);
-            wlr_render_rect(
-                    renderer->wlr_renderer,
-                    &damage_box, (float[]){0., 0., 0., 1.}, renderer->current->wlr_output->transform_matrix);
+static bool is_mirrored(struct wm_output *output) {
+    struct wm_output *other;
+    wl_list_for_each(other, &output->wm_layout->wm_outputs, link){
+        if(other->mirror_of == output) return true;
+    }
+    return false;
+}
+
+/* Mirrors only repaint, whenever the mirrored output has */
+static void damage_mirrors(struct wm_output *output) {
+    struct wm_output *other;
+    wl_list_for_each(other, &output->wm_layout->wm_outputs, link){
+        if(other->mirror_of == output){
+            wlr_output_damage_add_whole(other->wlr_output_damage);
         }
     }
+}
+
+static void render_mirror(struct wm_output *output, pixman_region32_t *damage) {
+    struct wm_renderer *renderer = output->wm_server->wm_renderer;
+
+    wm_renderer_begin(renderer, output, damage);
+
+    /* Bars around the scaled frame */
+    wm_renderer_clear_region(renderer, damage, (float[]){0., 0., 0., 1.});
+    wm_renderer_render_mirror(renderer, output->mirror_of->mirror, damage);
+
+    wm_renderer_end(renderer, damage, output);
+}
+
+/* Returns whether the frame has been committed */
+static bool render(struct wm_output *output, struct timespec now, pixman_region32_t *damage, struct wm_output_frame *frame) {
+    struct wm_renderer *renderer = output->wm_server->wm_renderer;
+
+    if(output->mirror_of){
+        render_mirror(output, damage);
+        goto commit;
+    }
+
+    /* Begin render */
+    wm_renderer_begin(renderer, output, damage);
+
+#ifdef DEBUG_DAMAGE_HIGHLIGHT
+    wlr_renderer_clear(renderer->wlr_renderer, (float[]){1, 1, 0, 1});
+#endif
 
     /* Do render */
-    if(output == output->wm_server->wm_layout->default_output){
-        struct wm_content *r;
-        wl_list_for_each_reverse(r, &output->wm_server->wm_contents, link) {
-            if(wm_content_get_opacity(r) < 0.0001) continue;
-            wm_content_render(r, output, damage, now);
+    if(wm_server_is_locked(output->wm_server)){
+        /* Contents behind the lock screen only when they have changed */
+        pixman_region32_t scene_damage;
+        pixman_region32_init(&scene_damage);
+        if(wm_renderer_begin_lock_cache(renderer, &output->lock_cache, damage, &scene_damage)){
+            frame->n_contents += render_contents(output, now, &scene_damage, RENDER_PASS_LOCK_SCENE);
+            wm_renderer_end_lock_cache(renderer, output->lock_cache);
         }
+        pixman_region32_fini(&scene_damage);
+
+        frame->n_contents += render_contents(output, now, damage, RENDER_PASS_LOCK_SCREEN);
     }else{
-        wlr_renderer_clear(renderer->wlr_renderer, (float[]){.3, .3, .3, 1});
+        if(output->lock_cache){
+            wm_renderer_destroy_lock_cache(renderer, output->lock_cache);
+            output->lock_cache = NULL;
+        }
+        frame->n_contents += render_contents(output, now, damage, RENDER_PASS_ALL);
+    }
+
+    if(is_mirrored(output)){
+        wm_renderer_capture_mirror(renderer, &output->mirror, damage);
+        damage_mirrors(output);
+    }else if(output->mirror){
+        wm_renderer_destroy_mirror(renderer, output->mirror);
+        output->mirror = NULL;
     }
 
     /* End render */
     wm_renderer_end(renderer, damage, output);
 
+commit:
+    wm_renderer_get_gl_stats(renderer, &frame->gl_issued, &frame->gl_skipped);
+
     /* Commit */
 #ifdef DEBUG_DAMAGE_HIGHLIGHT
     pixman_region32_t frame_damage;
@@ -112,19 +466,140 @@ static void render(struct wm_output *output, struct timespec now, pixman_region3
             output->wlr_output, &output->wlr_output_damage->current);
     pixman_region32_fini(&frame_damage);
 #else
-    wlr_output_set_damage(
-            output->wlr_output, &output->wlr_output_damage->current);
+    /* Damage is tracked in output coordinates, the backend wants buffer coordinates */
+    int width, height;
+    wlr_output_transformed_resolution(output->wlr_output, &width, &height);
+    pixman_region32_t frame_damage;
+    pixman_region32_init(&frame_damage);
+    wlr_region_transform(&frame_damage, &output->wlr_output_damage->current,
+            wlr_output_transform_invert(output->wlr_output->transform), width, height);
+    wlr_output_set_damage(output->wlr_output, &frame_damage);
+    pixman_region32_fini(&frame_damage);
 #endif
 
 
-    if (!wlr_output_commit(output->wlr_output)) {
+    struct timespec commit_start, commit_end;
+    clock_gettime(CLOCK_MONOTONIC, &commit_start);
+    bool committed = wlr_output_commit(output->wlr_output);
+    feedbacks_commit(output, committed);
+    clock_gettime(CLOCK_MONOTONIC, &commit_end);
+
+    frame->render_usec = (timespec_nsec(commit_start) - frame->start_nsec) / 1000;
+    frame->commit_usec = (timespec_nsec(commit_end) - timespec_nsec(commit_start)) / 1000;
+
+    if (!committed) {
         wlr_log(WLR_DEBUG, "Commit frame failed");
     }
+    return committed;
 }
 
-static void handle_damage_frame(struct wl_listener *listener, void *data) {
-    struct wm_output *output = wl_container_of(listener, output, damage_frame);
+/* Topmost visible content, if it is a fullscreen view with nothing on top */
+static struct wm_view* fullscreen_view(struct wm_output* output){
+    struct wm_server* server = output->wm_server;
+    if(server->lock_perc > 0.001) return NULL;
+
+    struct wm_content_arrays* arrays = wm_content_arrays_update(server);
+    for(int i=0; i<arrays->n; i++){
+        if(arrays->opacity[i] < 0.0001) continue;
+        if(!wm_output_intersects(output, arrays->bounds_x[i], arrays->bounds_y[i],
+                    arrays->bounds_width[i], arrays->bounds_height[i])) continue;
+
+        /* Anything else on top, e.g. drag icons or widgets, requires composition */
+        if(arrays->type[i] != WM_CONTENT_TYPE_VIEW) return NULL;
+
+        struct wm_view* view = wm_cast(wm_view, arrays->content[i]);
+        if(!wm_view_is_fullscreen(view)) return NULL;
+
+        return view;
+    }
+
+    return NULL;
+}
+
+/*
+ * Direct scanout: if the topmost visible content is a fullscreen view
+ * consisting of a single opaque surface covering the whole output, attach
+ * its buffer to the output instead of compositing
+ */
+static struct wlr_surface* scanout_candidate(struct wm_output* output){
+    /* Mirrors need the composited frame */
+    if(is_mirrored(output)) return NULL;
+
+    struct wm_view* view = fullscreen_view(output);
+    if(!view) return NULL;
+
+    return wm_view_get_scanout_surface(view, output);
+}
+
+static bool scan_out(struct wm_output* output, struct wlr_surface* surface, struct timespec now){
+    wlr_output_attach_buffer(output->wlr_output, &surface->buffer->base);
+    if(!wlr_output_test(output->wlr_output)){
+        wlr_output_rollback(output->wlr_output);
+        return false;
+    }
+
+    wlr_surface_send_frame_done(surface, &now);
+    wm_output_surface_sampled(output, surface);
+
+    bool committed = wlr_output_commit(output->wlr_output);
+    feedbacks_commit(output, committed);
+
+    if (!committed) {
+        wlr_log(WLR_DEBUG, "Commit scanout frame failed");
+        return false;
+    }
+    return true;
+}
+
+/* Returns whether a frame has been committed */
+static bool output_frame(struct wm_output *output) {
+    /* Pick up the newest results of callback_update */
+    wm_callback_apply_update();
+
+    struct wlr_surface* scanout_surface = scanout_candidate(output);
+    if(scanout_surface){
+        /* Nothing new to show */
+        if(output->scanout && !pixman_region32_not_empty(&output->wlr_output_damage->current)){
+            return false;
+        }
+
+        struct wm_output_frame frame = {
+            .damage_area = region_area(&output->wlr_output_damage->current),
+            .n_contents = 1,
+            .flags = WM_OUTPUT_FRAME_SCANOUT
+        };
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        WM_TRACE_BEGIN("scanout");
+        bool scanned_out = scan_out(output, scanout_surface, now);
+        WM_TRACE_END("scanout");
+
+        if(scanned_out){
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            frame.start_nsec = timespec_nsec(now);
+            frame.commit_usec = (timespec_nsec(end) - frame.start_nsec) / 1000;
+            frame_record(output, &frame);
+
+            if(!output->scanout){
+                wlr_log(WLR_DEBUG, "Output: Starting direct scanout");
+            }
+            output->scanout = true;
+            return true;
+        }
+    }
+
+    if(output->scanout){
+        wlr_log(WLR_DEBUG, "Output: Stopping direct scanout");
+        output->scanout = false;
 
+        /* Buffer contents are unknown after scanout */
+        wlr_output_damage_add_whole(output->wlr_output_damage);
+    }
+
+    bool committed = false;
     bool needs_frame;
     pixman_region32_t damage;
     pixman_region32_init(&damage);
@@ -139,10 +614,22 @@ static void handle_damage_frame(struct wl_listener *listener, void *data) {
             struct timespec now;
             clock_gettime(CLOCK_MONOTONIC, &now);
 
-            TIMER_START(render)
-            render(output, now, &damage);
-            TIMER_STOP(render);
-            TIMER_PRINT(render);
+            struct wm_output_frame frame = {
+                .start_nsec = timespec_nsec(now),
+                .damage_area = region_area(&damage)
+            };
+
+            WM_TRACE_BEGIN("render");
+            committed = render(output, now, &damage, &frame);
+            WM_TRACE_END("render");
+
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            frame_add_render_sample(output, msec_diff_f(end, now));
+
+            if(committed){
+                frame_record(output, &frame);
+            }
         } else {
             wlr_output_rollback(output->wlr_output);
         }
@@ -150,7 +637,39 @@ static void handle_damage_frame(struct wl_listener *listener, void *data) {
         pixman_region32_fini(&damage);
     }
 
+    return committed;
+}
+
+static int handle_frame_timer(void *data) {
+    struct wm_output *output = data;
 
+    output->frame_pending = false;
+    output->frame_target_valid = output_frame(output);
+    return 0;
+}
+
+static void handle_damage_frame(struct wl_listener *listener, void *data) {
+    struct wm_output *output = wl_container_of(listener, output, damage_frame);
+
+    /* Already scheduled */
+    if(output->frame_pending) return;
+
+    /*
+     * With adaptive sync, a fullscreen client sets the pace: present as soon
+     * as it commits, the display waits for us. Composited scenes keep the
+     * regular schedule.
+     */
+    int delay = 0;
+    if(!output->adaptive_sync || !fullscreen_view(output)){
+        delay = frame_delay(output);
+    }
+    if(delay > 0){
+        output->frame_pending = true;
+        wl_event_source_timer_update(output->frame_timer, delay);
+        return;
+    }
+
+    output_frame(output);
 }
 
 static void handle_damage_destroy(struct wl_listener *listener, void *data) {
@@ -171,6 +690,34 @@ void wm_output_init(struct wm_output *output, struct wm_server *server,
     output->wlr_output = out;
 
     output->wlr_output_damage = wlr_output_damage_create(output->wlr_output);
+    output->scanout = false;
+    output->layout_x = 0;
+    output->layout_y = 0;
+    output->stencil = NULL;
+    output->lock_cache = NULL;
+    output->mirror_of = NULL;
+    output->mirror = NULL;
+
+    output->frame_timer = wl_event_loop_add_timer(server->wl_event_loop,
+            handle_frame_timer, output);
+    output->frame_pending = false;
+    output->last_present = (struct timespec){ 0 };
+    output->refresh_nsec = 0;
+    output->n_render_msec = 0;
+    output->render_msec_idx = 0;
+    output->frame_margin = server->wm_config->frame_margin_min;
+    output->frames_on_time = 0;
+    output->frame_target_valid = false;
+    output->adaptive_sync = false;
+    output->n_presents = 0;
+    output->present_interval_sum = 0.;
+    output->present_metric_since = (struct timespec){ 0 };
+    output->n_frames = 0;
+    output->frames_idx = 0;
+    output->frames_seq = 0;
+    output->n_frames_unpresented = 0;
+    wl_array_init(&output->feedbacks_pending);
+    wl_array_init(&output->feedbacks_committed);
 
     /* Set mode */
     if (!wl_list_empty(&output->wlr_output->modes)) {
@@ -211,10 +758,24 @@ void wm_output_init(struct wm_output *output, struct wm_server *server,
     }
 
     wlr_output_enable(output->wlr_output, true);
+
+    if(server->wm_config->adaptive_sync){
+        wlr_output_enable_adaptive_sync(output->wlr_output, true);
+        if(!wlr_output_test(output->wlr_output)){
+            wlr_log(WLR_INFO, "New output: Adaptive sync not supported");
+            wlr_output_enable_adaptive_sync(output->wlr_output, false);
+        }
+    }
+
     if (!wlr_output_commit(output->wlr_output)) {
         wlr_log(WLR_INFO, "New output: Could not commit");
     }
 
+    output->adaptive_sync = output->wlr_output->adaptive_sync_status == WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED;
+    if(output->adaptive_sync){
+        wlr_log(WLR_INFO, "New output: Adaptive sync enabled");
+    }
+
     /* Set HiDPI scale */
     wlr_output_set_scale(output->wlr_output,
             output->wm_server->wm_config->output_scale);
@@ -241,10 +802,80 @@ void wm_output_init(struct wm_output *output, struct wm_server *server,
 }
 
 void wm_output_destroy(struct wm_output *output) {
+    /* Not to be touched by the layout change anymore */
+    pthread_mutex_lock(&output->wm_layout->frames_mutex);
+    wl_list_remove(&output->link);
+    pthread_mutex_unlock(&output->wm_layout->frames_mutex);
     wm_layout_remove_output(output->wm_layout, output);
+    wm_renderer_destroy_stencil(output->wm_server->wm_renderer, output->stencil);
+    wm_renderer_destroy_lock_cache(output->wm_server->wm_renderer, output->lock_cache);
+    wm_renderer_destroy_mirror(output->wm_server->wm_renderer, output->mirror);
+
+    feedbacks_destroy(&output->feedbacks_pending);
+    feedbacks_destroy(&output->feedbacks_committed);
+    wl_array_release(&output->feedbacks_pending);
+    wl_array_release(&output->feedbacks_committed);
     wl_list_remove(&output->destroy.link);
     wl_list_remove(&output->commit.link);
     wl_list_remove(&output->mode.link);
     wl_list_remove(&output->present.link);
-    wl_list_remove(&output->link);
+
+    wl_event_source_remove(output->frame_timer);
+}
+
+void wm_output_surface_sampled(struct wm_output* output, struct wlr_surface* surface){
+    /* Only if the client has asked for feedback, and not yet on another output */
+    struct wlr_presentation_feedback* feedback =
+        wlr_presentation_surface_sampled(output->wm_server->wlr_presentation, surface);
+    if(!feedback) return;
+
+    struct wlr_presentation_feedback** slot = wl_array_add(&output->feedbacks_pending, sizeof(*slot));
+    if(!slot){
+        wlr_presentation_feedback_destroy(feedback);
+        return;
+    }
+    *slot = feedback;
+}
+
+void wm_output_predict_present(struct wm_output* output, struct timespec now,
+                               int64_t* present_nsec, int* refresh_nsec){
+    struct wm_config *config = output->wm_server->wm_config;
+
+    /* Until the first present event, trust the mode */
+    int refresh = output->refresh_nsec;
+    if(refresh <= 0 && output->wlr_output->refresh > 0){
+        refresh = (int)(1000000000000LL / output->wlr_output->refresh);
+    }
+
+    *present_nsec = timespec_nsec(now);
+    *refresh_nsec = refresh > 0 ? refresh : 0;
+    if(refresh <= 0) return;
+
+    double refresh_msec = refresh / 1000000.;
+    double since_present = msec_diff_f(now, output->last_present);
+    if(output->last_present.tv_sec == 0 || since_present < 0. || since_present > 1000.){
+        *present_nsec += refresh;
+        return;
+    }
+
+    /*
+     * The frame for the next vblank is rendered shortly before it when
+     * scheduled (see frame_delay), otherwise right after the previous one
+     */
+    double until_vblank = refresh_msec - fmod(since_present, refresh_msec);
+    double render_ahead = config->frame_scheduling && output->n_render_msec ?
+        frame_render_estimate(output) + output->frame_margin : refresh_msec;
+    if(until_vblank < render_ahead) until_vblank += refresh_msec;
+
+    *present_nsec += (int64_t)(until_vblank * 1000000.);
+}
+
+bool wm_output_intersects(struct wm_output* output, double x, double y, double width, double height){
+    if(output->mirror_of) return false;
+
+    int output_width, output_height;
+    wlr_output_effective_resolution(output->wlr_output, &output_width, &output_height);
+
+    return x < output->layout_x + output_width && y < output->layout_y + output_height &&
+        x + width > output->layout_x && y + height > output->layout_y;
 }
@@ -2,9 +2,13 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wayland-server.h>
 #include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_box.h>
 #include <wlr/types/wlr_matrix.h>
 #include <render/gles2.h>
 
@@ -13,12 +17,17 @@
 #include "wm/wm_output.h"
 
 #ifdef WM_CUSTOM_RENDERER
-static const GLfloat verts[] = {
-	1, 0, // top right
-	0, 0, // top left
-	1, 1, // bottom right
-	0, 1, // bottom left
-};
+
+/*
+ * Fixed attribute locations shared by all programs, so the vertex layout
+ * only has to be set up once per flush
+ */
+#define ATTRIB_POS 0
+#define ATTRIB_TEXCOORD 1
+#define ATTRIB_LOCAL 2
+#define ATTRIB_RECT 3
+#define ATTRIB_LOCK 4
+#define ATTRIB_ALL ((1 << (ATTRIB_LOCK + 1)) - 1)
 
 static const float flip_180[9] = {
 	1.0f, 0.0f, 0.0f,
@@ -26,11 +35,18 @@ static const float flip_180[9] = {
 	0.0f, 0.0f, 1.0f,
 };
 
+/* Two triangles per quad, as (u, v) in the unit square */
+static const GLfloat quad_corners[6][2] = {
+	{0, 0}, {1, 0}, {0, 1},
+	{1, 0}, {1, 1}, {0, 1},
+};
+
 static GLuint compile_shader(struct wlr_gles2_renderer *renderer,
-		GLuint type, const GLchar *src) {
+		GLuint type, const GLchar *defines, const GLchar *src) {
 
 	GLuint shader = glCreateShader(type);
-	glShaderSource(shader, 1, &src, NULL);
+	const GLchar *srcs[] = { defines, src };
+	glShaderSource(shader, 2, srcs, NULL);
 	glCompileShader(shader);
 
 	GLint ok;
@@ -44,14 +60,14 @@ static GLuint compile_shader(struct wlr_gles2_renderer *renderer,
 }
 
 static GLuint link_program(struct wlr_gles2_renderer *renderer,
-		const GLchar *vert_src, const GLchar *frag_src) {
+		const GLchar *defines, const GLchar *vert_src, const GLchar *frag_src) {
 
-	GLuint vert = compile_shader(renderer, GL_VERTEX_SHADER, vert_src);
+	GLuint vert = compile_shader(renderer, GL_VERTEX_SHADER, defines, vert_src);
 	if (!vert) {
 		goto error;
 	}
 
-	GLuint frag = compile_shader(renderer, GL_FRAGMENT_SHADER, frag_src);
+	GLuint frag = compile_shader(renderer, GL_FRAGMENT_SHADER, defines, frag_src);
 	if (!frag) {
 		glDeleteShader(vert);
 		goto error;
@@ -60,6 +76,13 @@ static GLuint link_program(struct wlr_gles2_renderer *renderer,
 	GLuint prog = glCreateProgram();
 	glAttachShader(prog, vert);
 	glAttachShader(prog, frag);
+
+	glBindAttribLocation(prog, ATTRIB_POS, "pos");
+	glBindAttribLocation(prog, ATTRIB_TEXCOORD, "texcoord");
+	glBindAttribLocation(prog, ATTRIB_LOCAL, "local");
+	glBindAttribLocation(prog, ATTRIB_RECT, "rect");
+	glBindAttribLocation(prog, ATTRIB_LOCK, "lock");
+
 	glLinkProgram(prog);
 
 	glDetachShader(prog, vert);
@@ -80,265 +103,975 @@ error:
 	return 0;
 }
 
-static bool render_subtexture_with_matrix(
+static int shader_features(bool has_alpha, const struct wlr_fbox *rect,
+		const struct wlr_box *display_box, float corner_radius) {
+	int features = 0;
+	if (has_alpha) {
+		features |= WM_RENDERER_SHADER_ALPHA;
+	}
+	if (rect->x > 0.001 || rect->y > 0.001 ||
+			rect->x + rect->width < display_box->width - 0.001 ||
+			rect->y + rect->height < display_box->height - 0.001) {
+		features |= WM_RENDERER_SHADER_MASK;
+	}
+	if (corner_radius > 0.001) {
+		features |= WM_RENDERER_SHADER_CORNERS;
+	}
+	return features;
+}
+
+/*
+ * GL state cache
+ */
+static void gl_state_reset(struct wm_renderer* renderer){
+    struct wm_renderer_gl_state* state = &renderer->gl_state;
+    state->program_valid = false;
+    state->texture_valid = false;
+    state->external_bound = false;
+    state->array_buffer_valid = false;
+    state->attribs_valid = false;
+    state->n_filtered = 0;
+
+    for(int i=0; i<WM_RENDERER_SHADER_VARIANTS; i++){
+        renderer->shaders[i].proj_valid = false;
+    }
+    renderer->shader_solid.proj_valid = false;
+}
+
+static void gl_use_program(struct wm_renderer* renderer, GLuint program){
+    struct wm_renderer_gl_state* state = &renderer->gl_state;
+    if(state->program_valid && state->program == program){
+        renderer->gl_stats.skipped++;
+        return;
+    }
+
+    glUseProgram(program);
+    state->program_valid = true;
+    state->program = program;
+    renderer->gl_stats.issued++;
+}
+
+static void gl_bind_texture(struct wm_renderer* renderer, GLenum target, GLuint tex){
+    struct wm_renderer_gl_state* state = &renderer->gl_state;
+    if(state->texture_valid && state->target == target && state->tex == tex){
+        renderer->gl_stats.skipped++;
+        return;
+    }
+
+    glBindTexture(target, tex);
+    state->texture_valid = true;
+    state->target = target;
+    state->tex = tex;
+    state->external_bound |= target == GL_TEXTURE_EXTERNAL_OES;
+    renderer->gl_stats.issued++;
+}
+
+/* Expects the texture to be bound; a texture keeps its filter for the frame */
+static void gl_texture_filters(struct wm_renderer* renderer, GLenum target, GLuint tex, GLint filter){
+    struct wm_renderer_gl_state* state = &renderer->gl_state;
+    for(int i=0; i<state->n_filtered; i++){
+        if(state->filtered[i] == tex){
+            renderer->gl_stats.skipped += 2;
+            return;
+        }
+    }
+
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, filter);
+    renderer->gl_stats.issued += 2;
+
+    if(state->n_filtered == state->filtered_capacity){
+        int capacity = state->filtered_capacity ? 2 * state->filtered_capacity : 32;
+        GLuint* filtered = realloc(state->filtered, capacity * sizeof(GLuint));
+        if(!filtered) return;
+        state->filtered = filtered;
+        state->filtered_capacity = capacity;
+    }
+    state->filtered[state->n_filtered++] = tex;
+}
+
+static void gl_bind_array_buffer(struct wm_renderer* renderer, GLuint buffer){
+    struct wm_renderer_gl_state* state = &renderer->gl_state;
+    if(state->array_buffer_valid && state->array_buffer == buffer){
+        renderer->gl_stats.skipped++;
+        return;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    state->array_buffer_valid = true;
+    state->array_buffer = buffer;
+    renderer->gl_stats.issued++;
+}
+
+static void gl_enable_attribs(struct wm_renderer* renderer, GLuint attribs){
+    struct wm_renderer_gl_state* state = &renderer->gl_state;
+    for(int i=ATTRIB_POS; i<=ATTRIB_LOCK; i++){
+        GLuint bit = 1 << i;
+        if(state->attribs_valid && (state->attribs & bit) == (attribs & bit)){
+            renderer->gl_stats.skipped++;
+            continue;
+        }
+
+        if(attribs & bit){
+            glEnableVertexAttribArray(i);
+        }else{
+            glDisableVertexAttribArray(i);
+        }
+        renderer->gl_stats.issued++;
+    }
+    state->attribs_valid = true;
+    state->attribs = attribs;
+}
+
+/* Expects the program to be in use */
+static void gl_uniform_proj(struct wm_renderer* renderer, struct wm_renderer_shader* shader, const GLfloat proj[static 9]){
+    if(shader->proj_valid && !memcmp(shader->proj_value, proj, sizeof(shader->proj_value))){
+        renderer->gl_stats.skipped++;
+        return;
+    }
+
+    glUniformMatrix3fv(shader->proj, 1, GL_FALSE, proj);
+    memcpy(shader->proj_value, proj, sizeof(shader->proj_value));
+    shader->proj_valid = true;
+    renderer->gl_stats.issued++;
+}
+
+static void gl_draw_arrays(struct wm_renderer* renderer, GLint first, GLsizei count){
+    glDrawArrays(GL_TRIANGLES, first, count);
+    renderer->gl_stats.issued++;
+}
+
+/* Leave the state wlroots expects for its own drawing (client-side arrays) */
+static void gl_release(struct wm_renderer* renderer){
+    gl_enable_attribs(renderer, 0);
+    gl_bind_array_buffer(renderer, 0);
+    gl_bind_texture(renderer, GL_TEXTURE_2D, 0);
+
+    /* Separate binding point */
+    if(renderer->gl_state.external_bound){
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+        renderer->gl_state.external_bound = false;
+    }
+
+    renderer->gl_state.program_valid = false;
+    renderer->gl_state.texture_valid = false;
+    renderer->gl_state.attribs_valid = false;
+}
+
+/*
+ * Batch
+ */
+static struct wm_renderer_vertex* batch_reserve(struct wm_renderer_batch* batch, int n){
+    if(batch->n_vertices + n > batch->vertices_capacity){
+        int capacity = batch->vertices_capacity ? 2 * batch->vertices_capacity : 6 * 64;
+        while(capacity < batch->n_vertices + n) capacity *= 2;
+
+        struct wm_renderer_vertex* vertices = realloc(batch->vertices, capacity * sizeof(struct wm_renderer_vertex));
+        if(!vertices){
+            wlr_log(WLR_ERROR, "Could not grow render batch");
+            return NULL;
+        }
+        batch->vertices = vertices;
+        batch->vertices_capacity = capacity;
+    }
+
+    struct wm_renderer_vertex* res = batch->vertices + batch->n_vertices;
+    batch->n_vertices += n;
+    return res;
+}
+
+static void batch_add_run(struct wm_renderer_batch* batch, struct wm_renderer_shader* shader,
+        GLenum target, GLuint tex, GLint filter, int first, int count){
+    if(batch->n_runs > 0){
+        struct wm_renderer_batch_run* last = &batch->runs[batch->n_runs - 1];
+        if(last->shader == shader && last->target == target && last->tex == tex &&
+                last->filter == filter && last->first + last->count == first){
+            last->count += count;
+            return;
+        }
+    }
+
+    if(batch->n_runs == batch->runs_capacity){
+        int capacity = batch->runs_capacity ? 2 * batch->runs_capacity : 32;
+        struct wm_renderer_batch_run* runs = realloc(batch->runs, capacity * sizeof(struct wm_renderer_batch_run));
+        if(!runs){
+            wlr_log(WLR_ERROR, "Could not grow render batch");
+            batch->n_vertices = first;
+            return;
+        }
+        batch->runs = runs;
+        batch->runs_capacity = capacity;
+    }
+
+    batch->runs[batch->n_runs] = (struct wm_renderer_batch_run){
+        .shader = shader,
+        .target = target,
+        .tex = tex,
+        .filter = filter,
+        .first = first,
+        .count = count
+    };
+    batch->n_runs++;
+}
+
+/* Solid quads only use pos and rect, the latter holding the colour */
+static bool batch_push_solid(struct wm_renderer_batch* batch, const pixman_box32_t* box, const float color[static 4]){
+    struct wm_renderer_vertex* v = batch_reserve(batch, 6);
+    if(!v) return false;
+
+    for(int i=0; i<6; i++){
+        v[i] = (struct wm_renderer_vertex){
+            .pos = {
+                quad_corners[i][0] ? box->x2 : box->x1,
+                quad_corners[i][1] ? box->y2 : box->y1 },
+            .rect = { color[0], color[1], color[2], color[3] }
+        };
+    }
+    return true;
+}
+
+static void batch_draw_runs(struct wm_renderer* renderer){
+    struct wm_renderer_batch* batch = &renderer->batch;
+    for(int i=0; i<batch->n_runs; i++){
+        struct wm_renderer_batch_run* run = &batch->runs[i];
+
+        gl_use_program(renderer, run->shader->shader);
+        gl_uniform_proj(renderer, run->shader, batch->proj);
+
+        /* Solid runs come without texture */
+        if(run->tex){
+            gl_bind_texture(renderer, run->target, run->tex);
+            gl_texture_filters(renderer, run->target, run->tex, run->filter);
+        }
+
+        gl_draw_arrays(renderer, run->first, run->count);
+    }
+}
+
+static void stencil_release(struct wm_renderer_stencil* stencil){
+    if(stencil->rbo){
+        glDeleteRenderbuffers(1, &stencil->rbo);
+        stencil->rbo = 0;
+    }
+    stencil->n_fbos = 0;
+    stencil->unsupported = false;
+}
+
+/*
+ * Attach the stencil buffer of the current target to the framebuffer bound
+ * (for outputs the one wlroots bound for this frame)
+ */
+static bool batch_ensure_stencil(struct wm_renderer_stencil* stencil, int width, int height){
+    GLint fbo = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &fbo);
+    if(!fbo){
+        GLint bits = 0;
+        glGetIntegerv(GL_STENCIL_BITS, &bits);
+        return bits > 0;
+    }
+
+    if(stencil->rbo && (stencil->width != width || stencil->height != height)){
+        stencil_release(stencil);
+    }
+    if(stencil->unsupported) return false;
+
+    if(!stencil->rbo){
+        glGenRenderbuffers(1, &stencil->rbo);
+        glBindRenderbuffer(GL_RENDERBUFFER, stencil->rbo);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_STENCIL_INDEX8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        stencil->width = width;
+        stencil->height = height;
+    }
+
+    /*
+     * The attachment query alone is not enough: a framebuffer might still
+     * hold a deleted renderbuffer whose name has been reused for rbo. And
+     * the list alone neither, as wlroots recycles framebuffer names.
+     */
+    GLint attached = 0;
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT,
+            GL_FRAMEBUFFER_ATTACHMENT_OBJECT_NAME, &attached);
+    for(int i=0; i<stencil->n_fbos; i++){
+        if(stencil->fbos[i] == (GLuint)fbo && (GLuint)attached == stencil->rbo){
+            return true;
+        }
+    }
+
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT,
+            GL_RENDERBUFFER, stencil->rbo);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+        wlr_log(WLR_DEBUG, "Stencil attachment not supported - falling back to scissoring");
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT, GL_RENDERBUFFER, 0);
+        stencil->unsupported = true;
+        return false;
+    }
+
+    /* Oldest first, swapchains are short */
+    if(stencil->n_fbos == WM_RENDERER_STENCIL_FBOS){
+        memmove(&stencil->fbos[0], &stencil->fbos[1], (WM_RENDERER_STENCIL_FBOS - 1) * sizeof(GLuint));
+        stencil->n_fbos--;
+    }
+    stencil->fbos[stencil->n_fbos++] = fbo;
+    return true;
+}
+
+/*
+ * Draw all quads collected since wm_renderer_begin, clipped to damage. The
+ * damage region is written to the stencil buffer once; if no stencil buffer
+ * is available, fall back to one scissored pass per damage rectangle.
+ */
+static void batch_flush(struct wm_renderer* renderer, pixman_region32_t* damage){
+    struct wm_renderer_batch* batch = &renderer->batch;
+    if(!batch->n_runs){
+        batch->n_vertices = 0;
+        return;
+    }
+
+    int nrects;
+    pixman_box32_t* rects = pixman_region32_rectangles(damage, &nrects);
+
+    /* A single rectangle is cheaper as a scissor */
+    bool stencil = nrects > 1 && batch->stencil;
+    int damage_first = batch->n_vertices;
+    if(stencil){
+        static const float black[4] = { 0., 0., 0., 1. };
+        for(int i=0; i<nrects; i++){
+            if(!batch_push_solid(batch, &rects[i], black)){
+                stencil = false;
+                break;
+            }
+        }
+    }
+
+    gl_bind_array_buffer(renderer, renderer->vbo);
+    size_t size = batch->n_vertices * sizeof(struct wm_renderer_vertex);
+    if(size > renderer->vbo_size){
+        renderer->vbo_size = size;
+    }
+    /* Orphan the previous contents, so we don't wait for pending draws */
+    glBufferData(GL_ARRAY_BUFFER, renderer->vbo_size, NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, size, batch->vertices);
+
+    GLsizei stride = sizeof(struct wm_renderer_vertex);
+    glVertexAttribPointer(ATTRIB_POS, 2, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(struct wm_renderer_vertex, pos));
+    glVertexAttribPointer(ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(struct wm_renderer_vertex, texcoord));
+    glVertexAttribPointer(ATTRIB_LOCAL, 2, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(struct wm_renderer_vertex, local));
+    glVertexAttribPointer(ATTRIB_RECT, 4, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(struct wm_renderer_vertex, rect));
+    glVertexAttribPointer(ATTRIB_LOCK, 1, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(struct wm_renderer_vertex, lock_perc));
+    gl_enable_attribs(renderer, ATTRIB_ALL);
+
+    glActiveTexture(GL_TEXTURE0);
+
+    if(stencil){
+        wlr_renderer_scissor(renderer->wlr_renderer, NULL);
+
+        glEnable(GL_STENCIL_TEST);
+        glStencilMask(0xFF);
+        glClearStencil(0);
+        glClear(GL_STENCIL_BUFFER_BIT);
+
+        glStencilFunc(GL_ALWAYS, 1, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+        gl_use_program(renderer, renderer->shader_solid.shader);
+        gl_uniform_proj(renderer, &renderer->shader_solid, batch->proj);
+        gl_draw_arrays(renderer, damage_first, 6 * nrects);
+
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glStencilFunc(GL_EQUAL, 1, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+
+        batch_draw_runs(renderer);
+
+        glDisable(GL_STENCIL_TEST);
+    }else{
+        /* Damage is in output coordinates (as the quads), scissor boxes in buffer coordinates */
+        struct wlr_output* wlr_output = renderer->current->wlr_output;
+        enum wl_output_transform transform = wlr_output_transform_invert(wlr_output->transform);
+        int width, height;
+        wlr_output_transformed_resolution(wlr_output, &width, &height);
+
+        for(int i=0; i<nrects; i++){
+            struct wlr_box damage_box = {
+                .x = rects[i].x1,
+                .y = rects[i].y1,
+                .width = rects[i].x2 - rects[i].x1,
+                .height = rects[i].y2 - rects[i].y1
+            };
+            wlr_box_transform(&damage_box, &damage_box, transform, width, height);
+            wlr_renderer_scissor(renderer->wlr_renderer, &damage_box);
+            batch_draw_runs(renderer);
+        }
+        wlr_renderer_scissor(renderer->wlr_renderer, NULL);
+    }
+
+    gl_release(renderer);
+
+    batch->n_vertices = 0;
+    batch->n_runs = 0;
+}
+
+/*
+ * Append a textured quad to the batch. rect is the visible rounded box
+ * relative to display_box; it is expected to lie within display_box and
+ * corner_radius to fit inside it. The quad is cut down to clip (in output
+ * coordinates); all attributes are affine, so this does not change the
+ * result.
+ */
+static bool batch_push_texture(
 		struct wm_renderer *renderer, struct wlr_texture *wlr_texture,
-		const struct wlr_fbox *box, const float matrix[static 9],
 		float alpha,
         const struct wlr_box *display_box,
-		double padding_l, double padding_t, double padding_r, double padding_b,
-		float corner_radius,
-		double lock_perc
+        const pixman_box32_t *clip,
+		const struct wlr_fbox *rect,
+		float corner_radius
         ) {
-	struct wlr_gles2_renderer *gles2_renderer =
-		gles2_get_renderer(renderer->wlr_renderer);
 	struct wlr_gles2_texture *texture =
 		gles2_get_texture(wlr_texture);
-	assert(wlr_egl_is_current(gles2_renderer->egl));
 
-	struct wm_renderer_shader *shader = NULL;
+	int features = shader_features(texture->has_alpha, rect, display_box,
+			corner_radius);
 
 	switch (texture->target) {
 	case GL_TEXTURE_2D:
-		/* Same condition as below! Important! */
-		if (texture->has_alpha) {
-			shader = lock_perc > 0.001 ? &renderer->shader_blurred_rgba : &renderer->shader_rgba;
-		} else {
-			shader = lock_perc > 0.001 ? &renderer->shader_blurred_rgbx : &renderer->shader_rgbx;
-		}
 		break;
 	case GL_TEXTURE_EXTERNAL_OES:
+		features |= WM_RENDERER_SHADER_EXTERNAL;
+		break;
+	default:
+		abort();
+	}
+
+	if (!renderer->shaders[features].shader) {
         wlr_log(WLR_ERROR, "Failed to render texture: "
             "GL_TEXTURE_EXTERNAL_OES not supported");
         return false;
-	default:
-		abort();
 	}
 
-	float gl_matrix[9];
-    wlr_matrix_multiply(gl_matrix, gles2_renderer->projection, matrix);
-    wlr_matrix_multiply(gl_matrix, flip_180, gl_matrix);
+    double u0 = fmax(0., (clip->x1 - display_box->x) / (double)display_box->width);
+    double u1 = fmin(1., (clip->x2 - display_box->x) / (double)display_box->width);
+    double v0 = fmax(0., (clip->y1 - display_box->y) / (double)display_box->height);
+    double v1 = fmin(1., (clip->y2 - display_box->y) / (double)display_box->height);
+    if(u1 <= u0 || v1 <= v0) return true;
+
+    struct wm_renderer_batch* batch = &renderer->batch;
+    int first = batch->n_vertices;
+    struct wm_renderer_vertex* v = batch_reserve(batch, 6);
+    if(!v) return false;
+
+    double center_x = rect->x + .5 * rect->width;
+    double center_y = rect->y + .5 * rect->height;
+    for(int i=0; i<6; i++){
+        GLfloat u = quad_corners[i][0] ? u1 : u0;
+        GLfloat w = quad_corners[i][1] ? v1 : v0;
+        v[i] = (struct wm_renderer_vertex){
+            .pos = {
+                display_box->x + u * display_box->width,
+                display_box->y + w * display_box->height },
+            .texcoord = { u, texture->inverted_y ? 1. - w : w },
+            .local = {
+                u * display_box->width - center_x,
+                w * display_box->height - center_y },
+            .rect = { .5 * rect->width, .5 * rect->height, corner_radius, alpha },
+        };
+    }
 
-	// OpenGL ES 2 requires the glUniformMatrix3fv transpose parameter to be set
-	// to GL_FALSE
-	wlr_matrix_transpose(gl_matrix, gl_matrix);
+    batch_add_run(batch, &renderer->shaders[features], texture->target, texture->tex, GL_NEAREST, first, 6);
+	return true;
+}
 
+/* Framebuffer pixel of a point in output coordinates, see wm_renderer_begin */
+static void output_to_framebuffer(struct wm_renderer* renderer, double x, double y, double* fb_x, double* fb_y){
+    /* proj is column-major */
+    const GLfloat* p = renderer->batch.proj;
+    *fb_x = .5 * (p[0] * x + p[3] * y + p[6] + 1.) * renderer->current->wlr_output->width;
+    *fb_y = .5 * (p[1] * x + p[4] * y + p[7] + 1.) * renderer->current->wlr_output->height;
+}
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(texture->target, texture->tex);
+/*
+ * Append a quad for the rounded box rect (in output coordinates), cut down to
+ * clip, which samples tex exactly where it has been taken from in the
+ * framebuffer: tex covers the framebuffer pixels tex_box, and is magnified
+ * with filter
+ */
+static bool batch_push_framebuffer_texture(struct wm_renderer* renderer, GLuint tex, GLint filter,
+        const struct wlr_box* tex_box, const struct wlr_fbox* rect, float corner_radius,
+        float alpha, const pixman_box32_t* clip, double lock_perc){
+    double x1 = fmax(rect->x, clip->x1);
+    double y1 = fmax(rect->y, clip->y1);
+    double x2 = fmin(rect->x + rect->width, clip->x2);
+    double y2 = fmin(rect->y + rect->height, clip->y2);
+    if(x2 <= x1 || y2 <= y1) return true;
+
+    struct wm_renderer_batch* batch = &renderer->batch;
+    int first = batch->n_vertices;
+    struct wm_renderer_vertex* v = batch_reserve(batch, 6);
+    if(!v) return false;
+
+    double center_x = rect->x + .5 * rect->width;
+    double center_y = rect->y + .5 * rect->height;
+    for(int i=0; i<6; i++){
+        double x = quad_corners[i][0] ? x2 : x1;
+        double y = quad_corners[i][1] ? y2 : y1;
+        double fb_x, fb_y;
+        output_to_framebuffer(renderer, x, y, &fb_x, &fb_y);
+        v[i] = (struct wm_renderer_vertex){
+            .pos = { x, y },
+            .texcoord = {
+                (fb_x - tex_box->x) / tex_box->width,
+                (fb_y - tex_box->y) / tex_box->height },
+            .local = { x - center_x, y - center_y },
+            .rect = { .5 * rect->width, .5 * rect->height, corner_radius, alpha },
+            .lock_perc = lock_perc
+        };
+    }
+
+    int features = 0;
+    if(corner_radius > 0.001){
+        features |= WM_RENDERER_SHADER_CORNERS;
+    }
+    if(lock_perc > 0.001){
+        features |= WM_RENDERER_SHADER_LOCK;
+    }
+    batch_add_run(batch, &renderer->shaders[features], GL_TEXTURE_2D, tex, filter, first, 6);
+    return true;
+}
 
-	glTexParameteri(texture->target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(texture->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+/*
+ * Lock cache
+ */
+static void lock_cache_release(struct wm_renderer_lock_cache* cache){
+    if(cache->fbo){
+        glDeleteFramebuffers(1, &cache->fbo);
+        cache->fbo = 0;
+    }
+    if(cache->tex){
+        glDeleteTextures(1, &cache->tex);
+        cache->tex = 0;
+    }
+    stencil_release(&cache->stencil);
+    cache->dirty = true;
+}
 
-	glUseProgram(shader->shader);
+/* Expects the output framebuffer to be bound */
+static bool lock_cache_ensure(struct wm_renderer* renderer, struct wm_renderer_lock_cache* cache,
+        int width, int height){
+    if(cache->fbo && cache->width == width && cache->height == height){
+        return true;
+    }
+    lock_cache_release(cache);
+
+    GLint output_fbo = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &output_fbo);
+
+    glGenTextures(1, &cache->tex);
+    glBindTexture(GL_TEXTURE_2D, cache->tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    renderer->gl_state.texture_valid = false;
+
+    glGenFramebuffers(1, &cache->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, cache->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, cache->tex, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, output_fbo);
+
+    if(status != GL_FRAMEBUFFER_COMPLETE){
+        wlr_log(WLR_ERROR, "Lock cache framebuffer incomplete: 0x%x", status);
+        lock_cache_release(cache);
+        return false;
+    }
 
-	glUniformMatrix3fv(shader->proj, 1, GL_FALSE, gl_matrix);
-	glUniform1i(shader->invert_y, texture->inverted_y);
-	glUniform1i(shader->tex, 0);
-	glUniform1f(shader->alpha, alpha);
-	glUniform1f(shader->width, display_box->width);
-	glUniform1f(shader->height, display_box->height);
-	glUniform1f(shader->padding_l, padding_l);
-	glUniform1f(shader->padding_t, padding_t);
-	glUniform1f(shader->padding_r, padding_r);
-	glUniform1f(shader->padding_b, padding_b);
-	glUniform1f(shader->cornerradius, corner_radius);
+    cache->width = width;
+    cache->height = height;
+    return true;
+}
 
-	if(lock_perc > 0.001){ /* Same condition as above! Important! */
-		glUniform1f(shader->lock_perc, lock_perc);
-	}
+/*
+ * Blur
+ */
+static void blur_release_levels(struct wm_renderer_blur* blur){
+    for(int i=0; i<blur->n_levels; i++){
+        glDeleteFramebuffers(1, &blur->fbo[i]);
+        glDeleteTextures(1, &blur->tex[i]);
+    }
+    blur->n_levels = 0;
+}
 
-	const GLfloat x1 = box->x / wlr_texture->width;
-	const GLfloat y1 = box->y / wlr_texture->height;
-	const GLfloat x2 = (box->x + box->width) / wlr_texture->width;
-	const GLfloat y2 = (box->y + box->height) / wlr_texture->height;
-	const GLfloat texcoord[] = {
-		x2, y1, // top right
-		x1, y1, // top left
-		x2, y2, // bottom right
-		x1, y2, // bottom left
-	};
+/* Expects the target framebuffer to be bound */
+static bool blur_ensure_levels(struct wm_renderer* renderer, struct wm_renderer_blur* blur,
+        int width, int height, int n_levels){
+    if(blur->n_levels == n_levels && blur->width[0] == width && blur->height[0] == height){
+        return true;
+    }
+    blur_release_levels(blur);
+
+    GLint target_fbo = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target_fbo);
+
+    bool ok = true;
+    for(int i=0; i<n_levels; i++){
+        blur->width[i] = width >> i > 0 ? width >> i : 1;
+        blur->height[i] = height >> i > 0 ? height >> i : 1;
+
+        /*
+         * No alpha: copying from an XRGB framebuffer into an RGBA texture
+         * is not allowed
+         */
+        glGenTextures(1, &blur->tex[i]);
+        glBindTexture(GL_TEXTURE_2D, blur->tex[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, blur->width[i], blur->height[i], 0,
+                GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+        glGenFramebuffers(1, &blur->fbo[i]);
+        glBindFramebuffer(GL_FRAMEBUFFER, blur->fbo[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_TEXTURE_2D, blur->tex[i], 0);
+        blur->n_levels++;
+
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+            ok = false;
+            break;
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    renderer->gl_state.texture_valid = false;
+    glBindFramebuffer(GL_FRAMEBUFFER, target_fbo);
+
+    if(!ok){
+        wlr_log(WLR_ERROR, "Blur framebuffer incomplete");
+        blur_release_levels(blur);
+    }
+    return ok;
+}
 
-	glVertexAttribPointer(shader->pos_attrib, 2, GL_FLOAT, GL_FALSE, 0, verts);
-	glVertexAttribPointer(shader->tex_attrib, 2, GL_FLOAT, GL_FALSE, 0, texcoord);
+static void blur_pass(struct wm_renderer* renderer, struct wm_renderer_blur_shader* shader,
+        struct wm_renderer_blur* blur, int src, int dst, double radius){
+    glBindFramebuffer(GL_FRAMEBUFFER, blur->fbo[dst]);
+    glViewport(0, 0, blur->width[dst], blur->height[dst]);
 
-	glEnableVertexAttribArray(shader->pos_attrib);
-	glEnableVertexAttribArray(shader->tex_attrib);
+    gl_use_program(renderer, shader->shader);
+    gl_bind_texture(renderer, GL_TEXTURE_2D, blur->tex[src]);
+    glUniform2f(shader->halfpixel, .5 / blur->width[dst], .5 / blur->height[dst]);
+    glUniform1f(shader->offset, radius);
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    gl_draw_arrays(renderer, 0, 6);
+}
 
-	glDisableVertexAttribArray(shader->pos_attrib);
-	glDisableVertexAttribArray(shader->tex_attrib);
+/*
+ * Dual-Kawase: copy the framebuffer pixels fb_box into level 0, then
+ * downsample level by level and sample back up, so every pass only touches
+ * the blurred area at its own resolution
+ */
+static void blur_update(struct wm_renderer* renderer, struct wm_renderer_blur* blur,
+        const struct wlr_box* fb_box, double radius){
+    struct wlr_output* wlr_output = renderer->current->wlr_output;
+
+    gl_bind_texture(renderer, GL_TEXTURE_2D, blur->tex[0]);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+            fb_box->x, fb_box->y, fb_box->width, fb_box->height);
+
+    static const GLfloat quad[6][2] = {
+        {-1, -1}, {1, -1}, {-1, 1},
+        {1, -1}, {1, 1}, {-1, 1},
+    };
+
+    GLint target_fbo = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target_fbo);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+    glDisable(GL_BLEND);
+
+    gl_bind_array_buffer(renderer, 0);
+    glVertexAttribPointer(ATTRIB_POS, 2, GL_FLOAT, GL_FALSE, 0, quad);
+    gl_enable_attribs(renderer, 1 << ATTRIB_POS);
+
+    for(int i=1; i<blur->n_levels; i++){
+        blur_pass(renderer, &renderer->shader_blur_down, blur, i - 1, i, radius);
+    }
+    for(int i=blur->n_levels - 1; i>0; i--){
+        blur_pass(renderer, &renderer->shader_blur_up, blur, i, i - 1, radius);
+    }
+
+    if(blend) glEnable(GL_BLEND);
+    glBindFramebuffer(GL_FRAMEBUFFER, target_fbo);
+    glViewport(0, 0, wlr_output->width, wlr_output->height);
+
+    gl_release(renderer);
+
+    blur->fb_box = *fb_box;
+    blur->dirty = false;
+}
 
-	glBindTexture(texture->target, 0);
+/*
+ * Mirror
+ */
+static void mirror_release(struct wm_renderer_mirror* mirror){
+    if(mirror->tex){
+        glDeleteTextures(1, &mirror->tex);
+        mirror->tex = 0;
+    }
+    mirror->valid = false;
+}
 
-	return true;
+static void mirror_ensure(struct wm_renderer* renderer, struct wm_renderer_mirror* mirror,
+        int width, int height){
+    if(mirror->tex && mirror->width == width && mirror->height == height){
+        return;
+    }
+    mirror_release(mirror);
+
+    /* No alpha, see blur_ensure_levels */
+    glGenTextures(1, &mirror->tex);
+    gl_bind_texture(renderer, GL_TEXTURE_2D, mirror->tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0,
+            GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+    mirror->width = width;
+    mirror->height = height;
+}
+
+static void collect_garbage(struct wm_renderer* renderer){
+    struct wm_renderer_stencil *stencil, *tmp_stencil;
+    wl_list_for_each_safe(stencil, tmp_stencil, &renderer->stencil_garbage, link){
+        stencil_release(stencil);
+        wl_list_remove(&stencil->link);
+        free(stencil);
+    }
+
+    struct wm_renderer_blur *blur, *tmp;
+    wl_list_for_each_safe(blur, tmp, &renderer->blur_garbage, link){
+        blur_release_levels(blur);
+        wl_list_remove(&blur->link);
+        free(blur);
+    }
+
+    struct wm_renderer_lock_cache *cache, *tmp_cache;
+    wl_list_for_each_safe(cache, tmp_cache, &renderer->lock_cache_garbage, link){
+        lock_cache_release(cache);
+        pixman_region32_fini(&cache->damage);
+        wl_list_remove(&cache->link);
+        free(cache);
+    }
+
+    struct wm_renderer_mirror *mirror, *tmp_mirror;
+    wl_list_for_each_safe(mirror, tmp_mirror, &renderer->mirror_garbage, link){
+        mirror_release(mirror);
+        wl_list_remove(&mirror->link);
+        free(mirror);
+    }
 }
 
 const GLchar custom_tex_vertex_src[] =
 "uniform mat3 proj;\n"
-"uniform bool invert_y;\n"
 "attribute vec2 pos;\n"
 "attribute vec2 texcoord;\n"
+"attribute vec4 rect;\n"
 "varying vec2 v_texcoord;\n"
+"varying float v_alpha;\n"
+"#if defined(MASK) || defined(CORNERS)\n"
+"attribute vec2 local;\n"
+"varying vec2 v_local;\n"
+"varying vec3 v_rect;\n"
+"#endif\n"
+"#ifdef LOCK\n"
+"attribute float lock;\n"
+"varying float v_lock;\n"
+"#endif\n"
 "\n"
 "void main() {\n"
 "	gl_Position = vec4(proj * vec3(pos, 1.0), 1.0);\n"
-"	if (invert_y) {\n"
-"		v_texcoord = vec2(texcoord.x, 1.0 - texcoord.y);\n"
-"	} else {\n"
-"		v_texcoord = texcoord;\n"
-"	}\n"
+"	v_texcoord = texcoord;\n"
+"	v_alpha = rect.w;\n"
+"#if defined(MASK) || defined(CORNERS)\n"
+"	v_local = local;\n"
+"	v_rect = rect.xyz;\n"
+"#endif\n"
+"#ifdef LOCK\n"
+"	v_lock = lock;\n"
+"#endif\n"
 "}\n";
 
-
-const GLchar custom_tex_fragment_src_rgba[] =
+/*
+ * Single source for all variants; compiled once per feature bitmask with
+ * the matching #defines prepended (see shader_defines). Everything that
+ * varies per quad comes in as vertex attributes, so a whole run of quads
+ * sharing variant and texture is a single draw.
+ *
+ * Mask and corners are a signed distance to the rounded box centered at
+ * v_local = 0 with half extent v_rect.xy and radius v_rect.z (in pixels).
+ * The distance is turned into coverage, which gives anti-aliased edges at
+ * constant cost instead of per-corner discards.
+ */
+const GLchar custom_tex_fragment_src[] =
+"#ifdef EXTERNAL\n"
+"#extension GL_OES_EGL_image_external : require\n"
+"#endif\n"
+"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+"precision highp float;\n"
+"#else\n"
 "precision mediump float;\n"
+"#endif\n"
 "varying vec2 v_texcoord;\n"
+"varying float v_alpha;\n"
+"#ifdef EXTERNAL\n"
+"uniform samplerExternalOES tex;\n"
+"#else\n"
 "uniform sampler2D tex;\n"
-"uniform float alpha;\n"
+"#endif\n"
 "\n"
-"uniform float width;\n"
-"uniform float height;\n"
-"uniform float padding_l;\n"
-"uniform float padding_t;\n"
-"uniform float padding_r;\n"
-"uniform float padding_b;\n"
-"uniform float cornerradius;\n"
+"#if defined(MASK) || defined(CORNERS)\n"
+"varying vec2 v_local;\n"
+"varying vec3 v_rect;\n"
+"#endif\n"
+"#ifdef LOCK\n"
+"varying float v_lock;\n"
+"#endif\n"
 "\n"
 "void main() {\n"
-"   if(v_texcoord.x*width < padding_l) discard;\n"
-"   if(v_texcoord.y*height < padding_t) discard;\n"
-"   if(v_texcoord.x*width > width - padding_r) discard;\n"
-"   if(v_texcoord.y*height > height - padding_b) discard;\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"	gl_FragColor = texture2D(tex, v_texcoord) * alpha;\n"
+"#ifdef CORNERS\n"
+"   vec2 q = abs(v_local) - v_rect.xy + v_rect.z;\n"
+"   float dist = length(max(q, 0.0)) + min(max(q.x, q.y), 0.0) - v_rect.z;\n"
+"   float coverage = clamp(0.5 - dist, 0.0, 1.0);\n"
+"#elif defined(MASK)\n"
+"   vec2 q = abs(v_local) - v_rect.xy;\n"
+"   float coverage = clamp(0.5 - max(q.x, q.y), 0.0, 1.0);\n"
+"#else\n"
+"   float coverage = 1.0;\n"
+"#endif\n"
+"#ifdef LOCK\n"
+"   float r = sqrt((v_texcoord.x - 0.5) * (v_texcoord.x - 0.5) + (v_texcoord.y - 0.5) * (v_texcoord.y - 0.5));\n"
+"   float a = atan(v_texcoord.y - 0.5, v_texcoord.x - 0.5);\n"
+"   vec4 color = texture2D(tex, vec2(0.5 + r*cos(a + v_lock * 10.0 * (0.5 - r)), 0.5 + r*sin(a + v_lock * 10.0 * (0.5 - r))));\n"
+"#else\n"
+"   vec4 color = texture2D(tex, v_texcoord);\n"
+"#endif\n"
+"#ifdef ALPHA\n"
+"	gl_FragColor = color * (v_alpha * coverage);\n"
+"#else\n"
+"	gl_FragColor = vec4(color.rgb, 1.0) * (v_alpha * coverage);\n"
+"#endif\n"
 "}\n";
 
+const GLchar custom_solid_vertex_src[] =
+"uniform mat3 proj;\n"
+"attribute vec2 pos;\n"
+"attribute vec4 rect;\n"
+"varying vec4 v_color;\n"
+"\n"
+"void main() {\n"
+"	gl_Position = vec4(proj * vec3(pos, 1.0), 1.0);\n"
+"	v_color = rect;\n"
+"}\n";
 
-
-const GLchar custom_tex_fragment_src_rgbx[] =
+const GLchar custom_solid_fragment_src[] =
 "precision mediump float;\n"
-"varying vec2 v_texcoord;\n"
-"uniform sampler2D tex;\n"
-"uniform float alpha;\n"
+"varying vec4 v_color;\n"
 "\n"
-"uniform float width;\n"
-"uniform float height;\n"
-"uniform float padding_l;\n"
-"uniform float padding_t;\n"
-"uniform float padding_r;\n"
-"uniform float padding_b;\n"
-"uniform float cornerradius;\n"
+"void main() {\n"
+"	gl_FragColor = v_color;\n"
+"}\n";
+
+const GLchar blur_vertex_src[] =
+"attribute vec2 pos;\n"
+"varying vec2 v_texcoord;\n"
 "\n"
 "void main() {\n"
-"   if(v_texcoord.x*width < padding_l) discard;\n"
-"   if(v_texcoord.y*height < padding_t) discard;\n"
-"   if(v_texcoord.x*width > width - padding_r) discard;\n"
-"   if(v_texcoord.y*height > height - padding_b) discard;\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"	gl_FragColor = vec4(texture2D(tex, v_texcoord).rgb, 1.0) * alpha;\n"
+"	gl_Position = vec4(pos, 0.0, 1.0);\n"
+"	v_texcoord = pos * 0.5 + 0.5;\n"
 "}\n";
 
-const GLchar custom_tex_fragment_blurred_src_rgba[] =
+const GLchar blur_down_fragment_src[] =
 "precision mediump float;\n"
 "varying vec2 v_texcoord;\n"
 "uniform sampler2D tex;\n"
-"uniform float alpha;\n"
-"\n"
-"uniform float width;\n"
-"uniform float height;\n"
-"\n"
-"uniform float padding_l;\n"
-"uniform float padding_t;\n"
-"uniform float padding_r;\n"
-"uniform float padding_b;\n"
-"uniform float cornerradius;\n"
-"uniform float lock_perc;\n"
+"uniform vec2 halfpixel;\n"
+"uniform float offset;\n"
 "\n"
 "void main() {\n"
-"   if(v_texcoord.x*width < padding_l) discard;\n"
-"   if(v_texcoord.y*height < padding_t) discard;\n"
-"   if(v_texcoord.x*width > width - padding_r) discard;\n"
-"   if(v_texcoord.y*height > height - padding_b) discard;\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"   float r = sqrt((v_texcoord.x - 0.5) * (v_texcoord.x - 0.5) + (v_texcoord.y - 0.5) * (v_texcoord.y - 0.5));\n"
-"   float a = atan(v_texcoord.y - 0.5, v_texcoord.x - 0.5);\n"
-"	gl_FragColor = texture2D(tex, vec2(0.5 + r*cos(a + lock_perc * 10.0 * (0.5 - r)), 0.5 + r*sin(a + lock_perc * 10.0 * (0.5 - r)))) * alpha;\n"
+"	vec4 sum = texture2D(tex, v_texcoord) * 4.0;\n"
+"	sum += texture2D(tex, v_texcoord - halfpixel * offset);\n"
+"	sum += texture2D(tex, v_texcoord + halfpixel * offset);\n"
+"	sum += texture2D(tex, v_texcoord + vec2(halfpixel.x, -halfpixel.y) * offset);\n"
+"	sum += texture2D(tex, v_texcoord - vec2(halfpixel.x, -halfpixel.y) * offset);\n"
+"	gl_FragColor = sum / 8.0;\n"
 "}\n";
 
-
-
-const GLchar custom_tex_fragment_blurred_src_rgbx[] =
+const GLchar blur_up_fragment_src[] =
 "precision mediump float;\n"
 "varying vec2 v_texcoord;\n"
 "uniform sampler2D tex;\n"
-"uniform float alpha;\n"
-"\n"
-"uniform float width;\n"
-"uniform float height;\n"
-"\n"
-"uniform float padding_l;\n"
-"uniform float padding_t;\n"
-"uniform float padding_r;\n"
-"uniform float padding_b;\n"
-"uniform float cornerradius;\n"
-"uniform float lock_perc;\n"
+"uniform vec2 halfpixel;\n"
+"uniform float offset;\n"
 "\n"
 "void main() {\n"
-"   if(v_texcoord.x*width < padding_l) discard;\n"
-"   if(v_texcoord.y*height < padding_t) discard;\n"
-"   if(v_texcoord.x*width > width - padding_r) discard;\n"
-"   if(v_texcoord.y*height > height - padding_b) discard;\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height < cornerradius + padding_t){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, cornerradius + padding_t)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width < cornerradius + padding_l && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(cornerradius + padding_l, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"   if(v_texcoord.x*width > width - cornerradius - padding_r && v_texcoord.y*height > height - cornerradius - padding_b){\n"
-"       if(length(vec2(v_texcoord.x*width, v_texcoord.y*height) - vec2(width - cornerradius - padding_r, height - cornerradius - padding_b)) > cornerradius) discard;\n"
-"   }\n"
-"   float r = sqrt((v_texcoord.x - 0.5) * (v_texcoord.x - 0.5) + (v_texcoord.y - 0.5) * (v_texcoord.y - 0.5));\n"
-"   float a = atan(v_texcoord.y - 0.5, v_texcoord.x - 0.5);\n"
-"	gl_FragColor = vec4(texture2D(tex, vec2(0.5 + r*cos(a + lock_perc * 10.0 * (0.5 - r)), 0.5 + r*sin(a + lock_perc * 10.0 * (0.5 - r)))).rgb, 1.0) * alpha;\n"
+"	vec4 sum = texture2D(tex, v_texcoord + vec2(-halfpixel.x * 2.0, 0.0) * offset);\n"
+"	sum += texture2D(tex, v_texcoord + vec2(-halfpixel.x, halfpixel.y) * offset) * 2.0;\n"
+"	sum += texture2D(tex, v_texcoord + vec2(0.0, halfpixel.y * 2.0) * offset);\n"
+"	sum += texture2D(tex, v_texcoord + vec2(halfpixel.x, halfpixel.y) * offset) * 2.0;\n"
+"	sum += texture2D(tex, v_texcoord + vec2(halfpixel.x * 2.0, 0.0) * offset);\n"
+"	sum += texture2D(tex, v_texcoord + vec2(halfpixel.x, -halfpixel.y) * offset) * 2.0;\n"
+"	sum += texture2D(tex, v_texcoord + vec2(0.0, -halfpixel.y * 2.0) * offset);\n"
+"	sum += texture2D(tex, v_texcoord + vec2(-halfpixel.x, -halfpixel.y) * offset) * 2.0;\n"
+"	gl_FragColor = sum / 12.0;\n"
 "}\n";
 
+static void shader_defines(char* buf, size_t len, int features){
+    snprintf(buf, len, "%s%s%s%s%s",
+            features & WM_RENDERER_SHADER_ALPHA ? "#define ALPHA\n" : "",
+            features & WM_RENDERER_SHADER_MASK ? "#define MASK\n" : "",
+            features & WM_RENDERER_SHADER_CORNERS ? "#define CORNERS\n" : "",
+            features & WM_RENDERER_SHADER_LOCK ? "#define LOCK\n" : "",
+            features & WM_RENDERER_SHADER_EXTERNAL ? "#define EXTERNAL\n" : "");
+}
+
+static void shader_init(struct wm_renderer_shader* shader, struct wlr_gles2_renderer* r,
+        const GLchar* defines, const GLchar* vert_src, const GLchar* frag_src){
+    shader->shader = link_program(r, defines, vert_src, frag_src);
+    assert(shader->shader);
+
+    shader->proj = glGetUniformLocation(shader->shader, "proj");
+    shader->tex = glGetUniformLocation(shader->shader, "tex");
+    shader->proj_valid = false;
+
+    /* Always sample from unit 0 */
+    glUseProgram(shader->shader);
+    glUniform1i(shader->tex, 0);
+    glUseProgram(0);
+}
+
+static void blur_shader_init(struct wm_renderer_blur_shader* shader, struct wlr_gles2_renderer* r,
+        const GLchar* frag_src){
+    shader->shader = link_program(r, "", blur_vertex_src, frag_src);
+    assert(shader->shader);
+
+    shader->tex = glGetUniformLocation(shader->shader, "tex");
+    shader->halfpixel = glGetUniformLocation(shader->shader, "halfpixel");
+    shader->offset = glGetUniformLocation(shader->shader, "offset");
+
+    glUseProgram(shader->shader);
+    glUniform1i(shader->tex, 0);
+    glUseProgram(0);
+}
 
 #endif
 
@@ -358,83 +1091,27 @@ void wm_renderer_init(struct wm_renderer* renderer, struct wm_server* server){
 
 	assert(wlr_egl_make_current(r->egl));
 
-	renderer->shader_rgba.shader = 
-		link_program(r, custom_tex_vertex_src, custom_tex_fragment_src_rgba);
-	assert(renderer->shader_rgba.shader);
-
-	renderer->shader_rgba.proj = glGetUniformLocation(renderer->shader_rgba.shader, "proj");
-	renderer->shader_rgba.invert_y = glGetUniformLocation(renderer->shader_rgba.shader, "invert_y");
-	renderer->shader_rgba.tex = glGetUniformLocation(renderer->shader_rgba.shader, "tex");
-	renderer->shader_rgba.alpha = glGetUniformLocation(renderer->shader_rgba.shader, "alpha");
-	renderer->shader_rgba.width = glGetUniformLocation(renderer->shader_rgba.shader, "width");
-	renderer->shader_rgba.height = glGetUniformLocation(renderer->shader_rgba.shader, "height");
-	renderer->shader_rgba.padding_l = glGetUniformLocation(renderer->shader_rgba.shader, "padding_l");
-	renderer->shader_rgba.padding_t = glGetUniformLocation(renderer->shader_rgba.shader, "padding_t");
-	renderer->shader_rgba.padding_r = glGetUniformLocation(renderer->shader_rgba.shader, "padding_r");
-	renderer->shader_rgba.padding_b = glGetUniformLocation(renderer->shader_rgba.shader, "padding_b");
-	renderer->shader_rgba.cornerradius = glGetUniformLocation(renderer->shader_rgba.shader, "cornerradius");
-
-	renderer->shader_rgba.pos_attrib = glGetAttribLocation(renderer->shader_rgba.shader, "pos");
-	renderer->shader_rgba.tex_attrib = glGetAttribLocation(renderer->shader_rgba.shader, "texcoord");
-
-	renderer->shader_rgbx.shader = 
-		link_program(r, custom_tex_vertex_src, custom_tex_fragment_src_rgbx);
-	assert(renderer->shader_rgbx.shader);
-
-	renderer->shader_rgbx.proj = glGetUniformLocation(renderer->shader_rgbx.shader, "proj");
-	renderer->shader_rgbx.invert_y = glGetUniformLocation(renderer->shader_rgbx.shader, "invert_y");
-	renderer->shader_rgbx.tex = glGetUniformLocation(renderer->shader_rgbx.shader, "tex");
-	renderer->shader_rgbx.alpha = glGetUniformLocation(renderer->shader_rgbx.shader, "alpha");
-	renderer->shader_rgbx.width = glGetUniformLocation(renderer->shader_rgbx.shader, "width");
-	renderer->shader_rgbx.height = glGetUniformLocation(renderer->shader_rgbx.shader, "height");
-	renderer->shader_rgbx.padding_l = glGetUniformLocation(renderer->shader_rgbx.shader, "padding_l");
-	renderer->shader_rgbx.padding_t = glGetUniformLocation(renderer->shader_rgbx.shader, "padding_t");
-	renderer->shader_rgbx.padding_r = glGetUniformLocation(renderer->shader_rgbx.shader, "padding_r");
-	renderer->shader_rgbx.padding_b = glGetUniformLocation(renderer->shader_rgbx.shader, "padding_b");
-	renderer->shader_rgbx.cornerradius = glGetUniformLocation(renderer->shader_rgbx.shader, "cornerradius");
-
-	renderer->shader_rgbx.pos_attrib = glGetAttribLocation(renderer->shader_rgbx.shader, "pos");
-	renderer->shader_rgbx.tex_attrib = glGetAttribLocation(renderer->shader_rgbx.shader, "texcoord");
-
-	renderer->shader_blurred_rgba.shader =
-		link_program(r, custom_tex_vertex_src, custom_tex_fragment_blurred_src_rgba);
-	assert(renderer->shader_blurred_rgba.shader);
-
-	renderer->shader_blurred_rgba.proj = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "proj");
-	renderer->shader_blurred_rgba.invert_y = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "invert_y");
-	renderer->shader_blurred_rgba.tex = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "tex");
-	renderer->shader_blurred_rgba.alpha = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "alpha");
-	renderer->shader_blurred_rgba.width = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "width");
-	renderer->shader_blurred_rgba.height = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "height");
-	renderer->shader_blurred_rgba.padding_l = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "padding_l");
-	renderer->shader_blurred_rgba.padding_t = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "padding_t");
-	renderer->shader_blurred_rgba.padding_r = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "padding_r");
-	renderer->shader_blurred_rgba.padding_b = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "padding_b");
-	renderer->shader_blurred_rgba.cornerradius = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "cornerradius");
-	renderer->shader_blurred_rgba.lock_perc = glGetUniformLocation(renderer->shader_blurred_rgba.shader, "lock_perc");
-
-	renderer->shader_blurred_rgba.pos_attrib = glGetAttribLocation(renderer->shader_blurred_rgba.shader, "pos");
-	renderer->shader_blurred_rgba.tex_attrib = glGetAttribLocation(renderer->shader_blurred_rgba.shader, "texcoord");
-
-	renderer->shader_blurred_rgbx.shader =
-		link_program(r, custom_tex_vertex_src, custom_tex_fragment_blurred_src_rgbx);
-	assert(renderer->shader_blurred_rgbx.shader);
-
-	renderer->shader_blurred_rgbx.proj = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "proj");
-	renderer->shader_blurred_rgbx.invert_y = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "invert_y");
-	renderer->shader_blurred_rgbx.tex = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "tex");
-	renderer->shader_blurred_rgbx.alpha = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "alpha");
-	renderer->shader_blurred_rgbx.width = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "width");
-	renderer->shader_blurred_rgbx.height = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "height");
-	renderer->shader_blurred_rgbx.padding_l = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "padding_l");
-	renderer->shader_blurred_rgbx.padding_t = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "padding_t");
-	renderer->shader_blurred_rgbx.padding_r = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "padding_r");
-	renderer->shader_blurred_rgbx.padding_b = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "padding_b");
-	renderer->shader_blurred_rgbx.cornerradius = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "cornerradius");
-	renderer->shader_blurred_rgbx.lock_perc = glGetUniformLocation(renderer->shader_blurred_rgbx.shader, "lock_perc");
-
-	renderer->shader_blurred_rgbx.pos_attrib = glGetAttribLocation(renderer->shader_blurred_rgbx.shader, "pos");
-	renderer->shader_blurred_rgbx.tex_attrib = glGetAttribLocation(renderer->shader_blurred_rgbx.shader, "texcoord");
+	for(int i=0; i<WM_RENDERER_SHADER_VARIANTS; i++){
+		if((i & WM_RENDERER_SHADER_EXTERNAL) && !r->exts.egl_image_external_oes){
+			renderer->shaders[i] = (struct wm_renderer_shader){ 0 };
+			continue;
+		}
+
+		char defines[128];
+		shader_defines(defines, sizeof(defines), i);
+		shader_init(&renderer->shaders[i], r, defines, custom_tex_vertex_src, custom_tex_fragment_src);
+	}
+	shader_init(&renderer->shader_solid, r, "", custom_solid_vertex_src, custom_solid_fragment_src);
+	blur_shader_init(&renderer->shader_blur_down, r, blur_down_fragment_src);
+	blur_shader_init(&renderer->shader_blur_up, r, blur_up_fragment_src);
+
+	glGenBuffers(1, &renderer->vbo);
+	renderer->vbo_size = 0;
+
+	wl_list_init(&renderer->stencil_garbage);
+	wl_list_init(&renderer->blur_garbage);
+	wl_list_init(&renderer->lock_cache_garbage);
+	wl_list_init(&renderer->mirror_garbage);
 
 	wlr_egl_unset_current(r->egl);
 
@@ -442,15 +1119,54 @@ void wm_renderer_init(struct wm_renderer* renderer, struct wm_server* server){
 }
 
 void wm_renderer_destroy(struct wm_renderer* renderer){
+#ifdef WM_CUSTOM_RENDERER
+    free(renderer->batch.vertices);
+    free(renderer->batch.runs);
+    free(renderer->gl_state.filtered);
+#endif
     wlr_renderer_destroy(renderer->wlr_renderer);
 }
 
-void wm_renderer_begin(struct wm_renderer* renderer, struct wm_output* output){
+void wm_renderer_begin(struct wm_renderer* renderer, struct wm_output* output, pixman_region32_t* damage){
 	wlr_renderer_begin(renderer->wlr_renderer, output->wlr_output->width, output->wlr_output->height);
     renderer->current = output;
+
+#ifdef WM_CUSTOM_RENDERER
+	struct wlr_gles2_renderer *gles2_renderer =
+		gles2_get_renderer(renderer->wlr_renderer);
+
+    /* Quads are batched in output coordinates, see batch_push_texture */
+    float proj[9];
+    wlr_matrix_multiply(proj, gles2_renderer->projection, output->wlr_output->transform_matrix);
+    wlr_matrix_multiply(proj, flip_180, proj);
+
+	// OpenGL ES 2 requires the glUniformMatrix3fv transpose parameter to be set
+	// to GL_FALSE
+    wlr_matrix_transpose(renderer->batch.proj, proj);
+
+    gl_state_reset(renderer);
+    renderer->gl_stats = (struct wm_renderer_gl_stats){ 0 };
+
+    collect_garbage(renderer);
+
+    renderer->batch.n_vertices = 0;
+    renderer->batch.n_runs = 0;
+    renderer->batch.clip = damage;
+    if(!output->stencil){
+        output->stencil = calloc(1, sizeof(struct wm_renderer_stencil));
+        assert(output->stencil);
+        wl_list_init(&output->stencil->link);
+    }
+    renderer->batch.stencil = batch_ensure_stencil(output->stencil,
+            output->wlr_output->width, output->wlr_output->height);
+#endif
 }
 
 void wm_renderer_end(struct wm_renderer* renderer, pixman_region32_t* damage, struct wm_output* output){
+#ifdef WM_CUSTOM_RENDERER
+    batch_flush(renderer, damage);
+#endif
+
     wlr_renderer_scissor(renderer->wlr_renderer, NULL);
     wlr_output_render_software_cursors(output->wlr_output, damage);
 	wlr_renderer_end(renderer->wlr_renderer);
@@ -458,13 +1174,59 @@ void wm_renderer_end(struct wm_renderer* renderer, pixman_region32_t* damage, st
     renderer->current = NULL;
 }
 
+void wm_renderer_get_gl_stats(struct wm_renderer *renderer, int32_t *issued, int32_t *skipped){
+#ifdef WM_CUSTOM_RENDERER
+    *issued = renderer->gl_stats.issued;
+    *skipped = renderer->gl_stats.skipped;
+#else
+    *issued = 0;
+    *skipped = 0;
+#endif
+}
+
 void wm_renderer_render_texture_at(struct wm_renderer *renderer,
                                    pixman_region32_t *damage,
                                    struct wlr_texture *texture,
                                    struct wlr_box *box, double opacity,
-                                   double padding_l, double padding_t, double padding_r, double padding_b,
-                                   double corner_radius, double lock_perc) {
+                                   struct wlr_fbox *mask,
+                                   double corner_radius) {
+
+    pixman_box32_t extents = {
+        .x1 = box->x,
+        .y1 = box->y,
+        .x2 = box->x + box->width,
+        .y2 = box->y + box->height
+    };
+    if(pixman_region32_contains_rectangle(damage, &extents) == PIXMAN_REGION_OUT){
+        return;
+    }
 
+#ifdef WM_CUSTOM_RENDERER
+    /* Visible rounded box relative to box */
+    struct wlr_fbox rect = {
+        .x = 0,
+        .y = 0,
+        .width = box->width,
+        .height = box->height
+    };
+    if(mask){
+        double x1 = fmax(0., mask->x - box->x);
+        double y1 = fmax(0., mask->y - box->y);
+        double x2 = fmin(box->width, mask->x + mask->width - box->x);
+        double y2 = fmin(box->height, mask->y + mask->height - box->y);
+        if(x2 <= x1 || y2 <= y1) return;
+
+        rect.x = x1;
+        rect.y = y1;
+        rect.width = x2 - x1;
+        rect.height = y2 - y1;
+    }
+    corner_radius = fmax(0., fmin(corner_radius, .5 * fmin(rect.width, rect.height)));
+
+    /* Drawn in wm_renderer_end */
+    batch_push_texture(renderer, texture, opacity, box, pixman_region32_extents(damage),
+            &rect, corner_radius);
+#else
     float matrix[9];
     wlr_matrix_project_box(matrix, box,
             WL_OUTPUT_TRANSFORM_NORMAL, 0,
@@ -491,20 +1253,410 @@ void wm_renderer_render_texture_at(struct wm_renderer *renderer,
 		if(wlr_box_empty(&inters)) continue;
 
         wlr_renderer_scissor(renderer->wlr_renderer, &inters);
-
-#ifdef WM_CUSTOM_RENDERER
-		render_subtexture_with_matrix(
-				renderer,
-				texture,
-				&fbox, matrix, opacity,
-				box,
-				padding_l, padding_t, padding_r, padding_b,
-				corner_radius, lock_perc);
-#else
 		wlr_render_subtexture_with_matrix(
 				renderer->wlr_renderer,
 				texture,
 				&fbox, matrix, opacity);
-#endif
 	}
+#endif
+}
+
+bool wm_renderer_texture_has_alpha(struct wlr_texture* texture){
+    if(!texture) return true;
+#ifdef WM_CUSTOM_RENDERER
+    return gles2_get_texture(texture)->has_alpha;
+#else
+    return true;
+#endif
+}
+
+void wm_renderer_clear_region(struct wm_renderer* renderer, pixman_region32_t* region, const float color[static 4]){
+    int nrects;
+    pixman_box32_t* rects = pixman_region32_rectangles(region, &nrects);
+
+#ifdef WM_CUSTOM_RENDERER
+    /* Single run, drawn in wm_renderer_end */
+    struct wm_renderer_batch* batch = &renderer->batch;
+    int first = batch->n_vertices;
+    for(int i=0; i<nrects; i++){
+        if(!batch_push_solid(batch, &rects[i], color)) break;
+    }
+    if(batch->n_vertices > first){
+        batch_add_run(batch, &renderer->shader_solid, GL_TEXTURE_2D, 0, GL_NEAREST, first, batch->n_vertices - first);
+    }
+#else
+    for(int i=0; i<nrects; i++){
+        struct wlr_box box = {
+            .x = rects[i].x1,
+            .y = rects[i].y1,
+            .width = rects[i].x2 - rects[i].x1,
+            .height = rects[i].y2 - rects[i].y1
+        };
+        wlr_render_rect(renderer->wlr_renderer, &box, color,
+                renderer->current->wlr_output->transform_matrix);
+    }
+#endif
+}
+
+bool wm_renderer_begin_lock_cache(struct wm_renderer* renderer, struct wm_renderer_lock_cache** cache,
+        pixman_region32_t* damage, pixman_region32_t* region){
+#ifdef WM_CUSTOM_RENDERER
+    struct wlr_output* wlr_output = renderer->current->wlr_output;
+
+    if(!*cache){
+        *cache = calloc(1, sizeof(struct wm_renderer_lock_cache));
+        if(!*cache){
+            pixman_region32_copy(region, damage);
+            return true;
+        }
+        wl_list_init(&(*cache)->link);
+        pixman_region32_init(&(*cache)->damage);
+        (*cache)->dirty = true;
+    }
+    struct wm_renderer_lock_cache* c = *cache;
+
+    if(!lock_cache_ensure(renderer, c, wlr_output->width, wlr_output->height)){
+        /* Render without the effect */
+        pixman_region32_copy(region, damage);
+        return true;
+    }
+    if(!c->dirty && !pixman_region32_not_empty(&c->damage)) return false;
+
+    /* Anything so far belongs to the output */
+    batch_flush(renderer, renderer->batch.clip);
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &c->output_fbo);
+    c->output_stencil = renderer->batch.stencil;
+    c->output_clip = renderer->batch.clip;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, c->fbo);
+    renderer->batch.stencil = batch_ensure_stencil(&c->stencil, c->width, c->height);
+
+    /* Outside of damage, the cache still holds what has been rendered before */
+    int width, height;
+    wlr_output_transformed_resolution(wlr_output, &width, &height);
+    if(c->dirty){
+        pixman_region32_union_rect(region, region, 0, 0, width, height);
+    }else{
+        pixman_region32_intersect_rect(region, &c->damage, 0, 0, width, height);
+    }
+    renderer->batch.clip = region;
+    return true;
+#else
+    pixman_region32_copy(region, damage);
+    return true;
+#endif
+}
+
+void wm_renderer_end_lock_cache(struct wm_renderer* renderer, struct wm_renderer_lock_cache* cache){
+#ifdef WM_CUSTOM_RENDERER
+    if(!cache || !cache->fbo) return;
+
+    batch_flush(renderer, renderer->batch.clip);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, cache->output_fbo);
+    renderer->batch.stencil = cache->output_stencil;
+    renderer->batch.clip = cache->output_clip;
+
+    cache->dirty = false;
+    pixman_region32_clear(&cache->damage);
+#endif
+}
+
+void wm_renderer_render_lock_cache(struct wm_renderer* renderer, struct wm_renderer_lock_cache* cache,
+        pixman_region32_t* damage, double lock_perc){
+#ifdef WM_CUSTOM_RENDERER
+    if(!cache || !cache->fbo || cache->dirty) return;
+    if(!pixman_region32_not_empty(damage)) return;
+
+    int width, height;
+    wlr_output_transformed_resolution(renderer->current->wlr_output, &width, &height);
+    struct wlr_box tex_box = { 0, 0, cache->width, cache->height };
+    struct wlr_fbox rect = { 0, 0, width, height };
+
+    /* Drawn in wm_renderer_end */
+    batch_push_framebuffer_texture(renderer, cache->tex, GL_NEAREST, &tex_box, &rect, 0., 1.,
+            pixman_region32_extents(damage), lock_perc);
+#endif
+}
+
+void wm_renderer_invalidate_lock_cache(struct wm_renderer_lock_cache* cache, pixman_region32_t* region){
+#ifdef WM_CUSTOM_RENDERER
+    if(!cache) return;
+
+    if(region){
+        pixman_region32_union(&cache->damage, &cache->damage, region);
+    }else{
+        cache->dirty = true;
+    }
+#endif
+}
+
+/*
+ * The lock effect swirls pixels around the output centre, keeping their
+ * (normalised) distance to it. Changed pixels thus show up anywhere at the
+ * same distances, i.e. in a ring, which is damaged as its outer box minus
+ * the box inscribed into its inner circle. Beyond the inscribed circle,
+ * samples are clamped to the texture edges, towards the centre, so changes
+ * there may show up anywhere further out.
+ */
+void wm_renderer_lock_effect_damage(struct wm_output* output, pixman_region32_t* region,
+        pixman_region32_t* damage){
+#ifdef WM_CUSTOM_RENDERER
+    int width, height;
+    wlr_output_transformed_resolution(output->wlr_output, &width, &height);
+    if(width <= 0 || height <= 0 || !pixman_region32_not_empty(region)) return;
+
+    pixman_box32_t* extents = pixman_region32_extents(region);
+    double x1 = (double)extents->x1 / width - .5;
+    double x2 = (double)extents->x2 / width - .5;
+    double y1 = (double)extents->y1 / height - .5;
+    double y2 = (double)extents->y2 / height - .5;
+
+    double dx_max = fmax(fabs(x1), fabs(x2));
+    double dy_max = fmax(fabs(y1), fabs(y2));
+    double r_max = sqrt(dx_max * dx_max + dy_max * dy_max);
+    if(r_max >= .5) r_max = 1.;
+
+    double dx_min = x1 <= 0. && x2 >= 0. ? 0. : fmin(fabs(x1), fabs(x2));
+    double dy_min = y1 <= 0. && y2 >= 0. ? 0. : fmin(fabs(y1), fabs(y2));
+    double r_inner = sqrt(dx_min * dx_min + dy_min * dy_min) / sqrt(2.);
+
+    /* One pixel margin for linear filtering */
+    int ox1 = floor((.5 - r_max) * width) - 1;
+    int oy1 = floor((.5 - r_max) * height) - 1;
+    int ox2 = ceil((.5 + r_max) * width) + 1;
+    int oy2 = ceil((.5 + r_max) * height) + 1;
+
+    pixman_region32_t ring;
+    pixman_region32_init_rect(&ring, ox1, oy1, ox2 - ox1, oy2 - oy1);
+
+    int ix1 = ceil((.5 - r_inner) * width) + 1;
+    int iy1 = ceil((.5 - r_inner) * height) + 1;
+    int ix2 = floor((.5 + r_inner) * width) - 1;
+    int iy2 = floor((.5 + r_inner) * height) - 1;
+    if(ix2 > ix1 && iy2 > iy1){
+        pixman_region32_t inner;
+        pixman_region32_init_rect(&inner, ix1, iy1, ix2 - ix1, iy2 - iy1);
+        pixman_region32_subtract(&ring, &ring, &inner);
+        pixman_region32_fini(&inner);
+    }
+
+    pixman_region32_intersect_rect(&ring, &ring, 0, 0, width, height);
+    pixman_region32_union(damage, damage, &ring);
+    pixman_region32_fini(&ring);
+#else
+    pixman_region32_union(damage, damage, region);
+#endif
+}
+
+void wm_renderer_destroy_lock_cache(struct wm_renderer* renderer, struct wm_renderer_lock_cache* cache){
+#ifdef WM_CUSTOM_RENDERER
+    if(!cache) return;
+
+    wlr_log(WLR_DEBUG, "Releasing lock cache");
+
+    /* GL objects can only be deleted with a current context */
+    wl_list_remove(&cache->link);
+    wl_list_insert(&renderer->lock_cache_garbage, &cache->link);
+#endif
+}
+
+void wm_renderer_render_blur(struct wm_renderer* renderer, pixman_region32_t* damage,
+        struct wm_renderer_blur** blur, struct wlr_fbox* mask, double corner_radius,
+        double opacity, int passes, double radius){
+#ifdef WM_CUSTOM_RENDERER
+    if(passes <= 0 || mask->width < 1 || mask->height < 1) return;
+    if(passes > WM_RENDERER_BLUR_MAX_PASSES) passes = WM_RENDERER_BLUR_MAX_PASSES;
+
+    pixman_box32_t extents = {
+        .x1 = floor(mask->x),
+        .y1 = floor(mask->y),
+        .x2 = ceil(mask->x + mask->width),
+        .y2 = ceil(mask->y + mask->height)
+    };
+    if(pixman_region32_contains_rectangle(damage, &extents) == PIXMAN_REGION_OUT){
+        return;
+    }
+
+    struct wm_renderer_blur* b;
+    for(b = *blur; b && b->output != renderer->current; b = b->next);
+    if(!b){
+        b = calloc(1, sizeof(struct wm_renderer_blur));
+        if(!b) return;
+        wl_list_init(&b->link);
+        b->dirty = true;
+        b->output = renderer->current;
+        b->next = *blur;
+        *blur = b;
+    }
+
+    /* Framebuffer pixels behind mask */
+    double fb_x1, fb_y1, fb_x2, fb_y2;
+    output_to_framebuffer(renderer, mask->x, mask->y, &fb_x1, &fb_y1);
+    output_to_framebuffer(renderer, mask->x + mask->width, mask->y + mask->height, &fb_x2, &fb_y2);
+
+    struct wlr_output* wlr_output = renderer->current->wlr_output;
+    int x1 = fmax(0., floor(fmin(fb_x1, fb_x2)));
+    int y1 = fmax(0., floor(fmin(fb_y1, fb_y2)));
+    int x2 = fmin(wlr_output->width, ceil(fmax(fb_x1, fb_x2)));
+    int y2 = fmin(wlr_output->height, ceil(fmax(fb_y1, fb_y2)));
+    if(x2 <= x1 || y2 <= y1) return;
+
+    struct wlr_box fb_box = { x1, y1, x2 - x1, y2 - y1 };
+    if(b->dirty || memcmp(&fb_box, &b->fb_box, sizeof(fb_box))){
+        if(!blur_ensure_levels(renderer, b, fb_box.width, fb_box.height, passes + 1)){
+            return;
+        }
+
+        /* Everything behind has to be in the framebuffer */
+        batch_flush(renderer, renderer->batch.clip);
+        blur_update(renderer, b, &fb_box, radius);
+    }
+
+    /* Drawn in wm_renderer_end */
+    corner_radius = fmax(0., fmin(corner_radius, .5 * fmin(mask->width, mask->height)));
+    /* Keeps the filter the blur passes rely on, see blur_ensure_levels */
+    batch_push_framebuffer_texture(renderer, b->tex[0], GL_LINEAR, &b->fb_box, mask,
+            corner_radius, opacity, pixman_region32_extents(damage), 0.);
+#endif
+}
+
+void wm_renderer_invalidate_blur(struct wm_renderer_blur* blur){
+#ifdef WM_CUSTOM_RENDERER
+    for(; blur; blur = blur->next){
+        blur->dirty = true;
+    }
+#endif
+}
+
+void wm_renderer_destroy_blur(struct wm_renderer* renderer, struct wm_renderer_blur* blur){
+#ifdef WM_CUSTOM_RENDERER
+    /* GL objects can only be deleted with a current context */
+    while(blur){
+        struct wm_renderer_blur* next = blur->next;
+        wl_list_remove(&blur->link);
+        wl_list_insert(&renderer->blur_garbage, &blur->link);
+        blur = next;
+    }
+#endif
+}
+
+void wm_renderer_capture_mirror(struct wm_renderer* renderer, struct wm_renderer_mirror** mirror,
+        pixman_region32_t* damage){
+#ifdef WM_CUSTOM_RENDERER
+    if(!*mirror){
+        *mirror = calloc(1, sizeof(struct wm_renderer_mirror));
+        if(!*mirror) return;
+        wl_list_init(&(*mirror)->link);
+    }
+    struct wm_renderer_mirror* m = *mirror;
+
+    struct wlr_output* wlr_output = renderer->current->wlr_output;
+    mirror_ensure(renderer, m, wlr_output->width, wlr_output->height);
+
+    int width, height;
+    wlr_output_transformed_resolution(wlr_output, &width, &height);
+    m->output_width = width;
+    m->output_height = height;
+
+    double x0, y0, x1, y1, x2, y2;
+    output_to_framebuffer(renderer, 0, 0, &x0, &y0);
+    output_to_framebuffer(renderer, width, 0, &x1, &y1);
+    output_to_framebuffer(renderer, 0, height, &x2, &y2);
+    m->origin[0] = x0 / m->width;
+    m->origin[1] = y0 / m->height;
+    m->axis_x[0] = (x1 - x0) / m->width;
+    m->axis_x[1] = (y1 - y0) / m->height;
+    m->axis_y[0] = (x2 - x0) / m->width;
+    m->axis_y[1] = (y2 - y0) / m->height;
+
+    /* After the texture has been (re)created, the whole framebuffer is needed */
+    struct wlr_box fb_box = { 0, 0, m->width, m->height };
+    if(m->valid){
+        if(!pixman_region32_not_empty(damage)) return;
+
+        pixman_box32_t* extents = pixman_region32_extents(damage);
+        double fb_x1, fb_y1, fb_x2, fb_y2;
+        output_to_framebuffer(renderer, extents->x1, extents->y1, &fb_x1, &fb_y1);
+        output_to_framebuffer(renderer, extents->x2, extents->y2, &fb_x2, &fb_y2);
+
+        int bx1 = fmax(0., floor(fmin(fb_x1, fb_x2)));
+        int by1 = fmax(0., floor(fmin(fb_y1, fb_y2)));
+        int bx2 = fmin(m->width, ceil(fmax(fb_x1, fb_x2)));
+        int by2 = fmin(m->height, ceil(fmax(fb_y1, fb_y2)));
+        if(bx2 <= bx1 || by2 <= by1) return;
+
+        fb_box = (struct wlr_box){ bx1, by1, bx2 - bx1, by2 - by1 };
+    }
+
+    /* Everything has to be in the framebuffer */
+    batch_flush(renderer, renderer->batch.clip);
+
+    gl_bind_texture(renderer, GL_TEXTURE_2D, m->tex);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, fb_box.x, fb_box.y,
+            fb_box.x, fb_box.y, fb_box.width, fb_box.height);
+    m->valid = true;
+#endif
+}
+
+void wm_renderer_render_mirror(struct wm_renderer* renderer, struct wm_renderer_mirror* mirror,
+        pixman_region32_t* damage){
+#ifdef WM_CUSTOM_RENDERER
+    if(!mirror || !mirror->valid) return;
+    if(!pixman_region32_not_empty(damage)) return;
+
+    /* Fit, keeping the aspect ratio */
+    int width, height;
+    wlr_output_transformed_resolution(renderer->current->wlr_output, &width, &height);
+    double scale = fmin((double)width / mirror->output_width, (double)height / mirror->output_height);
+    struct wlr_fbox rect = {
+        .width = scale * mirror->output_width,
+        .height = scale * mirror->output_height
+    };
+    rect.x = .5 * (width - rect.width);
+    rect.y = .5 * (height - rect.height);
+
+    struct wm_renderer_batch* batch = &renderer->batch;
+    int first = batch->n_vertices;
+    struct wm_renderer_vertex* v = batch_reserve(batch, 6);
+    if(!v) return;
+
+    for(int i=0; i<6; i++){
+        GLfloat u = quad_corners[i][0];
+        GLfloat w = quad_corners[i][1];
+        v[i] = (struct wm_renderer_vertex){
+            .pos = { rect.x + u * rect.width, rect.y + w * rect.height },
+            .texcoord = {
+                mirror->origin[0] + u * mirror->axis_x[0] + w * mirror->axis_y[0],
+                mirror->origin[1] + u * mirror->axis_x[1] + w * mirror->axis_y[1] },
+            .local = { (u - .5) * rect.width, (w - .5) * rect.height },
+            .rect = { .5 * rect.width, .5 * rect.height, 0., 1. },
+            .lock_perc = 0.
+        };
+    }
+
+    /* Drawn in wm_renderer_end; scaled, unlike anything else batched */
+    batch_add_run(batch, &renderer->shaders[0], GL_TEXTURE_2D, mirror->tex, GL_LINEAR, first, 6);
+#endif
+}
+
+void wm_renderer_destroy_stencil(struct wm_renderer* renderer, struct wm_renderer_stencil* stencil){
+#ifdef WM_CUSTOM_RENDERER
+    if(!stencil) return;
+
+    /* GL objects can only be deleted with a current context */
+    wl_list_remove(&stencil->link);
+    wl_list_insert(&renderer->stencil_garbage, &stencil->link);
+#endif
+}
+
+void wm_renderer_destroy_mirror(struct wm_renderer* renderer, struct wm_renderer_mirror* mirror){
+#ifdef WM_CUSTOM_RENDERER
+    if(!mirror) return;
+
+    /* GL objects can only be deleted with a current context */
+    wl_list_remove(&mirror->link);
+    wl_list_insert(&renderer->mirror_garbage, &mirror->link);
+#endif
 }
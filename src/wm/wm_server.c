@@ -1,7 +1,10 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <wayland-server.h>
 #include <wlr/backend.h>
 #include <wlr/backend/headless.h>
@@ -12,6 +15,7 @@
 #include <wlr/config.h>
 #include <wlr/types/wlr_data_control_v1.h>
 #include <wlr/types/wlr_export_dmabuf_v1.h>
+#include <wlr/types/wlr_presentation_time.h>
 #include <wlr/types/wlr_linux_dmabuf_v1.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_screencopy_v1.h>
@@ -33,9 +37,13 @@
 #include "wm/wm_output.h"
 #include "wm/wm_renderer.h"
 #include "wm/wm_idle_inhibit.h"
+#include "wm/wm_grid.h"
+#include "wm/wm_content_arrays.h"
+#include "wm/wm_surface_map.h"
 #include "wm/wm_widget.h"
 #include "wm/wm_view.h"
 #include "wm/wm_drag.h"
+#include "wm/wm_trace.h"
 
 
 /*
@@ -61,9 +69,7 @@ static void handle_new_output(struct wl_listener* listener, void* data){
     /* Start the timer loop once an output is there */
     if(!server->callback_timer_started){
         server->callback_timer_started = true;
-        wl_event_source_timer_update(
-                server->callback_timer,
-                1000 / server->wm_config->callback_frequency);
+        wm_server_schedule_update(server);
     }
 }
 
@@ -73,12 +79,7 @@ static void handle_new_xdg_surface(struct wl_listener* listener, void* data){
     struct wm_server* server = wl_container_of(listener, server, new_xdg_surface);
     struct wlr_xdg_surface* surface = data;
 
-    /* Let clients know which (only one is supported) output they're on */
-    if(server->wm_layout->default_output) {
-        wlr_surface_send_enter(surface->surface,
-                server->wm_layout->default_output->wlr_output);
-    }
-
+    /* Outputs are entered by the view, see wm_view_update_outputs */
     if(surface->role == WLR_XDG_SURFACE_ROLE_POPUP){
         /* Popups should be handled by the parent */
         return;
@@ -142,22 +143,54 @@ static void handle_ready(struct wl_listener* listener, void* data){
     wm_callback_ready();
 }
 
+static int wakeup_handler(int fd, uint32_t mask, void* data){
+    struct wm_server* server = data;
+
+    uint64_t count;
+    if(read(fd, &count, sizeof(count)) < 0){
+        wlr_log_errno(WLR_DEBUG, "Server: Could not read wakeup eventfd");
+    }
+
+    if(atomic_exchange(&server->update_requested, false)){
+        wm_server_schedule_update(server);
+    }
+
+    wm_callback_apply_update();
+    return 0;
+}
+
+static void callback_metric(struct wm_server* server, struct timespec now){
+    long msec = msec_diff(now, server->callback_metric_since);
+    if(msec < 1000) return;
+
+    wlr_log(WLR_DEBUG, "Server: %.2f callback timer wake-ups/s, %.2f updates/s",
+            1000. * server->n_callback_timer_wakeups / msec,
+            1000. * server->n_callback_updates / msec);
+
+    server->n_callback_timer_wakeups = 0;
+    server->n_callback_updates = 0;
+    server->callback_metric_since = now;
+}
+
 static int callback_timer_handler(void* data){
     struct wm_server* server = data;
+    server->callback_timer_armed = false;
 
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
 
-    long long msec_diff = now.tv_nsec / 1000000 - server->last_callback_externally_sourced.tv_nsec / 1000000;
-    msec_diff += (now.tv_sec - server->last_callback_externally_sourced.tv_sec)*1000;
-    if(msec_diff > 1000 / server->wm_config->callback_frequency){
+    server->n_callback_timer_wakeups++;
+    callback_metric(server, now);
+
+    /*
+     * If an update has just been executed externally, its result decides
+     * whether to re-arm, otherwise ours does
+     */
+    if(msec_diff(now, server->last_callback_externally_sourced) > 1000 / server->wm_config->callback_frequency){
+        server->n_callback_updates++;
         wm_callback_update();
     }
 
-    /* Reschedule */
-    wl_event_source_timer_update(
-            server->callback_timer,
-            1000 / server->wm_config->callback_frequency);
     return 0;
 }
 
@@ -166,8 +199,22 @@ static int callback_timer_handler(void* data){
  */
 void wm_server_init(struct wm_server* server, struct wm_config* config){
     wl_list_init(&server->wm_contents);
+    server->n_contents = 0;
+    wl_list_init(&server->blurred_contents);
+    server->contents_generation = 0;
     server->wm_config = config;
 
+    /* Spatial index and content arrays, before any content is created */
+    server->wm_grid = calloc(1, sizeof(struct wm_grid));
+    wm_grid_init(server->wm_grid, server);
+    server->wm_content_arrays = calloc(1, sizeof(struct wm_content_arrays));
+    wm_content_arrays_init(server->wm_content_arrays);
+    server->surface_at_memo.valid = false;
+
+    server->wm_surface_map = calloc(1, sizeof(struct wm_surface_map));
+    wm_surface_map_init(server->wm_surface_map);
+    server->surfaces_generation = 0;
+
     /* Display */
     server->wl_display = wl_display_create();
     assert(server->wl_display);
@@ -206,6 +253,10 @@ void wm_server_init(struct wm_server* server, struct wm_config* config){
     server->wlr_xdg_decoration_manager = wlr_xdg_decoration_manager_v1_create(server->wl_display);
     assert(server->wlr_xdg_decoration_manager);
 
+    /* Feedback is sent per output, see wm_output_surface_sampled */
+    server->wlr_presentation = wlr_presentation_create(server->wl_display, server->wlr_backend);
+    assert(server->wlr_presentation);
+
     wlr_export_dmabuf_manager_v1_create(server->wl_display);
     wlr_screencopy_manager_v1_create(server->wl_display);
     wlr_data_control_manager_v1_create(server->wl_display);
@@ -283,6 +334,18 @@ void wm_server_init(struct wm_server* server, struct wm_config* config){
 	server->callback_timer = wl_event_loop_add_timer(server->wl_event_loop,
 		callback_timer_handler, server);
     server->callback_timer_started = false;
+    server->callback_timer_armed = false;
+    server->update_state = WM_UPDATE_ANIMATING;
+
+    server->n_callback_timer_wakeups = 0;
+    server->n_callback_updates = 0;
+    clock_gettime(CLOCK_MONOTONIC, &server->callback_metric_since);
+
+    server->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    assert(server->wakeup_fd >= 0);
+    server->wakeup_source = wl_event_loop_add_fd(server->wl_event_loop,
+            server->wakeup_fd, WL_EVENT_READABLE, wakeup_handler, server);
+    atomic_init(&server->update_requested, false);
 
     clock_gettime(CLOCK_MONOTONIC, &server->last_callback_externally_sourced);
 
@@ -300,76 +363,123 @@ void wm_server_destroy(struct wm_server* server){
     free(server->wm_seat);
     free(server->wm_idle_inhibit);
 
+    wl_event_source_remove(server->wakeup_source);
+    close(server->wakeup_fd);
+
     wlr_xwayland_destroy(server->wlr_xwayland);
     wl_display_destroy_clients(server->wl_display);
     wl_display_destroy(server->wl_display);
+
+    /* Contents unregister when their clients are destroyed */
+    wm_grid_destroy(server->wm_grid);
+    free(server->wm_grid);
+    wm_content_arrays_destroy(server->wm_content_arrays);
+    free(server->wm_content_arrays);
+    wm_surface_map_destroy(server->wm_surface_map);
+    free(server->wm_surface_map);
 }
 
 void wm_server_surface_at(struct wm_server* server, double at_x, double at_y, 
         struct wlr_surface** result, double* result_sx, double* result_sy, double* result_scale_x, double* result_scale_y){
-    struct wm_content* content;
-    wl_list_for_each(content, &server->wm_contents, link){
-        if(!wm_content_is_view(content)) continue;
-        struct wm_view* view = wm_cast(wm_view, content);
+    struct wm_server_surface_at_memo* memo = &server->surface_at_memo;
+    if(!(memo->valid && memo->at_x == at_x && memo->at_y == at_y &&
+                memo->contents_generation == server->contents_generation &&
+                memo->grid_generation == server->wm_grid->generation)){
+
+        WM_TRACE_BEGIN("surface_at");
+        memo->surface = NULL;
+
+        struct wm_content** candidates;
+        int n_candidates = wm_grid_query(server->wm_grid, at_x, at_y, &candidates);
+
+        /* Topmost first; there are only a few, if any */
+        wm_content_arrays_update(server);
+        for(int i=1; i<n_candidates; i++){
+            struct wm_content* content = candidates[i];
+            int j = i;
+            for(; j>0 && candidates[j-1]->z_order > content->z_order; j--){
+                candidates[j] = candidates[j-1];
+            }
+            candidates[j] = content;
+        }
+
+        for(int i=0; i<n_candidates; i++){
+            struct wm_view* view = wm_cast(wm_view, candidates[i]);
 
-        if(!view->mapped) continue;
-        if(!view->accepts_input) continue;
+            if(!view->mapped) continue;
+            if(!view->accepts_input) continue;
 
-        int width;
-        int height;
-        wm_view_get_size(view, &width, &height);
+            int width;
+            int height;
+            wm_view_get_size(view, &width, &height);
 
-        if(width <= 0 || height <=0) continue;
+            if(width <= 0 || height <=0) continue;
 
-        double display_x, display_y, display_width, display_height;
-        wm_content_get_box(content, &display_x, &display_y, &display_width, &display_height);
+            double display_x, display_y, display_width, display_height;
+            wm_content_get_box(&view->super, &display_x, &display_y, &display_width, &display_height);
 
-        double scale_x = display_width/width;
-        double scale_y = display_height/height;
+            double scale_x = display_width/width;
+            double scale_y = display_height/height;
 
-        int view_at_x = round((at_x - display_x) / scale_x);
-        int view_at_y = round((at_y - display_y) / scale_y);
+            int view_at_x = round((at_x - display_x) / scale_x);
+            int view_at_y = round((at_y - display_y) / scale_y);
 
-        double sx;
-        double sy;
-        struct wlr_surface* surface = wm_view_surface_at(view, view_at_x, view_at_y, &sx, &sy);
+            double sx;
+            double sy;
+            struct wlr_surface* surface = wm_view_surface_at(view, view_at_x, view_at_y, &sx, &sy);
 
-        if(surface){
-            *result = surface;
-            if(result_sx) *result_sx = sx;
-            if(result_sy) *result_sy = sy;
-            if(result_scale_x) *result_scale_x = scale_x;
-            if(result_scale_y) *result_scale_y = scale_y;
-            return;
+            if(surface){
+                memo->surface = surface;
+                memo->sx = sx;
+                memo->sy = sy;
+                memo->scale_x = scale_x;
+                memo->scale_y = scale_y;
+                break;
+            }
         }
+
+        memo->valid = true;
+        memo->at_x = at_x;
+        memo->at_y = at_y;
+        memo->contents_generation = server->contents_generation;
+        memo->grid_generation = server->wm_grid->generation;
+        WM_TRACE_END("surface_at");
     }
 
-    *result = NULL;
+    *result = memo->surface;
+    if(memo->surface){
+        if(result_sx) *result_sx = memo->sx;
+        if(result_sy) *result_sy = memo->sy;
+        if(result_scale_x) *result_scale_x = memo->scale_x;
+        if(result_scale_y) *result_scale_y = memo->scale_y;
+    }
 }
 
-struct _view_for_surface_data {
+struct view_for_surface_data {
     struct wlr_surface* surface;
     bool result;
 };
 
-static void _view_for_surface(struct wlr_surface* surface, int sx, int sy, void* _data){
-    struct _view_for_surface_data* data = _data;
-    if(surface == data->surface){
-        data->result = true;
-        return;
-    }
+static void view_for_surface(struct wlr_surface* surface, int sx, int sy, void* _data){
+    struct view_for_surface_data* data = _data;
+    if(surface == data->surface) data->result = true;
 }
 
 struct wm_view* wm_server_view_for_surface(struct wm_server* server, struct wlr_surface* surface){
+    struct wm_view* result = wm_surface_map_get(server->wm_surface_map, surface);
+    if(result || !surface || !wlr_surface_has_buffer(surface)) return result;
+
+    /* Every mapped view surface should be registered - walk the views, should one be missing */
     struct wm_content* content;
     wl_list_for_each(content, &server->wm_contents, link){
         if(!wm_content_is_view(content)) continue;
         struct wm_view* view = wm_cast(wm_view, content);
 
-        struct _view_for_surface_data data = { 0 };
-        data.surface = surface;
-        wm_view_for_each_surface(view, _view_for_surface, &data);
+        struct view_for_surface_data data = { .surface = surface, .result = false };
+        wm_view_for_each_surface(view, view_for_surface, &data);
         if(data.result){
+            wlr_log(WLR_ERROR, "Server: Surface missing from surface map");
+            wm_surface_map_insert(server->wm_surface_map, surface, view);
             return view;
         }
     }
@@ -384,52 +494,77 @@ struct wm_widget* wm_server_create_widget(struct wm_server* server){
 }
 
 
-void wm_server_update_contents(struct wm_server* server){
-    /* Empty or only one element */
-    if(server->wm_contents.next == server->wm_contents.prev) return;
-
-    int swapped = 1;
-    do {
-        swapped = 0;
-
-        struct wl_list* cur1 = server->wm_contents.next;
-        struct wl_list* cur2 = cur1->next;
-        for(;cur1 != server->wm_contents.prev; 
-                cur1 = cur1->next, cur2 = cur2->next){
+void wm_server_callback_update(struct wm_server* server){
+    clock_gettime(CLOCK_MONOTONIC, &server->last_callback_externally_sourced);
+    server->n_callback_updates++;
+    wm_callback_update();
+}
 
-            struct wm_content* content1 = wl_container_of(cur1, content1, link);
-            struct wm_content* content2 = wl_container_of(cur2, content2, link);
+void wm_server_request_apply_update(struct wm_server* server){
+    uint64_t one = 1;
+    if(write(server->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+        wlr_log_errno(WLR_DEBUG, "Server: Could not write wakeup eventfd");
+    }
+}
 
-            if(wm_content_get_z_index(content1)<wm_content_get_z_index(content2)){
-                cur1->prev->next = cur2;
-                cur2->next->prev = cur1;
+static void arm_callback_timer(struct wm_server* server, int msec){
+    if(!server->callback_timer_started) return;
+    if(msec < 1) msec = 1;
 
-                cur1->next = cur2->next;
-                cur2->prev = cur1->prev;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct timespec due = timespec_add_msec(now, msec);
 
-                cur2->next = cur1;
-                cur1->prev = cur2;
+    /* Already due earlier */
+    if(server->callback_timer_armed && msec_diff_f(due, server->callback_timer_due) >= 0.){
+        return;
+    }
 
-                cur1 = cur1->prev;
-                cur2 = cur1;
-                swapped = 1;
-            }
-        }
+    server->callback_timer_armed = true;
+    server->callback_timer_due = due;
+    wl_event_source_timer_update(server->callback_timer, msec);
+}
 
-    } while(swapped);
+void wm_server_schedule_update(struct wm_server* server){
+    arm_callback_timer(server, 1000 / server->wm_config->callback_frequency);
 }
 
+void wm_server_request_update(struct wm_server* server){
+    atomic_store(&server->update_requested, true);
+    wm_server_request_apply_update(server);
+}
 
-void wm_server_callback_update(struct wm_server* server){
-    clock_gettime(CLOCK_MONOTONIC, &server->last_callback_externally_sourced);
-    wm_callback_update();
+void wm_server_set_update_state(struct wm_server* server, enum wm_update_state state, int deadline_msec){
+    if(state != server->update_state){
+        wlr_log(WLR_DEBUG, "Server: Update state %d -> %d", server->update_state, state);
+    }
+    server->update_state = state;
+
+    switch(state){
+    case WM_UPDATE_IDLE:
+        /* Let the timer run out, input, view events and commits re-arm it */
+        break;
+    case WM_UPDATE_ANIMATING:
+        wm_server_schedule_update(server);
+        break;
+    case WM_UPDATE_DEADLINE:
+        arm_callback_timer(server, deadline_msec);
+        break;
+    }
 }
 
 void wm_server_set_locked(struct wm_server* server, double lock_perc){
     if(fabs(lock_perc - server->lock_perc) < 0.001) return;
 
+    bool was_locked = wm_server_is_locked(server);
     server->lock_perc = lock_perc;
-    wm_layout_damage_whole(server->wm_layout);
+
+    /* Caches are not kept up to date while unlocked */
+    if(!was_locked){
+        wm_layout_damage_whole(server->wm_layout);
+    }else{
+        wm_layout_damage_lock(server->wm_layout);
+    }
 
     if(wm_server_is_locked(server)){
         wm_seat_clear_focus(server->wm_seat);
@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <wlr/util/log.h>
+
+#include "wm/wm_surface_map.h"
+
+#define INITIAL_CAPACITY 64
+
+static size_t slot_of(struct wm_surface_map* map, struct wlr_surface* surface){
+    /* Fibonacci hashing, allocations are aligned */
+    uint64_t hash = ((uintptr_t)surface >> 4) * 11400714819323198485llu;
+    return (size_t)(hash >> 32) & (map->capacity - 1);
+}
+
+static void grow(struct wm_surface_map* map){
+    struct wm_surface_map_entry* old_entries = map->entries;
+    size_t old_capacity = map->capacity;
+
+    map->capacity = old_capacity ? 2 * old_capacity : INITIAL_CAPACITY;
+    map->entries = calloc(map->capacity, sizeof(struct wm_surface_map_entry));
+    assert(map->entries);
+    map->n_entries = 0;
+
+    for(size_t i=0; i<old_capacity; i++){
+        if(old_entries[i].surface){
+            wm_surface_map_insert(map, old_entries[i].surface, old_entries[i].view);
+        }
+    }
+    free(old_entries);
+}
+
+/* Backward shift deletion, so no tombstones are needed */
+static void remove_at(struct wm_surface_map* map, size_t slot){
+    size_t mask = map->capacity - 1;
+    size_t hole = slot;
+
+    for(size_t i=(slot + 1) & mask; map->entries[i].surface; i=(i + 1) & mask){
+        size_t home = slot_of(map, map->entries[i].surface);
+
+        /* Entry may fill the hole if its home is not within (hole, i] */
+        if(((i - home) & mask) >= ((i - hole) & mask)){
+            map->entries[hole] = map->entries[i];
+            hole = i;
+        }
+    }
+
+    map->entries[hole].surface = NULL;
+    map->entries[hole].view = NULL;
+    map->n_entries--;
+}
+
+/*
+ * Class implementation
+ */
+void wm_surface_map_init(struct wm_surface_map* map){
+    map->entries = NULL;
+    map->capacity = 0;
+    map->n_entries = 0;
+    grow(map);
+}
+
+void wm_surface_map_destroy(struct wm_surface_map* map){
+    free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->n_entries = 0;
+}
+
+void wm_surface_map_insert(struct wm_surface_map* map, struct wlr_surface* surface, struct wm_view* view){
+    assert(surface);
+
+    /* Load factor at most 1/2 */
+    if(2 * (map->n_entries + 1) > map->capacity) grow(map);
+
+    size_t mask = map->capacity - 1;
+    size_t slot = slot_of(map, surface);
+    for(; map->entries[slot].surface; slot=(slot + 1) & mask){
+        if(map->entries[slot].surface == surface){
+            map->entries[slot].view = view;
+            return;
+        }
+    }
+
+    map->entries[slot].surface = surface;
+    map->entries[slot].view = view;
+    map->n_entries++;
+}
+
+void wm_surface_map_remove(struct wm_surface_map* map, struct wlr_surface* surface, struct wm_view* view){
+    if(!surface) return;
+
+    size_t mask = map->capacity - 1;
+    for(size_t slot=slot_of(map, surface); map->entries[slot].surface; slot=(slot + 1) & mask){
+        if(map->entries[slot].surface == surface){
+            if(map->entries[slot].view == view) remove_at(map, slot);
+            return;
+        }
+    }
+}
+
+void wm_surface_map_remove_view(struct wm_surface_map* map, struct wm_view* view){
+    for(size_t slot=0; slot<map->capacity; slot++){
+        /* Shifting may move an unvisited entry into slot */
+        while(map->entries[slot].surface && map->entries[slot].view == view){
+            remove_at(map, slot);
+        }
+    }
+}
+
+struct wm_view* wm_surface_map_get(struct wm_surface_map* map, struct wlr_surface* surface){
+    if(!surface) return NULL;
+
+    size_t mask = map->capacity - 1;
+    for(size_t slot=slot_of(map, surface); map->entries[slot].surface; slot=(slot + 1) & mask){
+        if(map->entries[slot].surface == surface) return map->entries[slot].view;
+    }
+    return NULL;
+}
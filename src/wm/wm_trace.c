@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+#include "wm/wm_trace.h"
+#include "wm/wm_util.h"
+
+/*
+ * Written by its thread only; head counts all events ever written, so a
+ * reader can tell which slots might have been overwritten while copying
+ */
+struct wm_trace_ring {
+    struct wm_trace_ring* next;
+
+    long tid;
+    const char* thread_name;
+
+    atomic_uint_fast64_t head;
+    struct wm_trace_event events[WM_TRACE_RING_SIZE];
+};
+
+atomic_bool wm_trace_enabled = false;
+
+static _Thread_local struct wm_trace_ring* thread_ring = NULL;
+static _Thread_local const char* thread_name = NULL;
+
+/* Rings are only ever added, guarded by rings_mutex */
+static struct wm_trace_ring* rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct wm_trace_ring* ring_create(){
+    struct wm_trace_ring* ring = calloc(1, sizeof(struct wm_trace_ring));
+    if(!ring){
+        wlr_log(WLR_ERROR, "Trace: Could not allocate ring");
+        wm_trace_set_enabled(false);
+        return NULL;
+    }
+
+    ring->tid = syscall(SYS_gettid);
+    ring->thread_name = thread_name;
+    atomic_init(&ring->head, 0);
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    return ring;
+}
+
+void wm_trace_set_enabled(bool enabled){
+    wlr_log(WLR_INFO, "Trace: %s", enabled ? "Enabled" : "Disabled");
+    atomic_store(&wm_trace_enabled, enabled);
+}
+
+void wm_trace_set_thread_name(const char* name){
+    thread_name = name;
+    if(thread_ring) thread_ring->thread_name = name;
+}
+
+void wm_trace_event(const char* name, char phase){
+    if(!thread_ring){
+        thread_ring = ring_create();
+        if(!thread_ring) return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint_fast64_t head = atomic_load_explicit(&thread_ring->head, memory_order_relaxed);
+    struct wm_trace_event* event = &thread_ring->events[head % WM_TRACE_RING_SIZE];
+    event->nsec = timespec_nsec(now);
+    event->name = name;
+    event->phase = phase;
+
+    atomic_store_explicit(&thread_ring->head, head + 1, memory_order_release);
+}
+
+static void dump_ring(FILE* f, struct wm_trace_ring* ring, bool* first){
+    uint_fast64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint_fast64_t copied = head > WM_TRACE_RING_SIZE ? head - WM_TRACE_RING_SIZE : 0;
+    uint_fast64_t tail = copied;
+
+    struct wm_trace_event* events = malloc(WM_TRACE_RING_SIZE * sizeof(struct wm_trace_event));
+    if(!events) return;
+
+    for(uint_fast64_t i=copied; i<head; i++){
+        events[i - copied] = ring->events[i % WM_TRACE_RING_SIZE];
+    }
+
+    /*
+     * Slots the writer has reached in the meantime are not to be trusted,
+     * including new_head itself, which it may be filling right now
+     */
+    uint_fast64_t new_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if(new_head >= WM_TRACE_RING_SIZE && new_head - WM_TRACE_RING_SIZE + 1 > tail){
+        tail = new_head - WM_TRACE_RING_SIZE + 1;
+    }
+
+    if(ring->thread_name){
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+                *first ? "" : ",", (int)getpid(), ring->tid, ring->thread_name);
+        *first = false;
+    }
+
+    for(uint_fast64_t i=tail; i<head; i++){
+        struct wm_trace_event* event = &events[i - copied];
+        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld}",
+                *first ? "" : ",", event->name, event->phase, event->nsec / 1000.,
+                (int)getpid(), ring->tid);
+        *first = false;
+    }
+
+    free(events);
+}
+
+bool wm_trace_dump(const char* path){
+    FILE* f = fopen(path, "w");
+    if(!f){
+        wlr_log(WLR_ERROR, "Trace: Could not open %s", path);
+        return false;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&rings_mutex);
+    bool first = true;
+    for(struct wm_trace_ring* ring=rings; ring; ring=ring->next){
+        dump_ring(f, ring, &first);
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    fprintf(f, "\n]}\n");
+
+    bool ok = !ferror(f);
+    if(fclose(f)) ok = false;
+
+    wlr_log(WLR_INFO, "Trace: Dumped to %s", path);
+    return ok;
+}
@@ -9,6 +9,8 @@
 #include <wlr/xwayland.h>
 
 #include "wm/wm_view.h"
+#include "wm/wm_grid.h"
+#include "wm/wm_layout.h"
 #include "wm/wm_seat.h"
 #include "wm/wm_output.h"
 #include "wm/wm_renderer.h"
@@ -30,12 +32,22 @@ void wm_view_base_init(struct wm_view* view, struct wm_server* server){
     view->mapped = false;
     view->inhibiting_idle = false;
     view->accepts_input = true;
+
+    view->surfaces = NULL;
+    view->n_surfaces = 0;
+    view->surfaces_capacity = 0;
+    view->surfaces_dirty = true;
+    view->surfaces_generation = 0;
+
+    wl_array_init(&view->outputs);
 }
 
 static void wm_view_base_destroy(struct wm_content* super){
     struct wm_view* view = wm_cast(wm_view, super);
 
     (view->vtable->destroy)(view);
+    free(view->surfaces);
+    wl_array_release(&view->outputs);
     wm_content_base_destroy(super);
 }
 
@@ -50,6 +62,133 @@ bool wm_view_is_inhibiting_idle(struct wm_view* view){
     return view->inhibiting_idle;
 }
 
+void wm_view_set_accepts_input(struct wm_view* view, bool accepts_input){
+    if(accepts_input == view->accepts_input) return;
+
+    view->accepts_input = accepts_input;
+    wm_grid_invalidate(view->super.wm_server->wm_grid);
+}
+
+/*
+ * Outputs
+ */
+static void send_enter(struct wlr_surface* surface, int sx, int sy, void* data){
+    struct wm_output* output = data;
+    wlr_surface_send_enter(surface, output->wlr_output);
+}
+
+static void send_leave(struct wlr_surface* surface, int sx, int sy, void* data){
+    struct wm_output* output = data;
+    wlr_surface_send_leave(surface, output->wlr_output);
+}
+
+static bool has_output(struct wm_view* view, struct wm_output* output){
+    struct wm_output** entered;
+    wl_array_for_each(entered, &view->outputs){
+        if(*entered == output) return true;
+    }
+    return false;
+}
+
+static bool is_on_output(struct wm_view* view, struct wm_output* output){
+    struct wlr_fbox* bounds = &view->super.bounds;
+    return wm_output_intersects(output, bounds->x, bounds->y, bounds->width, bounds->height);
+}
+
+void wm_view_update_outputs(struct wm_view* view){
+    struct wm_layout* layout = view->super.wm_server->wm_layout;
+
+    bool placed = false;
+    struct wm_output* output;
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        if(is_on_output(view, output)){
+            placed = true;
+            break;
+        }
+    }
+
+    wl_list_for_each(output, &layout->wm_outputs, link){
+        bool on = placed ? is_on_output(view, output) : output == layout->default_output;
+        if(on == has_output(view, output)) continue;
+
+        if(on){
+            struct wm_output** entered = wl_array_add(&view->outputs, sizeof(struct wm_output*));
+            assert(entered);
+            *entered = output;
+            wm_view_for_each_surface(view, send_enter, output);
+        }else{
+            wm_view_forget_output(view, output);
+            wm_view_for_each_surface(view, send_leave, output);
+        }
+    }
+}
+
+void wm_view_surface_enter(struct wm_view* view, struct wlr_surface* surface){
+    struct wm_output** entered;
+    wl_array_for_each(entered, &view->outputs){
+        wlr_surface_send_enter(surface, (*entered)->wlr_output);
+    }
+}
+
+void wm_view_forget_outputs(struct wm_view* view){
+    view->outputs.size = 0;
+}
+
+void wm_view_forget_output(struct wm_view* view, struct wm_output* output){
+    struct wm_output** outputs = view->outputs.data;
+    size_t n = view->outputs.size / sizeof(struct wm_output*);
+    for(size_t i=0; i<n; i++){
+        if(outputs[i] == output){
+            outputs[i] = outputs[n - 1];
+            view->outputs.size -= sizeof(struct wm_output*);
+            return;
+        }
+    }
+}
+
+/*
+ * Flattened surface tree
+ */
+static void add_surface(struct wlr_surface *surface, int sx, int sy,
+        void *data) {
+    struct wm_view *view = data;
+
+    if(view->n_surfaces == view->surfaces_capacity){
+        view->surfaces_capacity = view->surfaces_capacity ? 2 * view->surfaces_capacity : 4;
+        view->surfaces = realloc(view->surfaces, view->surfaces_capacity * sizeof(struct wm_view_surface));
+        assert(view->surfaces);
+    }
+
+    struct wm_view_surface *entry = &view->surfaces[view->n_surfaces++];
+    entry->surface = surface;
+    entry->texture = wlr_surface_get_texture(surface);
+    entry->sx = sx;
+    entry->sy = sy;
+    entry->width = surface->current.width;
+    entry->height = surface->current.height;
+}
+
+void wm_view_invalidate_surfaces(struct wm_view* view){
+    view->surfaces_dirty = true;
+}
+
+struct wm_view_surface* wm_view_get_surfaces(struct wm_view* view, int* n_surfaces){
+    uint64_t generation = view->super.wm_server->surfaces_generation;
+    if(view->surfaces_dirty || view->surfaces_generation != generation){
+        view->n_surfaces = 0;
+        wm_view_for_each_surface(view, add_surface, view);
+
+        view->surfaces_dirty = false;
+        view->surfaces_generation = generation;
+    }
+
+    *n_surfaces = view->n_surfaces;
+    return view->surfaces;
+}
+
+/*
+ * Content implementation
+ */
 struct render_data {
     struct wm_output *output;
     pixman_region32_t* damage;
@@ -59,55 +198,42 @@ struct render_data {
     double x_scale;
     double y_scale;
     double opacity;
+
+    /* Output coordinates, applied to the root surface only */
+    struct wlr_fbox mask;
     double corner_radius;
-    double lock_perc;
-    double mask_x;
-    double mask_y;
-    double mask_w;
-    double mask_h;
 };
 
 
-static void render_surface(struct wlr_surface *surface, int sx, int sy,
-        void *data) {
-    struct render_data *rdata = data;
+static void render_surface(struct wm_view_surface *entry, struct render_data *rdata) {
     struct wm_output *output = rdata->output;
 
-    struct wlr_texture *texture = wlr_surface_get_texture(surface);
-    if (!texture) {
+    if (!entry->texture) {
         return;
     }
 
     struct wlr_box box = {
-        .x = round((rdata->x + sx * rdata->x_scale) * output->wlr_output->scale),
-        .y = round((rdata->y + sy * rdata->y_scale) * output->wlr_output->scale),
-        .width = round(surface->current.width * rdata->x_scale *
+        .x = round((rdata->x + entry->sx * rdata->x_scale) * output->wlr_output->scale),
+        .y = round((rdata->y + entry->sy * rdata->y_scale) * output->wlr_output->scale),
+        .width = round(entry->width * rdata->x_scale *
                 output->wlr_output->scale),
-        .height = round(surface->current.height * rdata->y_scale *
+        .height = round(entry->height * rdata->y_scale *
                 output->wlr_output->scale)};
 
-    double mask_l = fmax(0., (rdata->mask_x * output->wlr_output->scale) - box.x);
-    double mask_t = fmax(0., (rdata->mask_y * output->wlr_output->scale) - box.y);
-    double mask_r = fmax(0., box.x + box.width - (rdata->mask_x + rdata->mask_w) * output->wlr_output->scale);
-    double mask_b = fmax(0., box.y + box.height - (rdata->mask_y + rdata->mask_h) * output->wlr_output->scale);
-
-
-    double corner_radius = rdata->corner_radius * output->wlr_output->scale;
-    if (sx || sy) {
+    struct wlr_fbox* mask_box = &rdata->mask;
+    double corner_radius = rdata->corner_radius;
+    if (entry->sx || entry->sy) {
         /* Only for surfaces which extend fully */
-        mask_l = 0;
-        mask_t = 0;
-        mask_r = 0;
-        mask_b = 0;
+        mask_box = NULL;
         corner_radius = 0;
     }
-    wm_renderer_render_texture_at(output->wm_server->wm_renderer, rdata->damage, texture, &box,
-                                  rdata->opacity,
-                                  mask_l, mask_t, mask_r, mask_b,
-                                  corner_radius, rdata->lock_perc);
+    wm_renderer_render_texture_at(output->wm_server->wm_renderer, rdata->damage, entry->texture, &box,
+                                  rdata->opacity, mask_box,
+                                  corner_radius);
 
     /* Notify client */
-    wlr_surface_send_frame_done(surface, &rdata->when);
+    wlr_surface_send_frame_done(entry->surface, &rdata->when);
+    wm_output_surface_sampled(output, entry->surface);
 }
 
 
@@ -130,25 +256,30 @@ static void wm_view_render(struct wm_content* super, struct wm_output* output, p
 
     // Firefox starts off as a 1x1 view which causes subsurfaces to be scaled up,
     // that's why we require at least size 2x2 for the root surface
+    double scale = output->wlr_output->scale;
     struct render_data rdata = {
         .output = output,
         .when = now,
         .damage = output_damage,
-        .x = display_x,
-        .y = display_y,
+        .x = display_x - output->layout_x,
+        .y = display_y - output->layout_y,
         .opacity = wm_content_get_opacity(&view->super),
         .x_scale = width > 1 ? display_width / width : 0,
         .y_scale = width > 1 ? display_height / height : 0,
-        .corner_radius = corner_radius,
-        .lock_perc = view->super.lock_enabled ? 0.0 : view->super.wm_server->lock_perc,
-        .mask_x = display_x + mask_x,
-        .mask_y = display_y + mask_y,
-        .mask_w = mask_w,
-        .mask_h = mask_h
+        .mask = {
+            .x = (display_x - output->layout_x + mask_x) * scale,
+            .y = (display_y - output->layout_y + mask_y) * scale,
+            .width = mask_w * scale,
+            .height = mask_h * scale
+        },
+        .corner_radius = corner_radius * scale
     };
 
-
-    wm_view_for_each_surface(view, render_surface, &rdata);
+    int n_surfaces;
+    struct wm_view_surface* surfaces = wm_view_get_surfaces(view, &n_surfaces);
+    for(int i=0; i<n_surfaces; i++){
+        render_surface(&surfaces[i], &rdata);
+    }
 }
 
 
@@ -232,14 +363,176 @@ static void wm_view_damage_output(struct wm_content* super, struct wm_output* ou
 
     struct damage_data ddata = {
         .output = output,
-        .x = display_x,
-        .y = display_y,
+        .x = display_x - output->layout_x,
+        .y = display_y - output->layout_y,
         .x_scale = display_width / width,
         .y_scale = display_height / height,
         .origin = origin
     };
 
-    wm_view_for_each_surface(view, damage_surface, &ddata);
+    int n_surfaces;
+    struct wm_view_surface* surfaces = wm_view_get_surfaces(view, &n_surfaces);
+    for(int i=0; i<n_surfaces; i++){
+        damage_surface(surfaces[i].surface, surfaces[i].sx, surfaces[i].sy, &ddata);
+    }
+}
+
+struct opaque_data {
+    struct wm_output *output;
+    double x;
+    double y;
+    double x_scale;
+    double y_scale;
+    bool root_opaque;
+    struct wlr_fbox mask;
+    pixman_region32_t* region;
+};
+
+static void opaque_surface(struct wlr_surface *surface, int sx, int sy,
+        void *data) {
+    struct opaque_data *odata = data;
+    struct wm_output *output = odata->output;
+
+    if(!wlr_surface_has_buffer(surface)) return;
+    if(!pixman_region32_not_empty(&surface->opaque_region)) return;
+    if(!sx && !sy && !odata->root_opaque) return;
+    if(surface->current.width <= 0 || surface->current.height <= 0) return;
+
+    /* Same as render_surface */
+    struct wlr_box box = {
+        .x = round((odata->x + sx * odata->x_scale) * output->wlr_output->scale),
+        .y = round((odata->y + sy * odata->y_scale) * output->wlr_output->scale),
+        .width = round(surface->current.width * odata->x_scale *
+                output->wlr_output->scale),
+        .height = round(surface->current.height * odata->y_scale *
+                output->wlr_output->scale)};
+
+    double fx = (double)box.width / surface->current.width;
+    double fy = (double)box.height / surface->current.height;
+
+    /* Round inwards; when scaled, filtering may blend in edge pixels */
+    int inset = (box.width != surface->current.width || box.height != surface->current.height) ? 1 : 0;
+
+    int nrects;
+    pixman_box32_t* rects = pixman_region32_rectangles(&surface->opaque_region, &nrects);
+    for(int i=0; i<nrects; i++){
+        double x1 = box.x + ceil(fmax(0, rects[i].x1) * fx) + inset;
+        double y1 = box.y + ceil(fmax(0, rects[i].y1) * fy) + inset;
+        double x2 = box.x + floor(fmin(surface->current.width, rects[i].x2) * fx) - inset;
+        double y2 = box.y + floor(fmin(surface->current.height, rects[i].y2) * fy) - inset;
+
+        /* The mask is only applied to the root surface */
+        if(!sx && !sy){
+            x1 = fmax(x1, ceil(odata->mask.x));
+            y1 = fmax(y1, ceil(odata->mask.y));
+            x2 = fmin(x2, floor(odata->mask.x + odata->mask.width));
+            y2 = fmin(y2, floor(odata->mask.y + odata->mask.height));
+        }
+
+        if(x2 <= x1 || y2 <= y1) continue;
+        pixman_region32_union_rect(odata->region, odata->region, x1, y1, x2 - x1, y2 - y1);
+    }
+}
+
+static void wm_view_opaque_region(struct wm_content* super, struct wm_output* output, pixman_region32_t* region){
+    struct wm_view* view = wm_cast(wm_view, super);
+
+    if (!view->mapped) {
+        return;
+    }
+
+    int width, height;
+    wm_view_get_size(view, &width, &height);
+    if (width <= 1 || height <= 1) {
+        return;
+    }
+
+    double display_x, display_y, display_width, display_height;
+    wm_content_get_box(&view->super, &display_x, &display_y, &display_width,
+            &display_height);
+    double mask_x, mask_y, mask_w, mask_h;
+    wm_content_get_mask(&view->super, &mask_x, &mask_y, &mask_w, &mask_h);
+
+    struct opaque_data odata = {
+        .output = output,
+        .x = display_x - output->layout_x,
+        .y = display_y - output->layout_y,
+        .x_scale = display_width / width,
+        .y_scale = display_height / height,
+        /* Rounded corners only apply to the root surface as well */
+        .root_opaque = wm_content_get_corner_radius(&view->super) * output->wlr_output->scale < 0.001,
+        .mask = {
+            .x = (display_x - output->layout_x + mask_x) * output->wlr_output->scale,
+            .y = (display_y - output->layout_y + mask_y) * output->wlr_output->scale,
+            .width = mask_w * output->wlr_output->scale,
+            .height = mask_h * output->wlr_output->scale
+        },
+        .region = region
+    };
+
+    int n_surfaces;
+    struct wm_view_surface* surfaces = wm_view_get_surfaces(view, &n_surfaces);
+    for(int i=0; i<n_surfaces; i++){
+        opaque_surface(surfaces[i].surface, surfaces[i].sx, surfaces[i].sy, &odata);
+    }
+}
+
+struct wlr_surface* wm_view_get_scanout_surface(struct wm_view* view, struct wm_output* output){
+    if (!view->mapped) {
+        return NULL;
+    }
+
+    if(wm_content_get_opacity(&view->super) < 1. - 0.0001) return NULL;
+    if(wm_content_get_corner_radius(&view->super) > 0.001) return NULL;
+
+    int width, height;
+    wm_view_get_size(view, &width, &height);
+    if (width <= 1 || height <= 1) {
+        return NULL;
+    }
+
+    double display_x, display_y, display_width, display_height;
+    wm_content_get_box(&view->super, &display_x, &display_y, &display_width,
+            &display_height);
+    double mask_x, mask_y, mask_w, mask_h;
+    wm_content_get_mask(&view->super, &mask_x, &mask_y, &mask_w, &mask_h);
+    if(mask_x > 0 || mask_y > 0 || mask_x + mask_w < display_width || mask_y + mask_h < display_height){
+        return NULL;
+    }
+
+    /* No subsurfaces or popups */
+    int n_surfaces;
+    struct wm_view_surface* surfaces = wm_view_get_surfaces(view, &n_surfaces);
+    if(n_surfaces != 1) return NULL;
+
+    struct wlr_surface* surface = surfaces[0].surface;
+    if(!surface->buffer) return NULL;
+    if(surface->current.transform != output->wlr_output->transform) return NULL;
+    if(surface->current.buffer_width != output->wlr_output->width ||
+            surface->current.buffer_height != output->wlr_output->height){
+        return NULL;
+    }
+
+    /* Same as render_surface */
+    double scale = output->wlr_output->scale;
+    struct wlr_box box = {
+        .x = round((display_x - output->layout_x) * scale),
+        .y = round((display_y - output->layout_y) * scale),
+        .width = round(surface->current.width * display_width / width * scale),
+        .height = round(surface->current.height * display_height / height * scale)};
+    if(box.x != 0 || box.y != 0 ||
+            box.width != output->wlr_output->width || box.height != output->wlr_output->height){
+        return NULL;
+    }
+
+    /* Scanout ignores alpha, whereas composition would blend */
+    if(pixman_region32_contains_rectangle(&surface->opaque_region, &(pixman_box32_t){
+                0, 0, surface->current.width, surface->current.height }) != PIXMAN_REGION_IN &&
+            wm_renderer_texture_has_alpha(surface->buffer->texture)){
+        return NULL;
+    }
+
+    return surface;
 }
 
 static void print_surface(struct wlr_surface *surface, int sx, int sy,
@@ -276,5 +569,6 @@ struct wm_content_vtable wm_view_vtable = {
     .destroy = &wm_view_base_destroy,
     .render = &wm_view_render,
     .damage_output = &wm_view_damage_output,
-    .printf = &wm_view_printf
+    .printf = &wm_view_printf,
+    .opaque_region = &wm_view_opaque_region
 };
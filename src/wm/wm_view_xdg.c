@@ -10,12 +10,14 @@
 
 #include "wm/wm_view_xdg.h"
 
+#include "wm/wm_trace.h"
 #include "wm/wm_util.h"
 #include "wm/wm_config.h"
 #include "wm/wm_view.h"
 #include "wm/wm_seat.h"
 #include "wm/wm_server.h"
 #include "wm/wm_layout.h"
+#include "wm/wm_surface_map.h"
 #include "wm/wm.h"
 
 struct wm_view_vtable wm_view_xdg_vtable;
@@ -34,6 +36,7 @@ static void subsurface_handle_map(struct wl_listener* listener, void* data){
 
 static void subsurface_handle_unmap(struct wl_listener* listener, void* data){
     struct wm_xdg_subsurface* subsurface = wl_container_of(listener, subsurface, unmap);
+    subsurface->wm_server->surfaces_generation++;
 
     wm_layout_damage_whole(subsurface->toplevel->super.super.wm_server->wm_layout);
 }
@@ -56,11 +59,15 @@ static void subsurface_handle_new_subsurface(struct wl_listener* listener, void*
 static void subsurface_handle_surface_commit(struct wl_listener* listener, void* data){
     struct wm_xdg_subsurface* subsurface = wl_container_of(listener, subsurface, surface_commit);
 
+    WM_TRACE_BEGIN("client_commit");
+
     wm_layout_damage_from(
             subsurface->toplevel->super.super.wm_server->wm_layout,
             &subsurface->toplevel->super.super,
             subsurface->wlr_subsurface->surface
     );
+
+    WM_TRACE_END("client_commit");
 }
 static void popup_handle_map(struct wl_listener* listener, void* data){
     struct wm_popup_xdg* popup = wl_container_of(listener, popup, map);
@@ -73,6 +80,7 @@ static void popup_handle_map(struct wl_listener* listener, void* data){
 
 static void popup_handle_unmap(struct wl_listener* listener, void* data){
     struct wm_popup_xdg* popup = wl_container_of(listener, popup, unmap);
+    popup->wm_server->surfaces_generation++;
 
     wm_layout_damage_whole(popup->toplevel->super.super.wm_server->wm_layout);
 }
@@ -104,11 +112,15 @@ static void popup_handle_new_subsurface(struct wl_listener* listener, void* data
 static void popup_handle_surface_commit(struct wl_listener* listener, void* data){
     struct wm_popup_xdg* popup = wl_container_of(listener, popup, surface_commit);
 
+    WM_TRACE_BEGIN("client_commit");
+
     wm_layout_damage_from(
             popup->toplevel->super.super.wm_server->wm_layout,
             &popup->toplevel->super.super,
             popup->wlr_xdg_popup->base->surface
     );
+
+    WM_TRACE_END("client_commit");
 }
 
 
@@ -153,6 +165,7 @@ static void handle_map(struct wl_listener* listener, void* data){
     wm_callback_init_view(&view->super);
 
     view->super.mapped = true;
+    view->super.super.wm_server->surfaces_generation++;
 
     wm_layout_damage_from(
         view->super.super.wm_server->wm_layout,
@@ -163,6 +176,7 @@ static void handle_map(struct wl_listener* listener, void* data){
 static void handle_unmap(struct wl_listener* listener, void* data){
     struct wm_view_xdg* view = wl_container_of(listener, view, unmap);
     view->super.mapped = false;
+    view->super.super.wm_server->surfaces_generation++;
     wm_callback_destroy_view(&view->super);
 
     wm_layout_damage_whole(view->super.super.wm_server->wm_layout);
@@ -196,9 +210,16 @@ static void handle_new_subsurface(struct wl_listener* listener, void* data){
 static void handle_surface_commit(struct wl_listener* listener, void* data){
     struct wm_view_xdg* view = wl_container_of(listener, view, surface_commit);
 
+    WM_TRACE_BEGIN("client_commit");
+
     wm_layout_damage_from(
             view->super.super.wm_server->wm_layout,
             &view->super.super, view->wlr_xdg_surface->surface);
+
+    /* Size, title etc. might have changed */
+    wm_server_schedule_update(view->super.super.wm_server);
+
+    WM_TRACE_END("client_commit");
 }
 
 static void handle_fullscreen(struct wl_listener* listener, void* data){
@@ -248,6 +269,10 @@ static void handle_show_window_menu(struct wl_listener* listener, void* data){
 void wm_xdg_subsurface_init(struct wm_xdg_subsurface* subsurface, struct wm_view_xdg* toplevel, struct wlr_subsurface* wlr_subsurface){
     subsurface->toplevel = toplevel;
     subsurface->wlr_subsurface = wlr_subsurface;
+    subsurface->wm_server = toplevel->super.super.wm_server;
+
+    wm_surface_map_insert(subsurface->wm_server->wm_surface_map, wlr_subsurface->surface, &toplevel->super);
+    wm_view_surface_enter(&toplevel->super, wlr_subsurface->surface);
 
     wl_list_init(&subsurface->subsurfaces);
 
@@ -279,6 +304,10 @@ void wm_xdg_subsurface_init(struct wm_xdg_subsurface* subsurface, struct wm_view
 }
 
 void wm_xdg_subsurface_destroy(struct wm_xdg_subsurface* subsurface){
+    subsurface->wm_server->surfaces_generation++;
+    wm_surface_map_remove(subsurface->wm_server->wm_surface_map,
+            subsurface->wlr_subsurface->surface, &subsurface->toplevel->super);
+
     wl_list_remove(&subsurface->link);
     wl_list_remove(&subsurface->subsurfaces);
     wl_list_remove(&subsurface->map.link);
@@ -296,6 +325,10 @@ void wm_popup_xdg_init(struct wm_popup_xdg* popup, struct wm_view_xdg* toplevel,
 
     popup->wlr_xdg_popup = wlr_xdg_popup;
     popup->toplevel = toplevel;
+    popup->wm_server = toplevel->super.super.wm_server;
+
+    wm_surface_map_insert(popup->wm_server->wm_surface_map, wlr_xdg_popup->base->surface, &toplevel->super);
+    wm_view_surface_enter(&toplevel->super, wlr_xdg_popup->base->surface);
 
     wl_list_init(&popup->subsurfaces);
     wl_list_init(&popup->popups);
@@ -357,6 +390,10 @@ void wm_popup_xdg_init(struct wm_popup_xdg* popup, struct wm_view_xdg* toplevel,
 }
 
 void wm_popup_xdg_destroy(struct wm_popup_xdg* popup){
+    popup->wm_server->surfaces_generation++;
+    wm_surface_map_remove(popup->wm_server->wm_surface_map,
+            popup->wlr_xdg_popup->base->surface, &popup->toplevel->super);
+
     wl_list_remove(&popup->link);
     wl_list_remove(&popup->popups);
     wl_list_remove(&popup->subsurfaces);
@@ -380,6 +417,8 @@ void wm_view_xdg_init(struct wm_view_xdg* view, struct wm_server* server, struct
     view->wlr_xdg_surface = surface;
     view->wlr_deco = NULL;
 
+    wm_surface_map_insert(server->wm_surface_map, surface->surface, &view->super);
+
     wl_list_init(&view->popups);
     wl_list_init(&view->subsurfaces);
 
@@ -429,15 +468,21 @@ void wm_view_xdg_init(struct wm_view_xdg* view, struct wm_server* server, struct
         wlr_log(WLR_DEBUG, "View: Adding \"old\" subsurface (below)");
         handle_new_subsurface(&view->new_subsurface, ss);
     }
-    wl_list_for_each(ss, &surface->surface->subsurfaces_below, parent_link){
-        wlr_log(WLR_DEBUG, "View: Adding \"old\" subsurface (below)");
+    wl_list_for_each(ss, &surface->surface->subsurfaces_above, parent_link){
+        wlr_log(WLR_DEBUG, "View: Adding \"old\" subsurface (above)");
         handle_new_subsurface(&view->new_subsurface, ss);
     }
+
+    /* Not placed yet, i.e. the default output */
+    wm_view_update_outputs(&view->super);
 }
 
 static void wm_view_xdg_destroy(struct wm_view* super){
     struct wm_view_xdg* view = wm_cast(wm_view_xdg, super);
 
+    /* Including popups and subsurfaces, should they outlive the view */
+    wm_surface_map_remove_view(super->super.wm_server->wm_surface_map, super);
+
     wl_list_remove(&view->subsurfaces);
     wl_list_remove(&view->popups);
 
@@ -6,12 +6,14 @@
 #include <wlr/util/log.h>
 #include <wlr/xwayland.h>
 
+#include "wm/wm_trace.h"
 #include "wm/wm_util.h"
 #include "wm/wm_view_xwayland.h"
 #include "wm/wm_view.h"
 #include "wm/wm_seat.h"
 #include "wm/wm_server.h"
 #include "wm/wm_layout.h"
+#include "wm/wm_surface_map.h"
 #include "wm/wm.h"
 
 struct wm_view_vtable wm_view_xwayland_vtable;
@@ -87,6 +89,10 @@ static void child_handle_map(struct wl_listener* listener, void* data){
     struct wm_view_xwayland_child* child = wl_container_of(listener, child, map);
     child->mapped = true;
 
+    wm_surface_map_insert(child->parent->super.super.wm_server->wm_surface_map,
+            child->wlr_xwayland_surface->surface, &child->parent->super);
+    wm_view_surface_enter(&child->parent->super, child->wlr_xwayland_surface->surface);
+
     wm_layout_damage_from(
         child->parent->super.super.wm_server->wm_layout,
         &child->parent->super.super, child->wlr_xwayland_surface->surface);
@@ -100,11 +106,18 @@ static void child_handle_request_configure(struct wl_listener* listener, void* d
     struct wlr_xwayland_surface_configure_event* event = data;
 
     wlr_xwayland_surface_configure(child->wlr_xwayland_surface, event->x, event->y, event->width, event->height);
+
+    /* Position is part of the flattened surface tree */
+    child->parent->super.super.wm_server->surfaces_generation++;
 }
 
 static void child_handle_unmap(struct wl_listener* listener, void* data){
     struct wm_view_xwayland_child* child = wl_container_of(listener, child, unmap);
     child->mapped = false;
+    child->parent->super.super.wm_server->surfaces_generation++;
+
+    wm_surface_map_remove(child->parent->super.super.wm_server->wm_surface_map,
+            child->wlr_xwayland_surface->surface, &child->parent->super);
 
     wm_layout_damage_whole(
         child->parent->super.super.wm_server->wm_layout);
@@ -118,9 +131,13 @@ static void child_handle_destroy(struct wl_listener* listener, void* data){
 static void child_handle_surface_commit(struct wl_listener* listener, void* data){
     struct wm_view_xwayland_child* child = wl_container_of(listener, child, surface_commit);
 
+    WM_TRACE_BEGIN("client_commit");
+
     wm_layout_damage_from(
         child->parent->super.super.wm_server->wm_layout,
         &child->parent->super.super, child->wlr_xwayland_surface->surface);
+
+    WM_TRACE_END("client_commit");
 }
 
 static void handle_request_configure(struct wl_listener* listener, void* data){
@@ -153,6 +170,11 @@ static void handle_map(struct wl_listener* listener, void* data){
 
     wm_callback_init_view(&view->super);
     view->super.mapped = true;
+    view->super.super.wm_server->surfaces_generation++;
+
+    wm_surface_map_insert(view->super.super.wm_server->wm_surface_map,
+            view->wlr_xwayland_surface->surface, &view->super);
+    wm_view_update_outputs(&view->super);
 
     wm_layout_damage_from(
         view->super.super.wm_server->wm_layout,
@@ -165,6 +187,11 @@ static void handle_map(struct wl_listener* listener, void* data){
 static void handle_unmap(struct wl_listener* listener, void* data){
     struct wm_view_xwayland* view = wl_container_of(listener, view, unmap);
     view->super.mapped = false;
+    view->super.super.wm_server->surfaces_generation++;
+
+    wm_surface_map_remove(view->super.super.wm_server->wm_surface_map,
+            view->wlr_xwayland_surface->surface, &view->super);
+    wm_view_forget_outputs(&view->super);
     wm_callback_destroy_view(&view->super);
 
     wm_layout_damage_whole(view->super.super.wm_server->wm_layout);
@@ -181,9 +208,16 @@ static void handle_destroy(struct wl_listener* listener, void* data){
 static void handle_surface_commit(struct wl_listener* listener, void* data){
     struct wm_view_xwayland* view = wl_container_of(listener, view, surface_commit);
 
+    WM_TRACE_BEGIN("client_commit");
+
     wm_layout_damage_from(
             view->super.super.wm_server->wm_layout,
             &view->super.super, view->wlr_xwayland_surface->surface);
+
+    /* Size, title etc. might have changed */
+    wm_server_schedule_update(view->super.super.wm_server);
+
+    WM_TRACE_END("client_commit");
 }
 
 
@@ -259,6 +293,9 @@ void wm_view_xwayland_init(struct wm_view_xwayland* view, struct wm_server* serv
 static void wm_view_xwayland_destroy(struct wm_view* super){
     struct wm_view_xwayland* view = wm_cast(wm_view_xwayland, super);
 
+    /* Including surfaces of children */
+    wm_surface_map_remove_view(super->super.wm_server->wm_surface_map, super);
+
     wl_list_remove(&view->request_configure.link);
     wl_list_remove(&view->set_pid.link);
     wl_list_remove(&view->set_parent.link);
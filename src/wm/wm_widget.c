@@ -39,8 +39,8 @@ static void wm_widget_render(struct wm_content* super, struct wm_output* output,
         return;
 
     struct wlr_box box = {
-        .x = round(widget->super.display_x * output->wlr_output->scale),
-        .y = round(widget->super.display_y * output->wlr_output->scale),
+        .x = round((widget->super.display_x - output->layout_x) * output->wlr_output->scale),
+        .y = round((widget->super.display_y - output->layout_y) * output->wlr_output->scale),
         .width = round(widget->super.display_width * output->wlr_output->scale),
         .height =
             round(widget->super.display_height * output->wlr_output->scale)};
@@ -50,16 +50,16 @@ static void wm_widget_render(struct wm_content* super, struct wm_output* output,
     double mask_x, mask_y, mask_w, mask_h;
     wm_content_get_mask(super, &mask_x, &mask_y, &mask_w, &mask_h);
 
-    double mask_l = fmax(0., mask_x * output->wlr_output->scale);
-    double mask_t = fmax(0., mask_y * output->wlr_output->scale);
-    double mask_r = fmax(0., box.width - (mask_x + mask_w) * output->wlr_output->scale);
-    double mask_b = fmax(0., box.height - (mask_y + mask_h) * output->wlr_output->scale);
+    struct wlr_fbox mask = {
+        .x = box.x + mask_x * output->wlr_output->scale,
+        .y = box.y + mask_y * output->wlr_output->scale,
+        .width = mask_w * output->wlr_output->scale,
+        .height = mask_h * output->wlr_output->scale};
 
     wm_renderer_render_texture_at(
             output->wm_server->wm_renderer, output_damage,
             widget->wlr_texture, &box,
-            wm_content_get_opacity(super), mask_l, mask_t, mask_r, mask_b, corner_radius,
-            super->lock_enabled ? 0.0 : super->wm_server->lock_perc);
+            wm_content_get_opacity(super), &mask, corner_radius);
 
 }
 
@@ -70,8 +70,8 @@ static void wm_widget_damage_output(struct wm_content* super, struct wm_output*
 
     double x, y, w, h;
     wm_content_get_box(super, &x, &y, &w, &h);
-    x *= output->wlr_output->scale;
-    y *= output->wlr_output->scale;
+    x = (x - output->layout_x) * output->wlr_output->scale;
+    y = (y - output->layout_y) * output->wlr_output->scale;
     w *= output->wlr_output->scale;
     h *= output->wlr_output->scale;
     pixman_region32_union_rect(&region, &region,